@@ -24,7 +24,9 @@ hash_table *ht_create() {
     hash_table *tbl = malloc(sizeof *tbl);
     tbl->size = INITIAL_SIZE;
     tbl->n_elems = 0;
+    tbl->version = 0;
     tbl->elems = calloc(tbl->size, sizeof *(tbl->elems));
+    tbl->index = NULL;
 
     return tbl;
 }
@@ -34,24 +36,40 @@ size_t get_hash(hash_table *tbl, void *key, size_t key_len) {
     return string_hash(key, key_len) % tbl->size;
 }
 
-/* get the value corresponding to a key,
- * *res is a pointer to the value, belongs to table, so don't free the pointer
- * length of the result is stored in res_len*/
-int ht_get_value(hash_table *tbl, void *key, size_t key_len, void **res, size_t *res_len) {
+/* get the element of a key or NULL, it belongs to the table and is valid
+ * until the table is modified */
+hash_table_elem *ht_find(hash_table *tbl, void *key, size_t key_len) {
     hash_table_elem *list = tbl->elems[get_hash(tbl, key, key_len)];
 
     while (list != NULL) {
         if (list->key_len == key_len && memcmp(list->key, key, key_len) == 0) {
-            *res = list->value;
-            *res_len = list->value_len;
-            return 0;
+            return list;
         }
         list = list->next;
     }
 
-    *res = NULL;
-    *res_len = 0;
-    return -1;
+    return NULL;
+}
+
+/* get the value corresponding to a key,
+ * *res is a pointer to the value, belongs to table, so don't free the pointer
+ * length of the result is stored in res_len*/
+int ht_get_value(hash_table *tbl, void *key, size_t key_len, void **res, size_t *res_len) {
+    hash_table_elem *elem = ht_find(tbl, key, key_len);
+    if (elem == NULL) {
+        *res = NULL;
+        *res_len = 0;
+        return -1;
+    }
+
+    *res = elem->value;
+    *res_len = elem->value_len;
+    return 0;
+}
+
+/* hint the cpu to load the bucket of key, used ahead of batched lookups */
+void ht_prefetch(hash_table *tbl, void *key, size_t key_len) {
+    __builtin_prefetch(&tbl->elems[get_hash(tbl, key, key_len)]);
 }
 
 /* double the size of the array and rehash elements */
@@ -78,6 +96,19 @@ void resize(hash_table *tbl) {
 
 /* set a value of a given key, idempotent */
 int ht_set_value(hash_table *tbl, void *key, size_t key_len, void *value, size_t value_len) {
+    void *copy = malloc(value_len);
+    memcpy(copy, value, value_len);
+
+    if (ht_adopt_value(tbl, key, key_len, copy, value_len) == -1) {
+        free(copy);
+        return -1;
+    }
+    return 0;
+}
+
+/* like ht_set_value, but the table takes ownership of value instead of
+ * copying it. value has to be allocated with malloc */
+int ht_adopt_value(hash_table *tbl, void *key, size_t key_len, void *value, size_t value_len) {
     /* if 3/4 of the elements are full, resize table */
     if (4 * tbl->n_elems > 3 * tbl->size) {
         resize(tbl);
@@ -89,11 +120,9 @@ int ht_set_value(hash_table *tbl, void *key, size_t key_len, void *value, size_t
     while (list != NULL) {
         if (list->key_len == key_len && memcmp(list->key, key, key_len) == 0) {
             free(list->value);
-            /* allocate buffer big enough to hold str + NUL-byte */
-            /* always write NUL-byte */
-            list->value = malloc(value_len);
-            memcpy(list->value, value, value_len);
+            list->value = value;
             list->value_len = value_len;
+            list->version = ++tbl->version;
 
             return 0;
         }
@@ -106,9 +135,15 @@ int ht_set_value(hash_table *tbl, void *key, size_t key_len, void *value, size_t
     memcpy(new_elem->key, key, key_len);
     new_elem->key_len = key_len;
 
-    new_elem->value = malloc(value_len);
-    memcpy(new_elem->value, value, value_len);
+    new_elem->value = value;
     new_elem->value_len = value_len;
+    new_elem->version = ++tbl->version;
+
+    if (tbl->index != NULL && sl_insert(tbl->index, new_elem->key, key_len, new_elem) == -1) {
+        free(new_elem->key);
+        free(new_elem);
+        return -1;
+    }
 
     new_elem->next = tbl->elems[hash];
     tbl->elems[hash] = new_elem;
@@ -132,6 +167,9 @@ int ht_delete_key(hash_table *tbl, void *key, size_t key_len) {
                 prev->next = list->next;
             }
 
+            if (tbl->index != NULL) {
+                sl_remove(tbl->index, key, key_len);
+            }
             free(list->key);
             free(list->value);
             tbl->n_elems--;
@@ -146,8 +184,8 @@ int ht_delete_key(hash_table *tbl, void *key, size_t key_len) {
     return -1;
 }
 
-/* destroy and free hash table */
-void ht_destroy(hash_table *tbl) {
+/* remove all keys, the table keeps its size */
+void ht_clear(hash_table *tbl) {
     for (size_t i = 0; i < tbl->size; i++) {
         hash_table_elem *list = tbl->elems[i];
         while (list != NULL) {
@@ -157,8 +195,46 @@ void ht_destroy(hash_table *tbl) {
             free(list);
             list = elem;
         }
+        tbl->elems[i] = NULL;
+    }
+    tbl->n_elems = 0;
+
+    if (tbl->index != NULL) {
+        sl_clear(tbl->index);
+    }
+}
+
+/* keep the keys in order from now on, so they can be scanned through
+ * tbl->index. Returns -1 if out of memory */
+int ht_enable_index(hash_table *tbl) {
+    if (tbl->index != NULL) {
+        return 0;
+    }
+
+    tbl->index = sl_create();
+    if (tbl->index == NULL) {
+        return -1;
     }
 
+    for (size_t i = 0; i < tbl->size; i++) {
+        for (hash_table_elem *elem = tbl->elems[i]; elem != NULL; elem = elem->next) {
+            if (sl_insert(tbl->index, elem->key, elem->key_len, elem) == -1) {
+                sl_destroy(tbl->index);
+                tbl->index = NULL;
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* destroy and free hash table */
+void ht_destroy(hash_table *tbl) {
+    ht_clear(tbl);
+    if (tbl->index != NULL) {
+        sl_destroy(tbl->index);
+    }
     free(tbl->elems);
     free(tbl);
 }
@@ -1,20 +1,33 @@
 #pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#include "skiplist.h"
+
 typedef struct hash_table_elem {
     void *key;
     size_t key_len;
     void *value;
     size_t value_len;
+    uint64_t version; /* changes with every set, see hash_table.version */
     struct hash_table_elem *next;
 } hash_table_elem;
 
 typedef struct hash_table {
     size_t size;
     size_t n_elems;
+    uint64_t version; /* the last version handed out, versions start at 1 */
     hash_table_elem **elems;
+    skiplist *index;  /* keys in order, NULL unless ht_enable_index was called */
 } hash_table;
 
 hash_table *ht_create();
+hash_table_elem *ht_find(hash_table *tbl, void *key, size_t key_len);
 int ht_get_value(hash_table *tbl, void *key, size_t key_len, void **res, size_t *res_len);
 int ht_set_value(hash_table *tbl, void *key, size_t key_len, void *value, size_t value_len);
+int ht_adopt_value(hash_table *tbl, void *key, size_t key_len, void *value, size_t value_len);
+void ht_prefetch(hash_table *tbl, void *key, size_t key_len);
 int ht_delete_key(hash_table *tbl, void *key, size_t key_len);
+void ht_clear(hash_table *tbl);
+int ht_enable_index(hash_table *tbl);
 void ht_destroy(hash_table *tbl);
@@ -0,0 +1,583 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "stats.h"
+#include "shm_ring.h"
+
+/* load generator for the 6 byte header protocol of the tcp server and the
+ * udp chord nodes.
+ *
+ * closed loop: every connection keeps <depth> requests in flight and sends
+ * the next one as soon as a response arrives.
+ * open loop (-r): requests are scheduled at a fixed rate, latency is
+ * measured from the scheduled send time, so a stalled server is charged
+ * for the requests that should have been sent while it stalled
+ * (coordinated omission).
+ *
+ * -x talks to the unix domain socket of a local server instead of tcp,
+ * together with -m it uses the shared memory channel of that server. */
+
+#define HEADER_LEN 6
+#define MAX_DEPTH 256
+#define MAX_KEY_LEN 256
+#define MAX_KEYS (1 << 24)
+#define RECV_BUF_LEN (1 << 18)
+/* a udp request without response after this long is counted as lost */
+#define UDP_TIMEOUT_NS 1000000000ULL
+
+const uint8_t delete_mask = 1;
+const uint8_t set_mask = 1 << 1;
+const uint8_t get_mask = 1 << 2;
+
+typedef struct options {
+    char *host;
+    char *port;
+    bool udp;
+    char *unix_path;
+    bool shm;
+    int connections;
+    int depth;
+    double rate;       /* requests per second over all connections, 0 = closed loop */
+    double duration;   /* seconds */
+    double get_ratio;
+    size_t n_keys;
+    double zipf_theta; /* 0 = uniform */
+    char *csv_file;
+    size_t value_len;
+} options;
+
+static options opts = {
+    .host = "127.0.0.1",
+    .port = NULL,
+    .udp = false,
+    .unix_path = NULL,
+    .shm = false,
+    .connections = 1,
+    .depth = 1,
+    .rate = 0,
+    .duration = 10,
+    .get_ratio = 0.9,
+    .n_keys = 100000,
+    .zipf_theta = 0,
+    .csv_file = NULL,
+    .value_len = 32
+};
+
+/* keys are either generated or film titles read from a csv file */
+static char **keys;
+static uint16_t *key_lens;
+static size_t n_keys;
+
+static struct addrinfo *servinfo;
+
+/* zipf distributed ranks after gray et al., "quickly generating
+ * billion-record synthetic databases" */
+typedef struct zipf {
+    size_t n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+} zipf;
+
+static zipf zipf_dist;
+
+typedef struct worker {
+    pthread_t thread;
+    int id;
+    uint64_t rng;
+    uint64_t n_requests;
+    uint64_t n_errors;
+    histogram latency_ns;
+} worker;
+
+/* xorshift64*, good enough to pick keys */
+static uint64_t next_random(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 2685821657736338717ULL;
+}
+
+/* uniform double in [0, 1) */
+static double next_double(uint64_t *state) {
+    return (double) (next_random(state) >> 11) / (double) (1ULL << 53);
+}
+
+static double zeta(size_t n, double theta) {
+    double sum = 0;
+    for (size_t i = 1; i <= n; i++) {
+        sum += 1 / pow((double) i, theta);
+    }
+    return sum;
+}
+
+void zipf_init(zipf *z, size_t n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zeta(n, theta);
+    z->eta = (1 - pow(2.0 / (double) n, 1 - theta)) / (1 - zeta(2, theta) / z->zetan);
+}
+
+size_t zipf_next(zipf *z, uint64_t *rng) {
+    double u = next_double(rng);
+    double uz = u * z->zetan;
+
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < 1 + pow(0.5, z->theta)) {
+        return 1;
+    }
+
+    size_t rank = (size_t) ((double) z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
+
+size_t next_key(worker *w) {
+    if (opts.zipf_theta > 0) {
+        return zipf_next(&zipf_dist, &w->rng);
+    }
+    return next_random(&w->rng) % n_keys;
+}
+
+/* generate key0 ... key<n-1> */
+void generate_keys(size_t n) {
+    keys = malloc(n * sizeof *keys);
+    key_lens = malloc(n * sizeof *key_lens);
+    for (size_t i = 0; i < n; i++) {
+        char key[MAX_KEY_LEN];
+        int len = snprintf(key, sizeof key, "key%zu", i);
+        keys[i] = strdup(key);
+        key_lens[i] = (uint16_t) len;
+    }
+    n_keys = n;
+}
+
+/* use the titles, the first column, of a film csv file as keys */
+int read_keys(char *filename) {
+    FILE *file = fopen(filename, "r");
+    if (file == NULL) {
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        return -1;
+    }
+
+    size_t capacity = 64;
+    keys = malloc(capacity * sizeof *keys);
+    key_lens = malloc(capacity * sizeof *key_lens);
+    n_keys = 0;
+
+    char *line = NULL;
+    size_t len = 0;
+    while (getline(&line, &len, file) != -1 && n_keys < MAX_KEYS) {
+        size_t title_len = strcspn(line, ";\n");
+        if (title_len == 0 || title_len > UINT16_MAX) {
+            continue;
+        }
+        if (n_keys == capacity) {
+            capacity *= 2;
+            keys = realloc(keys, capacity * sizeof *keys);
+            key_lens = realloc(key_lens, capacity * sizeof *key_lens);
+        }
+        keys[n_keys] = strndup(line, title_len);
+        key_lens[n_keys] = (uint16_t) title_len;
+        n_keys++;
+    }
+
+    free(line);
+    fclose(file);
+
+    if (n_keys == 0) {
+        fprintf(stderr, "read_keys: no keys in file %s\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+/* write a request for key into msg, returns its length */
+size_t build_request(char *msg, uint8_t action, uint8_t transaction_id, size_t key, char *value, size_t value_len) {
+    uint16_t key_len = key_lens[key];
+    uint16_t num;
+
+    msg[0] = (char) action;
+    msg[1] = (char) transaction_id;
+    num = htons(key_len);
+    memcpy(msg + 2, &num, sizeof num);
+    num = htons((uint16_t) value_len);
+    memcpy(msg + 4, &num, sizeof num);
+    memcpy(msg + HEADER_LEN, keys[key], key_len);
+    memcpy(msg + HEADER_LEN + key_len, value, value_len);
+
+    return HEADER_LEN + key_len + value_len;
+}
+
+/* connect to the unix domain socket of the server, or to its shared memory
+ * listener if shm is given */
+int connect_unix(shm_endpoint *shm) {
+    if (opts.shm) {
+        char path[sizeof ((struct sockaddr_un *) 0)->sun_path];
+        snprintf(path, sizeof path, "%s.shm", opts.unix_path);
+        return shm_connect(path, shm);
+    }
+
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, opts.unix_path, sizeof addr.sun_path - 1);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        fprintf(stderr, "connect: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+int connect_server(shm_endpoint *shm) {
+    if (opts.unix_path != NULL) {
+        return connect_unix(shm);
+    }
+
+    int sock = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* a connected udp socket only receives datagrams from the server */
+    if (connect(sock, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+        fprintf(stderr, "connect: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    if (!opts.udp) {
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof opt);
+    }
+
+    return sock;
+}
+
+void sleep_until(uint64_t deadline_ns) {
+    uint64_t now = now_ns();
+    if (deadline_ns <= now) {
+        return;
+    }
+    struct timespec t;
+    t.tv_sec = (time_t) ((deadline_ns - now) / 1000000000);
+    t.tv_nsec = (long) ((deadline_ns - now) % 1000000000);
+    nanosleep(&t, NULL);
+}
+
+void *run_worker(void *arg) {
+    worker *w = arg;
+    shm_endpoint shm;
+    shm.channel = NULL;
+    int sock = connect_server(&shm);
+    if (sock == -1) {
+        return NULL;
+    }
+    /* responses are announced on the doorbell of a shared memory channel */
+    int recv_fd = shm.channel != NULL ? shm.doorbell : sock;
+
+    char *value = malloc(opts.value_len);
+    memset(value, 'x', opts.value_len);
+    char *request = malloc(HEADER_LEN + UINT16_MAX + opts.value_len);
+    char *recv_buf = malloc(RECV_BUF_LEN);
+    size_t recv_len = 0;
+
+    /* start times of the requests in flight, indexed by transaction id.
+     * tcp answers in order, so head and tail form a fifo */
+    uint64_t started[MAX_DEPTH];
+    bool in_flight[MAX_DEPTH];
+    memset(in_flight, 0, sizeof in_flight);
+    uint8_t head = 0;
+    uint8_t tail = 0;
+    int n_in_flight = 0;
+
+    double interval_ns = opts.rate > 0 ? 1e9 * opts.connections / opts.rate : 0;
+    uint64_t start = now_ns();
+    uint64_t end = start + (uint64_t) (opts.duration * 1e9);
+    uint64_t n_scheduled = 0;
+
+    while (1) {
+        uint64_t now = now_ns();
+        if (now >= end && n_in_flight == 0) {
+            break;
+        }
+        if (now >= end + UDP_TIMEOUT_NS) {
+            w->n_errors += (uint64_t) n_in_flight;
+            break;
+        }
+
+        /* send as many requests as the window and the schedule allow */
+        while (now < end && n_in_flight < opts.depth && !in_flight[tail]) {
+            uint64_t intended = now;
+            if (interval_ns > 0) {
+                intended = start + (uint64_t) ((double) n_scheduled * interval_ns);
+                if (intended > now) {
+                    break;
+                }
+            }
+            n_scheduled++;
+
+            size_t key = next_key(w);
+            size_t len;
+            if (next_double(&w->rng) < opts.get_ratio) {
+                len = build_request(request, get_mask, tail, key, NULL, 0);
+            } else {
+                size_t value_len = opts.value_len;
+                if (value_len > UINT16_MAX) {
+                    value_len = UINT16_MAX;
+                }
+                len = build_request(request, set_mask, tail, key, value, value_len);
+            }
+
+            struct iovec iov = { .iov_base = request, .iov_len = len };
+            if (shm.channel != NULL) {
+                shm_writev(&shm, &iov, 1);
+            } else if (send(sock, request, len, 0) == -1) {
+                fprintf(stderr, "send: %s\n", strerror(errno));
+                w->n_errors++;
+                break;
+            }
+            started[tail] = intended;
+            in_flight[tail] = true;
+            tail = (uint8_t) ((tail + 1) % opts.depth);
+            n_in_flight++;
+            now = now_ns();
+        }
+
+        /* wait for responses, but not past the next scheduled request */
+        int timeout_ms = 100;
+        if (interval_ns > 0 && n_in_flight < opts.depth) {
+            uint64_t next = start + (uint64_t) ((double) n_scheduled * interval_ns);
+            timeout_ms = next > now ? (int) ((next - now) / 1000000) : 0;
+        }
+        if (n_in_flight == 0) {
+            if (interval_ns > 0) {
+                sleep_until(start + (uint64_t) ((double) n_scheduled * interval_ns));
+            }
+            continue;
+        }
+
+        struct pollfd pfd = { .fd = recv_fd, .events = POLLIN, .revents = 0 };
+        if (poll(&pfd, 1, timeout_ms) <= 0) {
+            if (opts.udp) {
+                /* give up on requests that were lost */
+                now = now_ns();
+                for (int i = 0; i < opts.depth; i++) {
+                    if (in_flight[i] && now - started[i] > UDP_TIMEOUT_NS) {
+                        in_flight[i] = false;
+                        n_in_flight--;
+                        w->n_errors++;
+                    }
+                }
+            }
+            continue;
+        }
+
+        ssize_t status;
+        if (shm.channel != NULL) {
+            doorbell_wait(shm.doorbell);
+            if (ring_readable(shm.in) == 0) {
+                continue;
+            }
+            status = shm_recv(&shm, recv_buf + recv_len, RECV_BUF_LEN - recv_len);
+        } else {
+            status = recv(sock, recv_buf + recv_len, RECV_BUF_LEN - recv_len, 0);
+        }
+        if (status <= 0) {
+            if (status == -1) {
+                fprintf(stderr, "recv: %s\n", strerror(errno));
+            }
+            w->n_errors += (uint64_t) n_in_flight;
+            break;
+        }
+        recv_len += (size_t) status;
+        now = now_ns();
+
+        /* consume all complete responses */
+        size_t offset = 0;
+        while (recv_len - offset >= HEADER_LEN) {
+            uint16_t key_len;
+            uint16_t value_len;
+            memcpy(&key_len, recv_buf + offset + 2, sizeof key_len);
+            memcpy(&value_len, recv_buf + offset + 4, sizeof value_len);
+            size_t response_len = HEADER_LEN + ntohs(key_len) + ntohs(value_len);
+            if (recv_len - offset < response_len) {
+                break;
+            }
+
+            uint8_t transaction_id = opts.udp ? (uint8_t) recv_buf[offset + 1] : head;
+            if (transaction_id < opts.depth && in_flight[transaction_id]) {
+                hist_record(&w->latency_ns, now - started[transaction_id]);
+                in_flight[transaction_id] = false;
+                n_in_flight--;
+                w->n_requests++;
+                if (!opts.udp) {
+                    head = (uint8_t) ((head + 1) % opts.depth);
+                }
+            }
+            offset += response_len;
+        }
+        if (opts.udp) {
+            /* every datagram carries exactly one response */
+            offset = recv_len;
+        }
+        memmove(recv_buf, recv_buf + offset, recv_len - offset);
+        recv_len -= offset;
+    }
+
+    free(recv_buf);
+    free(request);
+    free(value);
+    shm_close(&shm);
+    close(sock);
+    return NULL;
+}
+
+void merge_histogram(histogram *dest, histogram *src) {
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        dest->buckets[i] += src->buckets[i];
+    }
+    dest->count += src->count;
+    dest->sum += src->sum;
+    if (src->max > dest->max) {
+        dest->max = src->max;
+    }
+}
+
+void usage(char *name) {
+    printf("usage: %s -p <port> [-h <host>] [-u] [-x <unix path> [-m]] [-c <connections>] [-d <depth>]\n"
+           "       [-r <requests/s>] [-t <seconds>] [-g <get ratio>] [-k <keys>]\n"
+           "       [-z <zipf theta>] [-f <film csv>] [-v <value bytes>]\n"
+           "  -u  use udp instead of tcp\n"
+           "  -x  use the unix domain socket of a local server, -m its shared memory\n"
+           "  -r  open loop at a fixed total rate, default is closed loop\n"
+           "  -z  zipf distributed keys, default is uniform\n"
+           "  -f  use the film titles of a csv file as keys\n", name);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:ux:mc:d:r:t:g:k:z:f:v:")) != -1) {
+        switch (opt) {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 'u': opts.udp = true; break;
+        case 'x': opts.unix_path = optarg; break;
+        case 'm': opts.shm = true; break;
+        case 'c': opts.connections = atoi(optarg); break;
+        case 'd': opts.depth = atoi(optarg); break;
+        case 'r': opts.rate = atof(optarg); break;
+        case 't': opts.duration = atof(optarg); break;
+        case 'g': opts.get_ratio = atof(optarg); break;
+        case 'k': opts.n_keys = (size_t) atol(optarg); break;
+        case 'z': opts.zipf_theta = atof(optarg); break;
+        case 'f': opts.csv_file = optarg; break;
+        case 'v': opts.value_len = (size_t) atol(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if ((opts.port == NULL && opts.unix_path == NULL) || (opts.shm && opts.unix_path == NULL)
+            || (opts.udp && opts.unix_path != NULL) || opts.connections < 1 || opts.depth < 1 || opts.depth > MAX_DEPTH
+            || opts.n_keys < 2 || opts.zipf_theta < 0 || opts.zipf_theta >= 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.csv_file != NULL) {
+        if (read_keys(opts.csv_file) == -1) {
+            return 1;
+        }
+    } else {
+        generate_keys(opts.n_keys < MAX_KEYS ? opts.n_keys : MAX_KEYS);
+    }
+    if (opts.zipf_theta > 0) {
+        zipf_init(&zipf_dist, n_keys, opts.zipf_theta);
+    }
+
+    struct addrinfo hints;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = opts.udp ? SOCK_DGRAM : SOCK_STREAM;
+    int status = opts.port == NULL ? 0 : getaddrinfo(opts.host, opts.port, &hints, &servinfo);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return 1;
+    }
+
+    worker *workers = calloc((size_t) opts.connections, sizeof *workers);
+    uint64_t start = now_ns();
+    for (int i = 0; i < opts.connections; i++) {
+        workers[i].id = i;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (uint64_t) (i + 1);
+        pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+    }
+
+    histogram *latency = calloc(1, sizeof *latency);
+    uint64_t n_requests = 0;
+    uint64_t n_errors = 0;
+    for (int i = 0; i < opts.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        merge_histogram(latency, &workers[i].latency_ns);
+        n_requests += workers[i].n_requests;
+        n_errors += workers[i].n_errors;
+    }
+    double elapsed = (double) (now_ns() - start) / 1e9;
+
+    printf("%s %s, %d connections, depth %d, %s, %zu keys %s, %.0f%% get\n",
+            opts.shm ? "shm" : opts.unix_path != NULL ? "unix" : opts.udp ? "udp" : "tcp",
+            opts.unix_path != NULL ? opts.unix_path : opts.port, opts.connections, opts.depth,
+            opts.rate > 0 ? "open loop" : "closed loop", n_keys,
+            opts.zipf_theta > 0 ? "zipf" : "uniform", opts.get_ratio * 100);
+    printf("requests=%" PRIu64 " errors=%" PRIu64 " throughput=%.0f req/s\n",
+            n_requests, n_errors, (double) n_requests / elapsed);
+    printf("latency_us p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+            (double) hist_percentile(latency, 0.5) / 1e3,
+            (double) hist_percentile(latency, 0.9) / 1e3,
+            (double) hist_percentile(latency, 0.99) / 1e3,
+            (double) hist_percentile(latency, 0.999) / 1e3,
+            (double) latency->max / 1e3);
+
+    free(latency);
+    free(workers);
+    if (servinfo != NULL) {
+        freeaddrinfo(servinfo);
+    }
+    return n_errors > 0;
+}
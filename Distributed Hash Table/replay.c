@@ -0,0 +1,468 @@
+#define _GNU_SOURCE /* ppoll */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "stats.h"
+#include "trace.h"
+
+/* replays a trace recorded with "server -T" against a server over one tcp
+ * connection, in the recorded order. With -u the requests go to a chord
+ * node over udp, responses are matched by transaction id.
+ *
+ * with -s 1 every request is sent at its recorded time, -s 2 at twice the
+ * recorded pace and so on, latency is measured from that time like the
+ * open loop of kvbench. With -s 0 requests are sent as fast as the server
+ * answers, with -d requests in flight.
+ *
+ * values are not recorded, a set sends value_len bytes derived from the
+ * recorded value hash, so equal values in the trace stay equal. */
+
+#define HEADER_LEN 6
+#define EXT_HEADER_LEN (1 + 1 + 4 + 4)
+#define MAX_DEPTH 256
+#define RECV_BUF_LEN (1 << 18)
+/* a udp request without response after this long is counted as lost */
+#define UDP_TIMEOUT_NS 1000000000ULL
+
+const uint8_t delete_mask = 1;
+const uint8_t set_mask = 1 << 1;
+const uint8_t get_mask = 1 << 2;
+const uint8_t batch_mask = 1 << 4;
+const uint8_t ext_len_mask = 1 << 5;
+const uint8_t command_mask = 0x80;
+
+typedef struct options {
+    char *host;
+    char *port;
+    bool udp;
+    double speed; /* 0 = as fast as possible */
+    int depth;
+    char *trace_path;
+} options;
+
+static options opts = {
+    .host = "127.0.0.1",
+    .port = NULL,
+    .udp = false,
+    .speed = 1,
+    .depth = 0,
+    .trace_path = NULL
+};
+
+/* a request that was sent and waits for its response. The transaction id
+ * of a request is its slot in window, over udp responses may complete the
+ * slots out of order */
+typedef struct in_flight {
+    uint64_t due_ns;
+    op_type op;
+    bool done;
+} in_flight;
+
+static in_flight window[MAX_DEPTH];
+static int window_start = 0;
+static int n_in_flight = 0;
+static uint64_t n_lost = 0;
+
+static histogram latency_ns[N_OPS];
+static histogram total_ns;
+
+/* the response stream is parsed in place, a body that does not fit into
+ * the buffer is skipped as it arrives */
+static char recv_buf[RECV_BUF_LEN];
+static size_t recv_start = 0;
+static size_t recv_end = 0;
+static uint64_t skip = 0;
+
+op_type action_op(uint8_t action) {
+    if (action & get_mask) {
+        return OP_GET;
+    }
+    return action & set_mask ? OP_SET : OP_DELETE;
+}
+
+/* account for the response to the request in slot */
+void complete(int slot, uint64_t now) {
+    in_flight *req = &window[slot];
+    hist_record(&latency_ns[req->op], now - req->due_ns);
+    hist_record(&total_ns, now - req->due_ns);
+    req->done = true;
+    while (n_in_flight > 0 && window[window_start].done) {
+        window_start = (window_start + 1) % MAX_DEPTH;
+        n_in_flight--;
+    }
+}
+
+/* give up on udp requests that waited for longer than UDP_TIMEOUT_NS */
+void expire_lost(uint64_t now) {
+    while (n_in_flight > 0 && now - window[window_start].due_ns > UDP_TIMEOUT_NS) {
+        if (!window[window_start].done) {
+            n_lost++;
+        }
+        window_start = (window_start + 1) % MAX_DEPTH;
+        n_in_flight--;
+    }
+}
+
+int connect_server(void) {
+    struct addrinfo hints;
+    struct addrinfo *servinfo;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = opts.udp ? SOCK_DGRAM : SOCK_STREAM;
+
+    int status = getaddrinfo(opts.host, opts.port, &hints, &servinfo);
+    if (status != 0) {
+        fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    int sock = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        goto cleanup;
+    }
+    if (connect(sock, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
+        fprintf(stderr, "connect: %s\n", strerror(errno));
+        close(sock);
+        sock = -1;
+        goto cleanup;
+    }
+
+    if (!opts.udp) {
+        int opt = 1;
+        setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof opt);
+    }
+
+cleanup:
+    freeaddrinfo(servinfo);
+    return sock;
+}
+
+/* fill value with len bytes that only depend on hash */
+void make_value(char *value, uint32_t len, uint64_t hash) {
+    uint64_t state = hash;
+    for (uint32_t i = 0; i < len; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        value[i] = (char) ('a' + (state >> 59) % 26);
+    }
+}
+
+int send_all(int sock, char *data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(sock, data, len, MSG_NOSIGNAL);
+        if (sent == -1) {
+            fprintf(stderr, "send: %s\n", strerror(errno));
+            return -1;
+        }
+        data += sent;
+        len -= (size_t) sent;
+    }
+    return 0;
+}
+
+/* send the request of e, an extended frame if it was recorded as one */
+int send_request(int sock, trace_entry *e, uint8_t transaction_id, char **value, uint32_t *value_cap) {
+    char header[EXT_HEADER_LEN];
+    size_t header_len;
+    header[0] = (char) e->action;
+    header[1] = (char) transaction_id;
+    if (e->action & ext_len_mask) {
+        uint32_t num = htonl(e->key_len);
+        memcpy(header + 2, &num, sizeof num);
+        num = htonl(e->value_len);
+        memcpy(header + 6, &num, sizeof num);
+        header_len = EXT_HEADER_LEN;
+    } else {
+        uint16_t num = htons(e->key_len);
+        memcpy(header + 2, &num, sizeof num);
+        num = htons((uint16_t) e->value_len);
+        memcpy(header + 4, &num, sizeof num);
+        header_len = HEADER_LEN;
+    }
+
+    if (e->value_len > *value_cap) {
+        char *grown = realloc(*value, e->value_len);
+        if (grown == NULL) {
+            fprintf(stderr, "realloc: %s\n", strerror(errno));
+            return -1;
+        }
+        *value = grown;
+        *value_cap = e->value_len;
+    }
+    make_value(*value, e->value_len, e->value_hash);
+
+    if (opts.udp) {
+        /* one datagram */
+        struct iovec iov[3] = {
+            { .iov_base = header, .iov_len = header_len },
+            { .iov_base = e->key, .iov_len = e->key_len },
+            { .iov_base = *value, .iov_len = e->value_len }
+        };
+        struct msghdr msg;
+        memset(&msg, 0, sizeof msg);
+        msg.msg_iov = iov;
+        msg.msg_iovlen = 3;
+        if (sendmsg(sock, &msg, 0) == -1) {
+            fprintf(stderr, "sendmsg: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+
+    if (send_all(sock, header, header_len) == -1 || send_all(sock, e->key, e->key_len) == -1) {
+        return -1;
+    }
+    return send_all(sock, *value, e->value_len);
+}
+
+/* read one datagram and account for its response */
+int read_datagram(int sock) {
+    ssize_t n = recv(sock, recv_buf, sizeof recv_buf, 0);
+    if (n == -1) {
+        /* e.g. a refused datagram, the request is lost */
+        fprintf(stderr, "recv: %s\n", strerror(errno));
+        return 0;
+    }
+    if (n < HEADER_LEN) {
+        return 0;
+    }
+
+    int slot = (uint8_t) recv_buf[1];
+    if ((slot - window_start + MAX_DEPTH) % MAX_DEPTH < n_in_flight && !window[slot].done) {
+        complete(slot, now_ns());
+    }
+    return 0;
+}
+
+/* read what the socket has and account for every complete response,
+ * returns -1 if the server closed the connection */
+int read_responses(int sock) {
+    if (opts.udp) {
+        return read_datagram(sock);
+    }
+    if (recv_start > 0) {
+        memmove(recv_buf, recv_buf + recv_start, recv_end - recv_start);
+        recv_end -= recv_start;
+        recv_start = 0;
+    }
+    ssize_t n = recv(sock, recv_buf + recv_end, sizeof recv_buf - recv_end, 0);
+    if (n <= 0) {
+        fprintf(stderr, "recv: %s\n", n == 0 ? "connection closed" : strerror(errno));
+        return -1;
+    }
+    recv_end += (size_t) n;
+    uint64_t now = now_ns();
+
+    while (recv_start < recv_end) {
+        if (skip > 0) {
+            size_t len = recv_end - recv_start < skip ? recv_end - recv_start : (size_t) skip;
+            recv_start += len;
+            skip -= len;
+            continue;
+        }
+
+        bool ext = recv_buf[recv_start] & ext_len_mask;
+        size_t header_len = ext ? EXT_HEADER_LEN : HEADER_LEN;
+        if (recv_end - recv_start < header_len) {
+            break;
+        }
+        char *header = recv_buf + recv_start;
+        if (ext) {
+            uint32_t key_len;
+            uint32_t value_len;
+            memcpy(&key_len, header + 2, sizeof key_len);
+            memcpy(&value_len, header + 6, sizeof value_len);
+            skip = (uint64_t) ntohl(key_len) + ntohl(value_len);
+        } else {
+            uint16_t key_len;
+            uint16_t value_len;
+            memcpy(&key_len, header + 2, sizeof key_len);
+            memcpy(&value_len, header + 4, sizeof value_len);
+            skip = (uint64_t) ntohs(key_len) + ntohs(value_len);
+        }
+        recv_start += header_len;
+
+        if (n_in_flight == 0) {
+            fprintf(stderr, "replay: response without request\n");
+            return -1;
+        }
+        complete(window_start, now);
+    }
+    return 0;
+}
+
+/* wait until deadline_ns or until a response arrives, a deadline of 0
+ * waits for the response */
+int wait_responses(int sock, uint64_t deadline_ns) {
+    if (opts.udp && n_in_flight > 0) {
+        expire_lost(now_ns());
+        uint64_t lost_ns = window[window_start].due_ns + UDP_TIMEOUT_NS + 1;
+        if (n_in_flight > 0 && (deadline_ns == 0 || lost_ns < deadline_ns)) {
+            deadline_ns = lost_ns;
+        }
+    }
+
+    struct timespec timeout;
+    if (deadline_ns > 0) {
+        uint64_t now = now_ns();
+        if (deadline_ns <= now) {
+            return 0;
+        }
+        timeout.tv_sec = (time_t) ((deadline_ns - now) / 1000000000);
+        timeout.tv_nsec = (long) ((deadline_ns - now) % 1000000000);
+    }
+
+    /* poll would round the timeout to milliseconds */
+    struct pollfd pfd = { .fd = sock, .events = POLLIN, .revents = 0 };
+    int status = ppoll(&pfd, 1, deadline_ns > 0 ? &timeout : NULL, NULL);
+    if (status == -1 && errno != EINTR) {
+        fprintf(stderr, "poll: %s\n", strerror(errno));
+        return -1;
+    }
+    if (status > 0) {
+        return read_responses(sock);
+    }
+    return 0;
+}
+
+void print_latency(char *name, histogram *h) {
+    if (h->count == 0) {
+        return;
+    }
+    printf("%s n=%" PRIu64 " latency_us p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+            name, h->count,
+            (double) hist_percentile(h, 0.5) / 1e3,
+            (double) hist_percentile(h, 0.9) / 1e3,
+            (double) hist_percentile(h, 0.99) / 1e3,
+            (double) hist_percentile(h, 0.999) / 1e3,
+            (double) h->max / 1e3);
+}
+
+void usage(char *name) {
+    printf("usage: %s -p <port> [-h <host>] [-u] [-s <speed>] [-d <depth>] <trace>\n"
+           "  -u  use udp instead of tcp, for chord nodes\n"
+           "  -s  1 replays at the recorded pace (default), 2 twice as fast, 0 as fast as possible\n"
+           "  -d  requests in flight, default 1 with -s 0 and %d otherwise\n", name, MAX_DEPTH);
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "h:p:us:d:")) != -1) {
+        switch (opt) {
+        case 'h': opts.host = optarg; break;
+        case 'p': opts.port = optarg; break;
+        case 'u': opts.udp = true; break;
+        case 's': opts.speed = atof(optarg); break;
+        case 'd': opts.depth = atoi(optarg); break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (opts.depth == 0) {
+        opts.depth = opts.speed > 0 ? MAX_DEPTH : 1;
+    }
+    if (opts.port == NULL || optind != argc - 1 || opts.speed < 0 || opts.depth < 1 || opts.depth > MAX_DEPTH) {
+        usage(argv[0]);
+        return 1;
+    }
+    opts.trace_path = argv[optind];
+
+    FILE *file = trace_open_read(opts.trace_path);
+    if (file == NULL) {
+        return 1;
+    }
+    int sock = connect_server();
+    if (sock == -1) {
+        fclose(file);
+        return 1;
+    }
+
+    trace_entry *e = malloc(sizeof *e);
+    char *value = NULL;
+    uint32_t value_cap = 0;
+    uint64_t n_requests = 0;
+    uint64_t n_skipped = 0;
+    uint64_t traced_ns = 0;
+    int status = 0;
+    uint64_t start = now_ns();
+
+    int read_status;
+    while ((read_status = trace_read(file, e)) == 1) {
+        /* commands and batches are not recorded as such, skip what we can not replay */
+        if (e->action & (command_mask | batch_mask) || !(e->action & (get_mask | set_mask | delete_mask))) {
+            n_skipped++;
+            continue;
+        }
+
+        uint64_t due = start;
+        if (opts.speed > 0) {
+            due += (uint64_t) ((double) e->arrival_ns / opts.speed);
+        }
+        while (n_in_flight == opts.depth || (opts.speed > 0 && now_ns() < due)) {
+            if (wait_responses(sock, n_in_flight == opts.depth ? 0 : due) == -1) {
+                status = 1;
+                goto cleanup;
+            }
+        }
+        if (!(opts.speed > 0)) {
+            due = now_ns();
+        }
+
+        int slot = (window_start + n_in_flight) % MAX_DEPTH;
+        if (send_request(sock, e, (uint8_t) slot, &value, &value_cap) == -1) {
+            status = 1;
+            goto cleanup;
+        }
+        in_flight *req = &window[slot];
+        req->due_ns = due;
+        req->op = action_op(e->action);
+        req->done = false;
+        n_in_flight++;
+        n_requests++;
+        traced_ns = e->arrival_ns;
+    }
+    if (read_status == -1) {
+        fprintf(stderr, "replay: %s is cut off, replaying what was read\n", opts.trace_path);
+    }
+
+    while (n_in_flight > 0) {
+        if (wait_responses(sock, 0) == -1) {
+            status = 1;
+            goto cleanup;
+        }
+    }
+
+    double elapsed = (double) (now_ns() - start) / 1e9;
+    printf("trace %s, %" PRIu64 " requests over %.3f s recorded, %" PRIu64 " skipped\n",
+            opts.trace_path, n_requests, (double) traced_ns / 1e9, n_skipped);
+    printf("replayed in %.3f s, %s, depth %d, throughput=%.0f req/s, lost=%" PRIu64 "\n", elapsed,
+            opts.speed > 0 ? "paced" : "max speed", opts.depth, (double) n_requests / elapsed, n_lost);
+    print_latency("get", &latency_ns[OP_GET]);
+    print_latency("set", &latency_ns[OP_SET]);
+    print_latency("delete", &latency_ns[OP_DELETE]);
+    print_latency("all", &total_ns);
+
+cleanup:
+    free(value);
+    free(e);
+    close(sock);
+    fclose(file);
+    return status;
+}
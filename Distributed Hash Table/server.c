@@ -1,79 +1,931 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* sched_setaffinity */
+#endif
 #include <stdlib.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <endian.h>
+#include <sched.h>
 
 #include "hash_table.h"
-#define BUF_LEN 1 << 16
+#include "stats.h"
+#include "shm_ring.h"
+#include "upgrade.h"
+#include "trace.h"
+#include "log.h"
+
 #define HEADER_LEN 6
+/* header of a frame with 32 bit key and value lengths */
+#define EXT_HEADER_LEN (1 + 1 + 4 + 4)
+/* largest value accepted in an extended frame */
+#define MAX_EXT_VALUE_LEN (1UL << 30)
+/* maximum length of the text returned by a stats request */
+#define STATS_LEN 4096
+/* a receive buffer holds at least one complete request */
+#define CONN_BUF_LEN (HEADER_LEN + 2 * UINT16_MAX)
+/* number of receive buffers allocated at once */
+#define SLAB_BUFFERS 4
+/* maximum number of clients served at the same time */
+#define MAX_CONNS 1024
+/* queued response bytes above which the requests of a connection wait
+ * until the client read some of them */
+#define CONN_OUT_LIMIT (1UL << 20)
+/* number of batched operations whose responses are sent with one writev */
+#define BATCH_CHUNK 128
+/* maximum number of keys and prefixes one connection watches */
+#define MAX_WATCHES 64
+/* distinct changed keys a subscriber may fall behind by before they are
+ * dropped for a single overflow notification */
+#define MAX_PENDING_NOTIFICATIONS 4096
+/* recent requests per client whose responses are kept for retries */
+#define IDEM_WINDOW 64
+/* maximum number of clients with cached responses */
+#define MAX_IDEM_CLIENTS 4096
+/* maximum number of replicas streaming from this server */
+#define MAX_REPLICAS 16
+/* bytes a replica may fall behind by before it gets a new snapshot */
+#define REPL_BACKLOG_LEN (16UL << 20)
+/* snapshot bytes queued for a replica per round of the event loop */
+#define REPL_CHUNK (256UL << 10)
+/* how long a server that handed over to its successor serves its clients */
+#define DRAIN_TIMEOUT_NS (30ULL * 1000000000)
+/* poll timeout in milliseconds while draining */
+#define DRAIN_POLL_MS 100
 
 const uint8_t delete_mask = 1;
 const uint8_t set_mask = 1 << 1;
 const uint8_t get_mask = 1 << 2;
 const uint8_t acknowledgment_mask = 1 << 3;
-const uint8_t reserved_mask = 0xF0;
+/* a batch frame carries several requests, see serve_batch */
+const uint8_t batch_mask = 1 << 4;
+/* an extended frame has 32 bit lengths, see serve_ext */
+const uint8_t ext_len_mask = 1 << 5;
+/* ask for the counters and latency percentiles, see serve_stats */
+const uint8_t stats_mask = 1 << 6;
+/* a command frame, the other bits except the acknowledgment bit hold a
+ * command_code, see serve_command */
+const uint8_t command_mask = 0x80;
 
-void serve(int sock, hash_table *tbl) {
-    struct sockaddr_storage their_addr;
-    socklen_t addr_size;
-    int conn_sock;
-    ssize_t status;
+typedef enum command_code {
+    CMD_REPLICATE = 1,     /* turn the connection into a replication stream */
+    CMD_SNAPSHOT = 2,      /* sent to a replica ahead of a snapshot, clears its table */
+    CMD_SET_IF_ABSENT = 3, /* atomic operations, see serve_atomic */
+    CMD_CAS = 4,
+    CMD_INCR = 5,
+    CMD_DECR = 6,
+    CMD_SCAN = 7,          /* list keys in order, see serve_scan */
+    CMD_WATCH = 0x10,      /* subscribe to changes, see serve_watch */
+    CMD_NOTIFY = 0x11,     /* pushed to a subscriber when a watched key changed */
+    CMD_IDEMPOTENT = 0x12  /* a set or delete that is executed once, see serve_idempotent */
+} command_code;
 
-    addr_size = sizeof their_addr;
-    conn_sock = accept(sock, (struct sockaddr *)&their_addr, &addr_size);
-    if (conn_sock == -1) {
-        fprintf(stderr, "accept: %s\n", strerror(errno));
-        return ;
+/* flags of a scan request */
+const uint8_t scan_values_flag = 1;
+const uint8_t scan_prefix_flag = 1 << 1;
+
+/* flags of a watch request */
+const uint8_t watch_prefix_flag = 1;
+const uint8_t unwatch_flag = 1 << 1;
+
+/* a receive buffer is owned by one connection. Requests are read with as
+ * few large recv calls as possible and parsed in place, key and value stay
+ * slices of data until they are handed to the table */
+typedef struct conn_buffer {
+    char data[CONN_BUF_LEN];
+    size_t start; /* first byte that was not parsed yet */
+    size_t end;   /* one past the last received byte */
+    uint64_t recv_ns; /* time of the last recv, see now_ns */
+    struct conn_buffer *next_free;
+} conn_buffer;
+
+/* unused receive buffers, allocated SLAB_BUFFERS at a time */
+static conn_buffer *free_buffers = NULL;
+
+/* take a buffer from the pool, returns NULL if out of memory */
+conn_buffer *buffer_get(void) {
+    if (free_buffers == NULL) {
+        conn_buffer *slab = malloc(SLAB_BUFFERS * sizeof *slab);
+        if (slab == NULL) {
+            return NULL;
+        }
+        for (int i = 0; i < SLAB_BUFFERS; i++) {
+            slab[i].next_free = free_buffers;
+            free_buffers = &slab[i];
+        }
     }
 
-    char recv_key_buffer[BUF_LEN];
-    char recv_value_buffer[BUF_LEN];
-    char header_buffer[HEADER_LEN];
+    conn_buffer *buf = free_buffers;
+    free_buffers = buf->next_free;
+    buf->start = 0;
+    buf->end = 0;
+    buf->recv_ns = 0;
+    buf->next_free = NULL;
+    return buf;
+}
+
+/* return a buffer to the pool */
+void buffer_put(conn_buffer *buf) {
+    buf->next_free = free_buffers;
+    free_buffers = buf;
+}
+
+/* the server accepts clients on tcp, a unix domain socket and a unix
+ * domain socket that hands out shared memory channels. A new server
+ * taking over connects to the upgrade socket, see hand_over */
+typedef enum listener_type {
+    LISTEN_TCP,
+    LISTEN_UNIX,
+    LISTEN_SHM,
+    LISTEN_UPGRADE,
+    N_LISTENERS
+} listener_type;
 
-    status = recv(conn_sock, header_buffer, sizeof header_buffer, MSG_WAITALL);
-    if (status == -1) {
-        fprintf(stderr, "recv: %s\n", strerror(errno));
-        goto close_conn_sock;
+/* returned instead of 0 or -1 if the buffered input ends in an incomplete
+ * request. Nothing of it was applied, it is parsed again from its header
+ * once more input arrived */
+#define INCOMPLETE 1
+
+/* a key or key prefix a connection watches */
+typedef struct watch {
+    char *key;
+    size_t key_len;
+    bool prefix;
+    struct watch *next;
+} watch;
+
+/* a connection that watches keys. Notifications wait in pending, one per
+ * key with the latest event, until the socket took all responses, so a
+ * subscriber that lags behind gets every changed key once instead of
+ * every change */
+typedef struct subscriber {
+    watch *watches;
+    int n_watches;
+    hash_table *pending;   /* changed key -> event */
+    size_t cursor;         /* bucket of pending to look at next */
+    bool overflow;         /* pending was dropped, tell the client once */
+    char out[HEADER_LEN + UINT16_MAX + 1]; /* the next notification */
+    struct subscriber *next;
+} subscriber;
+
+static subscriber *subscribers = NULL;
+
+/* a client, either connected by a socket or by a shared memory channel.
+ * Sockets are non-blocking: a request is only served once it arrived
+ * completely and what the client does not read right away is queued in
+ * out, so no client holds up the others */
+typedef struct connection {
+    int sock;         /* for shared memory clients the control socket */
+    shm_endpoint shm; /* shm.channel is NULL for socket clients */
+    conn_buffer *buf;
+    bool partial;     /* buf ends in an incomplete request */
+    char *value;      /* the value of an extended set while it arrives, see serve_ext */
+    size_t value_received;
+    char *out;        /* responses that were not sent yet */
+    size_t out_start;
+    size_t out_end;
+    size_t out_cap;
+    bool primary;     /* the replication stream of our primary, see serve_command */
+    bool predecessor; /* the changes of the server we took over from */
+    subscriber *sub;  /* NULL until the client watches a key */
+} connection;
+
+/* a value too large for the backlog, it is sent from its own copy right
+ * after the backlog byte before offset at */
+typedef struct repl_value {
+    char *data;
+    size_t len;
+    size_t sent;
+    size_t at;
+    struct repl_value *next;
+} repl_value;
+
+/* a replica attached to this server. Applied changes are queued in backlog
+ * and written whenever the socket takes them, so a slow replica never
+ * blocks the event loop. A replica that falls behind by more than the
+ * backlog is resynchronized with a new snapshot once the backlog drained */
+typedef struct replica {
+    int sock;
+    char *backlog;
+    size_t start;         /* first byte that was not sent yet */
+    size_t end;           /* one past the last queued byte */
+    repl_value *values;   /* large values in the order they are sent */
+    repl_value *last_value;
+    size_t values_len;    /* bytes of large values that were not sent yet */
+    uint64_t behind_ns;   /* time the backlog last stopped being empty */
+    bool resync;          /* changes were dropped, a snapshot has to follow */
+    bool in_snapshot;
+    size_t cursor;        /* next bucket of the snapshot */
+    size_t snapshot_size; /* size of the table when the snapshot started */
+    uint64_t resyncs;
+    uint64_t skipped;     /* keys a snapshot could not queue, the replica misses them */
+} replica;
+
+static replica replicas[MAX_REPLICAS];
+static int n_replicas = 0;
+
+/* a replica only takes changes from its primary */
+static bool read_only = false;
+/* frames received from the primary and when the last one arrived */
+static uint64_t repl_applied = 0;
+static uint64_t repl_applied_ns = 0;
+
+/* set once the listeners were handed to a new server, the event loop
+ * ends when the last client is gone or at drain_deadline_ns */
+static bool draining = false;
+static uint64_t drain_deadline_ns = 0;
+
+/* low latency mode: client sockets busy poll for busy_poll_us and the
+ * event loop spins on poll instead of sleeping in it */
+static int busy_poll_us = 0;
+static bool spin = false;
+
+/* every get, set and delete is recorded here unless it is NULL */
+static trace_writer *trace = NULL;
+
+/* false for clients of a replica */
+bool conn_writable(connection *conn) {
+    return !read_only || conn->primary;
+}
+
+/* true if a frame with this value can never fit into the backlog */
+bool repl_is_large(size_t key_len, size_t value_len) {
+    return EXT_HEADER_LEN + key_len + value_len > REPL_BACKLOG_LEN;
+}
+
+/* bytes queued for r, in the backlog and in large values */
+size_t repl_queued(replica *r) {
+    return r->end - r->start + r->values_len;
+}
+
+/* queue a frame for r, an ordinary one if the lengths fit into 16 bits and an
+ * extended one otherwise. The value of a large frame is copied aside and only
+ * its header and key go into the backlog. Returns -1 if the backlog has no
+ * room for it or large values of more than MAX_EXT_VALUE_LEN bytes are
+ * already waiting */
+int repl_queue(replica *r, char action, void *key, size_t key_len, void *value, size_t value_len) {
+    bool ext = key_len > UINT16_MAX || value_len > UINT16_MAX;
+    bool large = repl_is_large(key_len, value_len);
+    size_t header_len = ext ? EXT_HEADER_LEN : HEADER_LEN;
+    size_t len = header_len + key_len + (large ? 0 : value_len);
+
+    if (REPL_BACKLOG_LEN - r->end < len && r->start > 0) {
+        memmove(r->backlog, r->backlog + r->start, r->end - r->start);
+        for (repl_value *v = r->values; v != NULL; v = v->next) {
+            v->at -= r->start;
+        }
+        r->end -= r->start;
+        r->start = 0;
+    }
+    if (REPL_BACKLOG_LEN - r->end < len) {
+        return -1;
+    }
+    if (large && r->values_len > 0 && r->values_len + value_len > MAX_EXT_VALUE_LEN) {
+        return -1;
     }
 
-    /* discard malformed packages */
-    if (status != HEADER_LEN) {
-        goto close_conn_sock;
+    repl_value *v = NULL;
+    if (large) {
+        v = malloc(sizeof *v);
+        if (v == NULL || (v->data = malloc(value_len)) == NULL) {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            free(v);
+            return -1;
+        }
+        memcpy(v->data, value, value_len);
+        v->len = value_len;
+        v->sent = 0;
+        v->at = r->end + len;
+        v->next = NULL;
+    }
+    if (repl_queued(r) == 0) {
+        r->behind_ns = now_ns();
     }
 
-    /* recv request */
-    char action = header_buffer[0];
-    uint16_t recv_key_len;
-    memcpy(&recv_key_len, header_buffer + 2, sizeof recv_key_len);
-    recv_key_len = ntohs(recv_key_len);
+    char *frame = r->backlog + r->end;
+    frame[0] = ext ? (char) (action | ext_len_mask) : action;
+    frame[1] = 0; /* transaction_id, replicas do not answer */
+    if (ext) {
+        uint32_t num = htonl((uint32_t) key_len);
+        memcpy(frame + 2, &num, sizeof num);
+        num = htonl((uint32_t) value_len);
+        memcpy(frame + 6, &num, sizeof num);
+    } else {
+        uint16_t num = htons((uint16_t) key_len);
+        memcpy(frame + 2, &num, sizeof num);
+        num = htons((uint16_t) value_len);
+        memcpy(frame + 4, &num, sizeof num);
+    }
+    if (key_len > 0) {
+        memcpy(frame + header_len, key, key_len);
+    }
+    if (value_len > 0 && !large) {
+        memcpy(frame + header_len + key_len, value, value_len);
+    }
+    r->end += len;
 
-    uint16_t recv_value_len;
-    memcpy(&recv_value_len, header_buffer + 4, sizeof recv_value_len);
-    recv_value_len = ntohs(recv_value_len);
+    if (large) {
+        if (r->values == NULL) {
+            r->values = v;
+        } else {
+            r->last_value->next = v;
+        }
+        r->last_value = v;
+        r->values_len += value_len;
+    }
 
-    if (recv_key_len > 0) {
-        status = recv(conn_sock, recv_key_buffer, recv_key_len, MSG_WAITALL);
-        if (status == -1) {
-            fprintf(stderr, "recv: %s\n", strerror(errno));
-            goto close_conn_sock;
+    return 0;
+}
+
+/* queue a change that was applied to the table for every replica */
+void repl_feed(char action, void *key, size_t key_len, void *value, size_t value_len) {
+    for (int i = 0; i < n_replicas; i++) {
+        replica *r = &replicas[i];
+        if (r->resync) {
+            continue; /* the next snapshot includes this change */
+        }
+        if (repl_queue(r, action, key, key_len, value, value_len) == -1) {
+            r->resync = true;
+            r->in_snapshot = false;
+            r->resyncs++;
+        }
+    }
+}
+
+/* start a snapshot, the replica clears its table when it reads the first frame */
+void repl_start_snapshot(replica *r, hash_table *tbl) {
+    char action = (char) (command_mask | CMD_SNAPSHOT);
+    r->resync = repl_queue(r, action, NULL, 0, NULL, 0) == -1;
+    r->in_snapshot = !r->resync;
+    r->cursor = 0;
+    r->snapshot_size = tbl->size;
+    r->skipped = 0;
+}
+
+/* queue the next buckets of the snapshot, about REPL_CHUNK bytes at a time.
+ * A change to a bucket that was already sent is queued behind it as usual
+ * and a key in a later bucket is sent with its value at that time, so the
+ * replica ends up with the current table. A resize moves keys between
+ * buckets, then the snapshot starts over */
+void repl_snapshot_step(replica *r, hash_table *tbl) {
+    if (r->snapshot_size != tbl->size) {
+        r->cursor = 0;
+        r->snapshot_size = tbl->size;
+    }
+
+    while (r->cursor < tbl->size && repl_queued(r) < REPL_CHUNK) {
+        /* a bucket is queued completely or not at all */
+        size_t len = 0;
+        size_t values_len = 0;
+        for (hash_table_elem *elem = tbl->elems[r->cursor]; elem != NULL; elem = elem->next) {
+            if (repl_is_large(elem->key_len, elem->value_len)) {
+                len += EXT_HEADER_LEN + elem->key_len;
+                values_len += elem->value_len;
+            } else {
+                len += EXT_HEADER_LEN + elem->key_len + elem->value_len;
+            }
+        }
+        if (len > REPL_BACKLOG_LEN - (r->end - r->start) && r->end > r->start) {
+            return;
+        }
+        if (values_len > MAX_EXT_VALUE_LEN - r->values_len && r->values_len > 0) {
+            return;
+        }
+
+        for (hash_table_elem *elem = tbl->elems[r->cursor]; elem != NULL; elem = elem->next) {
+            if (repl_queue(r, (char) set_mask, elem->key, elem->key_len, elem->value, elem->value_len) == -1) {
+                r->skipped++;
+            }
+        }
+        r->cursor++;
+    }
+
+    if (r->cursor == tbl->size) {
+        r->in_snapshot = false;
+    }
+}
+
+/* true if the event loop has to wait until the socket of r is writable */
+bool repl_wants_write(replica *r) {
+    return repl_queued(r) > 0 || r->in_snapshot || r->resync;
+}
+
+/* move the snapshot along and send as much of the backlog as the socket
+ * takes without blocking, returns -1 if the replica is gone */
+int repl_pump(replica *r, hash_table *tbl) {
+    if (r->resync && repl_queued(r) == 0) {
+        repl_start_snapshot(r, tbl);
+    }
+    if (r->in_snapshot) {
+        repl_snapshot_step(r, tbl);
+    }
+
+    while (repl_queued(r) > 0) {
+        /* the backlog up to the next large value, then the value itself */
+        repl_value *v = r->values;
+        char *data = r->backlog + r->start;
+        size_t len = (v != NULL ? v->at : r->end) - r->start;
+        if (len == 0) {
+            data = v->data + v->sent;
+            len = v->len - v->sent;
+        }
+
+        ssize_t sent = send(r->sock, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            fprintf(stderr, "send: %s\n", strerror(errno));
+            return -1;
+        }
+        if (data != r->backlog + r->start) {
+            v->sent += (size_t) sent;
+            r->values_len -= (size_t) sent;
+            if (v->sent == v->len) {
+                r->values = v->next;
+                free(v->data);
+                free(v);
+            }
+        } else {
+            r->start += (size_t) sent;
+        }
+    }
+
+    if (r->start == r->end && r->values == NULL) {
+        r->start = 0;
+        r->end = 0;
+    }
+    return 0;
+}
+
+/* stream the table, unless the replica already has it, and then all
+ * changes to the replica on sock. Returns -1 if no replica can be added */
+int repl_attach(int sock, hash_table *tbl, bool snapshot) {
+    if (n_replicas == MAX_REPLICAS) {
+        return -1;
+    }
+
+    replica *r = &replicas[n_replicas];
+    memset(r, 0, sizeof *r);
+    r->sock = sock;
+    r->backlog = malloc(REPL_BACKLOG_LEN);
+    if (r->backlog == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return -1;
+    }
+    if (snapshot) {
+        repl_start_snapshot(r, tbl);
+    }
+    n_replicas++;
+
+    return 0;
+}
+
+void repl_detach(int i) {
+    close(replicas[i].sock);
+    free(replicas[i].backlog);
+    while (replicas[i].values != NULL) {
+        repl_value *v = replicas[i].values;
+        replicas[i].values = v->next;
+        free(v->data);
+        free(v);
+    }
+    replicas[i] = replicas[n_replicas - 1];
+    n_replicas--;
+}
+
+/* describe the replication state for serve_stats. The lag of a replica is
+ * the number of queued bytes and how long it has been behind. A replica
+ * that misses keys a snapshot skipped stays out of sync until the next one */
+size_t repl_dump(char *out, size_t out_len) {
+    uint64_t now = now_ns();
+    size_t len = 0;
+    int status;
+
+    if (read_only) {
+        status = snprintf(out, out_len, "replica applied=%llu last_applied_ms=%llu\n",
+                (unsigned long long) repl_applied,
+                (unsigned long long) (repl_applied_ns ? (now - repl_applied_ns) / 1000000 : 0));
+        if (status > 0) {
+            len += (size_t) status < out_len ? (size_t) status : out_len - 1;
+        }
+    }
+
+    for (int i = 0; i < n_replicas && len + 1 < out_len; i++) {
+        replica *r = &replicas[i];
+        size_t queued = repl_queued(r);
+        status = snprintf(out + len, out_len - len,
+                "replica %d backlog=%zu lag_us=%llu snapshot=%d resyncs=%llu skipped=%llu in_sync=%d\n",
+                i, queued, (unsigned long long) (queued > 0 ? (now - r->behind_ns) / 1000 : 0),
+                r->in_snapshot || r->resync, (unsigned long long) r->resyncs,
+                (unsigned long long) r->skipped, !r->in_snapshot && !r->resync && r->skipped == 0);
+        if (status > 0) {
+            len += (size_t) status < out_len - len ? (size_t) status : out_len - len - 1;
+        }
+    }
+
+    return len;
+}
+
+bool watch_matches(watch *w, char *key, size_t key_len) {
+    if (w->prefix) {
+        return key_len >= w->key_len && memcmp(key, w->key, w->key_len) == 0;
+    }
+    return key_len == w->key_len && memcmp(key, w->key, key_len) == 0;
+}
+
+/* remember a change of key for every subscriber that watches it */
+void watch_notify(char event, char *key, size_t key_len) {
+    for (subscriber *sub = subscribers; sub != NULL; sub = sub->next) {
+        if (sub->overflow) {
+            continue; /* the client re-reads everything anyway */
+        }
+        for (watch *w = sub->watches; w != NULL; w = w->next) {
+            if (!watch_matches(w, key, key_len)) {
+                continue;
+            }
+            /* a key that is already pending only updates its event */
+            bool pending = ht_find(sub->pending, key, key_len) != NULL;
+            if ((!pending && sub->pending->n_elems == MAX_PENDING_NOTIFICATIONS)
+                    || ht_set_value(sub->pending, key, key_len, &event, 1) == -1) {
+                ht_clear(sub->pending);
+                sub->overflow = true;
+            }
+            break;
+        }
+    }
+}
+
+/* a table change that replicas and subscribers are told about */
+void publish_change(char action, char *key, size_t key_len, void *value, size_t value_len) {
+    repl_feed(action, key, key_len, value, value_len);
+    watch_notify(action, key, key_len);
+}
+
+/* true if the subscriber has notifications that were not sent yet */
+bool sub_wants_write(subscriber *sub) {
+    return sub->pending->n_elems > 0 || sub->overflow;
+}
+
+/* build the next notification in out and return its length, an overflow
+ * is a notification without key */
+size_t sub_next_notification(subscriber *sub) {
+    char *key = NULL;
+    size_t key_len = 0;
+    char event = 0;
+    hash_table_elem *elem = NULL;
+
+    if (!sub->overflow) {
+        while (sub->pending->elems[sub->cursor % sub->pending->size] == NULL) {
+            sub->cursor++;
+        }
+        elem = sub->pending->elems[sub->cursor % sub->pending->size];
+        key = elem->key;
+        key_len = elem->key_len;
+        event = *(char *) elem->value;
+    }
+
+    uint16_t num;
+    sub->out[0] = (char) (command_mask | CMD_NOTIFY);
+    sub->out[1] = 0; /* transaction_id */
+    num = htons((uint16_t) key_len);
+    memcpy(sub->out + 2, &num, sizeof num);
+    num = htons(sub->overflow ? 0 : 1);
+    memcpy(sub->out + 4, &num, sizeof num);
+    if (key_len > 0) {
+        memcpy(sub->out + HEADER_LEN, key, key_len);
+    }
+    sub->out[HEADER_LEN + key_len] = event;
+    size_t len = HEADER_LEN + key_len + (sub->overflow ? 0 : 1);
+
+    if (elem != NULL) {
+        ht_delete_key(sub->pending, key, key_len);
+    }
+    sub->overflow = false;
+    return len;
+}
+
+/* add or, with unwatch_flag, remove a watch, returns -1 if there is no
+ * room for another one */
+int sub_watch(subscriber *sub, char *key, size_t key_len, uint8_t flags) {
+    bool prefix = flags & watch_prefix_flag;
+
+    for (watch **w = &sub->watches; *w != NULL; w = &(*w)->next) {
+        if ((*w)->prefix == prefix && (*w)->key_len == key_len && memcmp((*w)->key, key, key_len) == 0) {
+            if (flags & unwatch_flag) {
+                watch *old = *w;
+                *w = old->next;
+                free(old->key);
+                free(old);
+                sub->n_watches--;
+            }
+            return 0;
+        }
+    }
+    if (flags & unwatch_flag) {
+        return 0;
+    }
+
+    if (sub->n_watches == MAX_WATCHES) {
+        return -1;
+    }
+    watch *w = malloc(sizeof *w);
+    if (w == NULL) {
+        return -1;
+    }
+    w->key = malloc(key_len > 0 ? key_len : 1);
+    if (w->key == NULL) {
+        free(w);
+        return -1;
+    }
+    memcpy(w->key, key, key_len);
+    w->key_len = key_len;
+    w->prefix = prefix;
+    w->next = sub->watches;
+    sub->watches = w;
+    sub->n_watches++;
+
+    return 0;
+}
+
+/* the subscriber of a socket client, created on its first watch.
+ * Returns NULL for shared memory clients or if out of memory */
+subscriber *sub_get(connection *conn) {
+    if (conn->sub != NULL || conn->shm.channel != NULL) {
+        return conn->sub;
+    }
+
+    subscriber *sub = calloc(1, sizeof *sub);
+    if (sub == NULL) {
+        return NULL;
+    }
+    sub->pending = ht_create();
+    sub->next = subscribers;
+    subscribers = sub;
+    conn->sub = sub;
+    return sub;
+}
+
+void sub_free(subscriber *sub) {
+    for (subscriber **s = &subscribers; *s != NULL; s = &(*s)->next) {
+        if (*s == sub) {
+            *s = sub->next;
+            break;
+        }
+    }
+    while (sub->watches != NULL) {
+        watch *w = sub->watches;
+        sub->watches = w->next;
+        free(w->key);
+        free(w);
+    }
+    ht_destroy(sub->pending);
+    free(sub);
+}
+
+/* like recv without waiting, but reads from the shared memory channel if
+ * there is one */
+ssize_t conn_recv(connection *conn, void *dest, size_t len) {
+    if (conn->shm.channel != NULL) {
+        return shm_try_recv(&conn->shm, dest, len);
+    }
+    return recv(conn->sock, dest, len, 0);
+}
+
+/* like writev without waiting, but writes to the shared memory channel if
+ * there is one */
+ssize_t conn_writev(connection *conn, struct iovec *iov, int iovcnt) {
+    if (conn->shm.channel != NULL) {
+        return shm_try_writev(&conn->shm, iov, iovcnt);
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (size_t) iovcnt;
+    ssize_t sent;
+    while ((sent = sendmsg(conn->sock, &msg, MSG_NOSIGNAL)) == -1 && errno == EINTR) {
+    }
+    return sent;
+}
+
+/* true if the requests of conn wait until the client read its responses */
+bool conn_backlogged(connection *conn) {
+    return conn->out_end - conn->out_start > CONN_OUT_LIMIT;
+}
+
+/* append the bytes of iov after the first skip ones to out,
+ * returns -1 if out of memory */
+int conn_queue(connection *conn, struct iovec *iov, int iovcnt, size_t skip) {
+    size_t len = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+    len -= skip;
+
+    if (conn->out_cap - conn->out_end < len && conn->out_start > 0) {
+        memmove(conn->out, conn->out + conn->out_start, conn->out_end - conn->out_start);
+        conn->out_end -= conn->out_start;
+        conn->out_start = 0;
+    }
+    if (conn->out_cap - conn->out_end < len) {
+        size_t cap = 2 * conn->out_cap > conn->out_end + len ? 2 * conn->out_cap : conn->out_end + len;
+        char *out = realloc(conn->out, cap);
+        if (out == NULL) {
+            fprintf(stderr, "realloc: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->out = out;
+        conn->out_cap = cap;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t part = iov[i].iov_len;
+        char *src = iov[i].iov_base;
+        if (skip >= part) {
+            skip -= part;
+            continue;
+        }
+        memcpy(conn->out + conn->out_end, src + skip, part - skip);
+        conn->out_end += part - skip;
+        skip = 0;
+    }
+
+    return 0;
+}
+
+/* send all buffers of iov with one syscall, what the socket does not take
+ * is copied to the queue of the connection, since iov points into buffers
+ * that change with the next request. Returns the number of bytes of iov
+ * or -1 on error */
+ssize_t send_iov(connection *conn, struct iovec *iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        total += iov[i].iov_len;
+    }
+
+    /* the primary does not read responses */
+    if (conn->primary) {
+        return (ssize_t) total;
+    }
+
+    /* queued responses go first */
+    size_t sent = 0;
+    if (conn->out_end == conn->out_start) {
+        ssize_t status = conn_writev(conn, iov, iovcnt);
+        if (status == -1 && errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+        sent = status == -1 ? 0 : (size_t) status;
+    }
+
+    if (sent < total && conn_queue(conn, iov, iovcnt, sent) == -1) {
+        return -1;
+    }
+    return (ssize_t) total;
+}
+
+/* send queued responses as far as the client takes them,
+ * returns -1 on error */
+int conn_flush(connection *conn) {
+    while (conn->out_start < conn->out_end) {
+        struct iovec iov;
+        iov.iov_base = conn->out + conn->out_start;
+        iov.iov_len = conn->out_end - conn->out_start;
+        ssize_t sent = conn_writev(conn, &iov, 1);
+        if (sent == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            fprintf(stderr, "send: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->out_start += (size_t) sent;
+    }
+
+    /* a large response does not keep its memory */
+    conn->out_start = 0;
+    conn->out_end = 0;
+    if (conn->out_cap > CONN_OUT_LIMIT) {
+        free(conn->out);
+        conn->out = NULL;
+        conn->out_cap = 0;
+    }
+    return 0;
+}
+
+/* queue notifications while the client reads everything it gets, so they
+ * never pile up behind responses. Returns -1 on error */
+int sub_push(connection *conn) {
+    while (conn->out_end == conn->out_start && sub_wants_write(conn->sub)) {
+        struct iovec iov;
+        iov.iov_base = conn->sub->out;
+        iov.iov_len = sub_next_notification(conn->sub);
+        if (send_iov(conn, &iov, 1) == -1) {
+            fprintf(stderr, "send: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* make sure at least len unparsed bytes are buffered, returns INCOMPLETE
+ * if they did not arrive yet and -1 on error or if the peer closed the
+ * connection */
+int buffer_fill(connection *conn, size_t len) {
+    conn_buffer *buf = conn->buf;
+    assert(len <= CONN_BUF_LEN);
+
+    while (buf->end - buf->start < len) {
+        /* move the partial request to the front to make room */
+        if (CONN_BUF_LEN - buf->start < len) {
+            memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+            buf->end -= buf->start;
+            buf->start = 0;
         }
-        assert(status < BUF_LEN);
-        recv_key_buffer[status] = '\0';
 
-        if (recv_value_len > 0) {
-            status = recv(conn_sock, recv_value_buffer, recv_value_len, MSG_WAITALL);
-            if (status == -1) {
-                fprintf(stderr, "recv: %s\n", strerror(errno));
-                goto close_conn_sock;
+        ssize_t status = conn_recv(conn, buf->data + buf->end, CONN_BUF_LEN - buf->end);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return INCOMPLETE;
             }
-            assert(status < BUF_LEN);
-            recv_value_buffer[status] = '\0';
+            fprintf(stderr, "recv: %s\n", strerror(errno));
+            return -1;
+        }
+        if (status == 0) {
+            return -1;
         }
+        buf->end += status;
+        buf->recv_ns = now_ns();
+    }
+
+    return 0;
+}
+
+/* the statistics bucket of a request */
+op_type action_op(char action) {
+    if (action & batch_mask) {
+        return OP_BATCH;
+    } else if (action & delete_mask) {
+        return OP_DELETE;
+    } else if (action & set_mask) {
+        return OP_SET;
+    }
+    return OP_GET;
+}
+
+/* read action and lengths from a request header */
+void parse_header(char *header_buffer, char *action, uint16_t *key_len, uint16_t *value_len) {
+    *action = header_buffer[0];
+    memcpy(key_len, header_buffer + 2, sizeof *key_len);
+    *key_len = ntohs(*key_len);
+
+    memcpy(value_len, header_buffer + 4, sizeof *value_len);
+    *value_len = ntohs(*value_len);
+}
+
+/* every request needs a key and only a set carries a value */
+bool is_malformed(char action, uint16_t key_len, uint16_t value_len) {
+    return key_len == 0 || (value_len > 0 && !(action & set_mask));
+}
+
+/* apply a single complete request to the table. The response header is
+ * written to response_header and the response is described by up to three
+ * entries in iov, which point into the request and the table, so they are
+ * only valid until the table is modified. A set or delete fails unless
+ * writable is set. Returns the number of entries */
+int execute_request(hash_table *tbl, char *request, bool writable, char *response_header, struct iovec *iov) {
+    ssize_t status;
+    char action;
+    uint16_t recv_key_len;
+    uint16_t recv_value_len;
+    parse_header(request, &action, &recv_key_len, &recv_value_len);
+
+    char *recv_key_buffer = request + HEADER_LEN;
+    char *recv_value_buffer = recv_key_buffer + recv_key_len;
+    if (trace != NULL) {
+        trace_write(trace, (uint8_t) action, recv_key_buffer, recv_key_len, recv_value_buffer, recv_value_len);
+    }
+
+    if (!writable) {
+        action &= (char) ~(set_mask | delete_mask);
     }
 
     /* process request */
@@ -91,13 +943,20 @@ void serve(int sock, hash_table *tbl) {
         }
     }
 
+    /* a set after a delete leaves the key set */
+    if (action & set_mask) {
+        publish_change((char) set_mask, recv_key_buffer, recv_key_len, recv_value_buffer, recv_value_len);
+    } else if (action & delete_mask) {
+        publish_change((char) delete_mask, recv_key_buffer, recv_key_len, NULL, 0);
+    }
+
     char *send_value_buffer = NULL;
     char *send_key_buffer = NULL;
     size_t send_value_len = 0;
     size_t send_key_len = 0;
     if (action & get_mask) {
         status = ht_get_value(tbl, recv_key_buffer, recv_key_len, (void **) &send_value_buffer, &send_value_len);
-        printf("GET DETECTED\n");
+        log_debug("GET DETECTED");
         if (status == -1) {
             action ^= get_mask;
         } else {
@@ -110,92 +969,1577 @@ void serve(int sock, hash_table *tbl) {
 
     /* build response header */
     uint16_t num;
-    header_buffer[0] = action;
+    response_header[0] = action;
+    response_header[1] = request[1]; /* transaction_id */
     num = htons(send_key_len);
-    memcpy(header_buffer + 2, &num, sizeof num);
+    memcpy(response_header + 2, &num, sizeof num);
 
     num = htons(send_value_len);
-    memcpy(header_buffer + 4, &num, sizeof num);
+    memcpy(response_header + 4, &num, sizeof num);
 
-    /* build response */
-    size_t response_len = HEADER_LEN + send_key_len + send_value_len;
-    char *response = calloc(response_len, sizeof *response);
-    memcpy(response, header_buffer, HEADER_LEN);
+    /* build response, the header lives with the caller, the key in the
+     * request buffer and the value in the table, so nothing is copied */
+    int n_iov = 0;
+    iov[n_iov].iov_base = response_header;
+    iov[n_iov].iov_len = HEADER_LEN;
+    n_iov++;
     if (send_key_len > 0) {
         assert(send_key_buffer != NULL);
-        memcpy(response + HEADER_LEN, send_key_buffer, send_key_len);
+        iov[n_iov].iov_base = send_key_buffer;
+        iov[n_iov].iov_len = send_key_len;
+        n_iov++;
     }
     if (send_value_len > 0) {
         assert(send_value_buffer != NULL);
-        memcpy(response + HEADER_LEN + send_key_len, send_value_buffer, send_value_len);
+        iov[n_iov].iov_base = send_value_buffer;
+        iov[n_iov].iov_len = send_value_len;
+        n_iov++;
     }
 
-    status = send(conn_sock, response, response_len, 0);
-    if (status == -1) {
-        fprintf(stderr, "send: %s\n", strerror(errno));
+    return n_iov;
+}
+
+/* handle a batch frame, the key_len field holds the number of operations
+ * and the value_len field the length of the body, which is a sequence of
+ * ordinary requests. The response is a batch header with the number of
+ * responses followed by one ordinary response per operation.
+ * Returns -1 if the connection should be closed */
+int serve_batch(connection *conn, hash_table *tbl, uint16_t n_ops, uint16_t body_len) {
+    conn_buffer *buf = conn->buf;
+    int filled = buffer_fill(conn, HEADER_LEN + body_len);
+    if (filled != 0) {
+        return filled;
     }
-    free(response);
+    uint64_t start_ns = now_ns();
 
-close_conn_sock:
-    close(conn_sock);
-}
+    char *batch = buf->data + buf->start;
+    char *body = batch + HEADER_LEN;
 
-int run_server(char *port) {
-    hash_table *tbl = ht_create();
+    /* validate the whole batch before touching the table, and let the
+     * cpu fetch the buckets while we are at it */
+    size_t offset = 0;
+    for (uint16_t i = 0; i < n_ops; i++) {
+        char action;
+        uint16_t key_len;
+        uint16_t value_len;
+        if (body_len - offset < HEADER_LEN) {
+            return -1;
+        }
+        parse_header(body + offset, &action, &key_len, &value_len);
+        if (action & (batch_mask | ext_len_mask | command_mask) || is_malformed(action, key_len, value_len)
+                || body_len - offset < (size_t) HEADER_LEN + key_len + value_len) {
+            return -1;
+        }
+        ht_prefetch(tbl, body + offset + HEADER_LEN, key_len);
+        offset += HEADER_LEN + key_len + value_len;
+    }
+    if (offset != body_len) {
+        return -1;
+    }
 
-    int status;
-    struct addrinfo hints;
-    struct addrinfo *servinfo;  // will point to the results
+    char batch_header[HEADER_LEN];
+    uint16_t num;
+    batch_header[0] = batch_mask | acknowledgment_mask;
+    batch_header[1] = batch[1]; /* transaction_id */
+    num = htons(n_ops);
+    memcpy(batch_header + 2, &num, sizeof num);
+    memset(batch_header + 4, 0, 2);
 
-    memset(&hints, 0, sizeof hints); // make sure the struct is empty
-    hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
-    hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
-    hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
+    /* responses are collected and sent BATCH_CHUNK operations at a time */
+    char response_headers[BATCH_CHUNK][HEADER_LEN];
+    struct iovec response[1 + 3 * BATCH_CHUNK];
+    int n_iov = 0;
+    int n_pending = 0;
+    bool pending_values = false;
+    size_t bytes_out = 0;
 
-    if ((status = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
-        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
-        return 1;
-    }
+    response[n_iov].iov_base = batch_header;
+    response[n_iov].iov_len = HEADER_LEN;
+    n_iov++;
 
-    int sock = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
-    if (sock == -1) {
-        status = 1;
-        fprintf(stderr, "socket: %s\n", strerror(errno));
-        goto cleanup;
-    }
+    offset = 0;
+    for (uint16_t i = 0; i < n_ops; i++) {
+        char *request = body + offset;
+        char action;
+        uint16_t key_len;
+        uint16_t value_len;
+        parse_header(request, &action, &key_len, &value_len);
 
-    status = bind(sock, servinfo->ai_addr, servinfo->ai_addrlen);
+        /* pending responses may point to values this operation frees */
+        bool modifies = action & (set_mask | delete_mask);
+        if (n_pending == BATCH_CHUNK || (modifies && pending_values)) {
+            ssize_t sent = send_iov(conn, response, n_iov);
+            if (sent == -1) {
+                fprintf(stderr, "send: %s\n", strerror(errno));
+                return -1;
+            }
+            bytes_out += sent;
+            n_iov = 0;
+            n_pending = 0;
+            pending_values = false;
+        }
+
+        int n = execute_request(tbl, request, conn_writable(conn), response_headers[n_pending], response + n_iov);
+        pending_values = pending_values || n == 3;
+        n_iov += n;
+        n_pending++;
+        offset += HEADER_LEN + key_len + value_len;
+    }
+
+    ssize_t status = send_iov(conn, response, n_iov);
+    buf->start += HEADER_LEN + body_len;
+    if (status == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    stats_record(OP_BATCH, start_ns - buf->recv_ns, now_ns() - start_ns,
+            HEADER_LEN + body_len, bytes_out + (size_t) status);
+
+    return 0;
+}
+
+/* receive the len bytes of a value that follow the first offset bytes of
+ * the request in buf into conn->value, buffered bytes first, the rest
+ * straight from the socket. The request before the value stays in buf, so
+ * it is parsed again until the value is complete. Returns INCOMPLETE until
+ * then and -1 on error or if the peer closed the connection */
+int value_fill(connection *conn, size_t offset, size_t len) {
+    conn_buffer *buf = conn->buf;
+    if (conn->value == NULL) {
+        conn->value = malloc(len);
+        if (conn->value == NULL) {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            return -1;
+        }
+        conn->value_received = 0;
+    }
+
+    /* take the buffered part of the value out of buf */
+    char *value = buf->data + buf->start + offset;
+    size_t after = buf->end - buf->start - offset;
+    size_t buffered = after < len - conn->value_received ? after : len - conn->value_received;
+    memcpy(conn->value + conn->value_received, value, buffered);
+    memmove(value, value + buffered, after - buffered);
+    buf->end -= buffered;
+    conn->value_received += buffered;
+
+    while (conn->value_received < len) {
+        ssize_t status = conn_recv(conn, conn->value + conn->value_received, len - conn->value_received);
+        if (status == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return INCOMPLETE;
+            }
+            fprintf(stderr, "recv: %s\n", strerror(errno));
+            return -1;
+        }
+        if (status == 0) {
+            return -1;
+        }
+        conn->value_received += (size_t) status;
+        buf->recv_ns = now_ns();
+    }
+
+    return 0;
+}
+
+/* handle a frame with 32 bit lengths, the header is action, transaction_id,
+ * key_len and value_len. The key has to fit into the receive buffer, the
+ * value of a set is streamed into its own allocation which is then handed
+ * to the table, a get sends the value directly out of the table.
+ * Returns -1 if the connection should be closed and INCOMPLETE until the
+ * whole frame arrived */
+int serve_ext(connection *conn, hash_table *tbl) {
+    conn_buffer *buf = conn->buf;
+    ssize_t status;
+    int filled = buffer_fill(conn, EXT_HEADER_LEN);
+    if (filled != 0) {
+        return filled;
+    }
+
+    char *header_buffer = buf->data + buf->start;
+    char action = header_buffer[0];
+    char transaction_id = header_buffer[1];
+    uint32_t recv_key_len;
+    memcpy(&recv_key_len, header_buffer + 2, sizeof recv_key_len);
+    recv_key_len = ntohl(recv_key_len);
+
+    uint32_t recv_value_len;
+    memcpy(&recv_value_len, header_buffer + 6, sizeof recv_value_len);
+    recv_value_len = ntohl(recv_value_len);
+
+    /* discard malformed packages */
+    if (action & batch_mask || recv_key_len == 0 || recv_key_len > UINT16_MAX
+            || recv_value_len > MAX_EXT_VALUE_LEN || (recv_value_len > 0 && !(action & set_mask))) {
+        return -1;
+    }
+
+    filled = buffer_fill(conn, EXT_HEADER_LEN + recv_key_len);
+    if (filled != 0) {
+        return filled;
+    }
+
+    char *recv_value_buffer = NULL;
+    if (recv_value_len > 0) {
+        filled = value_fill(conn, EXT_HEADER_LEN + recv_key_len, recv_value_len);
+        if (filled != 0) {
+            return filled;
+        }
+        recv_value_buffer = conn->value;
+        conn->value = NULL;
+    }
+
+    /* the key stays valid in the buffer until the next buffer_fill */
+    char *recv_key_buffer = buf->data + buf->start + EXT_HEADER_LEN;
+    buf->start += EXT_HEADER_LEN + recv_key_len;
+    uint64_t start_ns = now_ns();
+    op_type op = action_op(action);
+    if (trace != NULL) {
+        trace_write(trace, (uint8_t) action, recv_key_buffer, (uint16_t) recv_key_len,
+                recv_value_buffer, recv_value_len);
+    }
+
+    if (!conn_writable(conn)) {
+        action &= (char) ~(set_mask | delete_mask);
+    }
+
+    /* process request */
+    if (action & delete_mask) {
+        status = ht_delete_key(tbl, recv_key_buffer, recv_key_len);
+        if (status == -1) {
+            action ^= delete_mask;
+        }
+    }
+
+    if (action & set_mask) {
+        status = ht_adopt_value(tbl, recv_key_buffer, recv_key_len, recv_value_buffer, recv_value_len);
+        if (status == -1) {
+            free(recv_value_buffer);
+            action ^= set_mask;
+        }
+    } else {
+        free(recv_value_buffer);
+    }
+
+    /* the table owns the value now, it is valid until the next change */
+    if (action & set_mask) {
+        publish_change((char) set_mask, recv_key_buffer, recv_key_len, recv_value_buffer, recv_value_len);
+    } else if (action & delete_mask) {
+        publish_change((char) delete_mask, recv_key_buffer, recv_key_len, NULL, 0);
+    }
+
+    char *send_value_buffer = NULL;
+    size_t send_value_len = 0;
+    uint32_t send_key_len = 0;
+    if (action & get_mask) {
+        status = ht_get_value(tbl, recv_key_buffer, recv_key_len, (void **) &send_value_buffer, &send_value_len);
+        if (status == -1) {
+            action ^= get_mask;
+        } else {
+            send_key_len = recv_key_len;
+        }
+    }
+
+    action ^= acknowledgment_mask;
+
+    /* build response header */
+    uint32_t num;
+    char response_header[EXT_HEADER_LEN];
+    response_header[0] = action;
+    response_header[1] = transaction_id;
+    num = htonl(send_key_len);
+    memcpy(response_header + 2, &num, sizeof num);
+    num = htonl((uint32_t) send_value_len);
+    memcpy(response_header + 6, &num, sizeof num);
+
+    struct iovec response[3];
+    int n_iov = 0;
+    response[n_iov].iov_base = response_header;
+    response[n_iov].iov_len = EXT_HEADER_LEN;
+    n_iov++;
+    if (send_key_len > 0) {
+        response[n_iov].iov_base = recv_key_buffer;
+        response[n_iov].iov_len = send_key_len;
+        n_iov++;
+    }
+    if (send_value_len > 0) {
+        response[n_iov].iov_base = send_value_buffer;
+        response[n_iov].iov_len = send_value_len;
+        n_iov++;
+    }
+
+    status = send_iov(conn, response, n_iov);
+    if (status == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    stats_record(op, start_ns - buf->recv_ns, now_ns() - start_ns,
+            EXT_HEADER_LEN + recv_key_len + recv_value_len, (size_t) status);
+    return 0;
+}
+
+/* answer a stats request, the value of the response is a text dump of
+ * the number of keys and the latency and size histograms per operation.
+ * Returns -1 if the connection should be closed */
+int serve_stats(connection *conn, hash_table *tbl, uint16_t key_len, uint16_t value_len) {
+    conn_buffer *buf = conn->buf;
+    if (key_len > 0 || value_len > 0) {
+        return -1;
+    }
+
+    char text[STATS_LEN];
+    int len = snprintf(text, sizeof text, "keys=%zu\n", tbl->n_elems);
+    len += (int) stats_dump(text + len, sizeof text - (size_t) len);
+    len += (int) repl_dump(text + len, sizeof text - (size_t) len);
+
+    uint16_t num;
+    char response_header[HEADER_LEN];
+    response_header[0] = stats_mask | acknowledgment_mask;
+    response_header[1] = buf->data[buf->start + 1]; /* transaction_id */
+    memset(response_header + 2, 0, 2);
+    num = htons((uint16_t) len);
+    memcpy(response_header + 4, &num, sizeof num);
+    buf->start += HEADER_LEN;
+
+    struct iovec response[2];
+    response[0].iov_base = response_header;
+    response[0].iov_len = HEADER_LEN;
+    response[1].iov_base = text;
+    response[1].iov_len = (size_t) len;
+
+    if (send_iov(conn, response, 2) == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the 8 byte big endian number at p */
+uint64_t read_u64(char *p) {
+    uint64_t num;
+    memcpy(&num, p, sizeof num);
+    return be64toh(num);
+}
+
+void write_u64(char *p, uint64_t num) {
+    num = htobe64(num);
+    memcpy(p, &num, sizeof num);
+}
+
+/* handle an atomic read-modify-write command, the request carries a key and
+ * a value like a set. The response carries the key if the operation was
+ * applied, like a get that found its key, and an 8 byte big endian number:
+ *   CMD_SET_IF_ABSENT  value: the value to set
+ *                      response: the version of the new or existing entry
+ *   CMD_CAS            value: the expected version (0 for a missing key),
+ *                      followed by the value to set
+ *                      response: the new version, or if the version did not
+ *                      match the current one followed by the current value
+ *   CMD_INCR/CMD_DECR  value: empty for 1, or an 8 byte amount
+ *                      response: the new counter, nothing if it overflowed
+ *                      or the value is not a counter
+ * A counter is an 8 byte big endian signed number and a missing key counts
+ * as 0. Returns -1 if the connection should be closed */
+int serve_atomic(connection *conn, hash_table *tbl, char action, uint16_t key_len, uint16_t value_len) {
+    conn_buffer *buf = conn->buf;
+    uint8_t code = (uint8_t) (action & ~(command_mask | acknowledgment_mask));
+    bool counter = code == CMD_INCR || code == CMD_DECR;
+
+    /* discard malformed packages */
+    if (key_len == 0 || (code == CMD_CAS && value_len < 8) || (counter && value_len != 0 && value_len != 8)) {
+        return -1;
+    }
+
+    size_t request_len = HEADER_LEN + key_len + value_len;
+    int filled = buffer_fill(conn, request_len);
+    if (filled != 0) {
+        return filled;
+    }
+    uint64_t start_ns = now_ns();
+
+    char *request = buf->data + buf->start;
+    char *key = request + HEADER_LEN;
+    char *value = key + key_len;
+    size_t new_value_len = value_len;
+    char number[8];
+    bool applied = false;
+    bool send_number = true;
+    hash_table_elem *elem = ht_find(tbl, key, key_len);
+
+    if (code == CMD_SET_IF_ABSENT) {
+        applied = elem == NULL;
+    } else if (code == CMD_CAS) {
+        applied = read_u64(value) == (elem != NULL ? elem->version : 0);
+        value += 8;
+        new_value_len -= 8;
+    } else {
+        int64_t amount = value_len > 0 ? (int64_t) read_u64(value) : 1;
+        int64_t current = 0;
+        int64_t result = 0;
+        if (elem != NULL && elem->value_len == sizeof current) {
+            current = (int64_t) read_u64(elem->value);
+        }
+        applied = (elem == NULL || elem->value_len == sizeof current)
+            && !(code == CMD_INCR ? __builtin_add_overflow(current, amount, &result)
+                                  : __builtin_sub_overflow(current, amount, &result));
+        write_u64(number, (uint64_t) result);
+        value = number;
+        new_value_len = sizeof number;
+    }
+
+    applied = applied && conn_writable(conn);
+    if (applied) {
+        applied = ht_set_value(tbl, key, key_len, value, new_value_len) == 0;
+    }
+    if (applied) {
+        publish_change((char) set_mask, key, key_len, value, new_value_len);
+        elem = ht_find(tbl, key, key_len);
+    } else {
+        send_number = send_number && !counter;
+    }
+
+    if (!counter) {
+        write_u64(number, elem != NULL ? elem->version : 0);
+    }
+
+    /* a failed compare and swap also returns the current value */
+    char *send_value = NULL;
+    size_t send_value_len = 0;
+    if (code == CMD_CAS && !applied && elem != NULL) {
+        send_value = elem->value;
+        send_value_len = elem->value_len;
+    }
+    size_t response_value_len = (send_number ? sizeof number : 0) + send_value_len;
+    if (response_value_len > UINT16_MAX) {
+        send_value_len = 0; /* the version alone tells the client to retry */
+        response_value_len = sizeof number;
+    }
+
+    uint16_t num;
+    char response_header[HEADER_LEN];
+    response_header[0] = (char) (action ^ acknowledgment_mask);
+    response_header[1] = request[1]; /* transaction_id */
+    num = htons(applied ? key_len : 0);
+    memcpy(response_header + 2, &num, sizeof num);
+    num = htons((uint16_t) response_value_len);
+    memcpy(response_header + 4, &num, sizeof num);
+
+    struct iovec response[4];
+    int n_iov = 0;
+    response[n_iov].iov_base = response_header;
+    response[n_iov].iov_len = HEADER_LEN;
+    n_iov++;
+    if (applied) {
+        response[n_iov].iov_base = key;
+        response[n_iov].iov_len = key_len;
+        n_iov++;
+    }
+    if (send_number) {
+        response[n_iov].iov_base = number;
+        response[n_iov].iov_len = sizeof number;
+        n_iov++;
+    }
+    if (send_value_len > 0) {
+        response[n_iov].iov_base = send_value;
+        response[n_iov].iov_len = send_value_len;
+        n_iov++;
+    }
+
+    ssize_t status = send_iov(conn, response, n_iov);
+    buf->start += request_len;
+    if (status == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    stats_record(OP_SET, start_ns - buf->recv_ns, now_ns() - start_ns, request_len, (size_t) status);
+    return 0;
+}
+
+/* true if key is past the end of a scan, see serve_scan */
+bool scan_done(sl_node *node, bool prefix, char *bound, size_t bound_len) {
+    if (prefix) {
+        return node->key_len < bound_len || memcmp(node->key, bound, bound_len) != 0;
+    }
+    return bound_len > 0 && sl_compare(node->key, node->key_len, bound, bound_len) >= 0;
+}
+
+/* answer one page of a scan over the ordered index. The key of the request
+ * is the first key of the page, empty for the first key of the table. The
+ * value holds a flags byte, the maximum number of entries as 16 bit number
+ * (0 for as many as fit) and a bound: the end of the range, exclusive and
+ * empty for no end, or with scan_prefix_flag the prefix of all keys.
+ * The response carries the first key of the next page, none if the scan is
+ * complete, and a value with one entry per key: the 16 bit key length and
+ * the key, with scan_values_flag followed by the 32 bit value length and
+ * the value. A value that does not fit into a page has the length
+ * UINT32_MAX and is left out, an extended get returns it.
+ * Returns -1 if the connection should be closed */
+int serve_scan(connection *conn, hash_table *tbl, char action, uint16_t key_len, uint16_t value_len) {
+    static char page[UINT16_MAX];
+    conn_buffer *buf = conn->buf;
+
+    /* discard malformed packages, or if there is no index to scan */
+    if (tbl->index == NULL || value_len < 3) {
+        return -1;
+    }
+
+    size_t request_len = HEADER_LEN + key_len + value_len;
+    int filled = buffer_fill(conn, request_len);
+    if (filled != 0) {
+        return filled;
+    }
+    uint64_t start_ns = now_ns();
+
+    char *request = buf->data + buf->start;
+    char *start = request + HEADER_LEN;
+    char *params = start + key_len;
+    uint8_t flags = (uint8_t) params[0];
+    uint16_t limit;
+    memcpy(&limit, params + 1, sizeof limit);
+    limit = ntohs(limit);
+    char *bound = params + 3;
+    size_t bound_len = value_len - 3u;
+    bool prefix = flags & scan_prefix_flag;
+    bool with_values = flags & scan_values_flag;
+
+    /* a prefix scan starts at the prefix at the earliest */
+    sl_node *node;
+    if (prefix && sl_compare(start, key_len, bound, bound_len) < 0) {
+        node = sl_seek(tbl->index, bound, bound_len);
+    } else {
+        node = sl_seek(tbl->index, start, key_len);
+    }
+
+    size_t page_len = 0;
+    uint16_t n_entries = 0;
+    for (; node != NULL && !scan_done(node, prefix, bound, bound_len); node = node->next[0]) {
+        hash_table_elem *elem = node->data;
+        size_t entry_len = 2 + elem->key_len + (with_values ? 4 : 0);
+        bool value_fits = with_values && entry_len + elem->value_len <= sizeof page;
+        if (value_fits) {
+            entry_len += elem->value_len;
+        }
+        if (entry_len > sizeof page) {
+            continue; /* a key this long never fits, skip it */
+        }
+        if ((limit > 0 && n_entries == limit) || page_len + entry_len > sizeof page) {
+            break;
+        }
+
+        uint16_t num = htons((uint16_t) elem->key_len);
+        memcpy(page + page_len, &num, sizeof num);
+        memcpy(page + page_len + 2, elem->key, elem->key_len);
+        page_len += 2 + elem->key_len;
+        if (with_values) {
+            uint32_t len = htonl(value_fits ? (uint32_t) elem->value_len : UINT32_MAX);
+            memcpy(page + page_len, &len, sizeof len);
+            page_len += sizeof len;
+            if (value_fits) {
+                memcpy(page + page_len, elem->value, elem->value_len);
+                page_len += elem->value_len;
+            }
+        }
+        n_entries++;
+    }
+
+    /* there is a next page if the loop stopped early */
+    size_t next_len = node != NULL && !scan_done(node, prefix, bound, bound_len) ? node->key_len : 0;
+
+    uint16_t num;
+    char response_header[HEADER_LEN];
+    response_header[0] = (char) (action ^ acknowledgment_mask);
+    response_header[1] = request[1]; /* transaction_id */
+    num = htons((uint16_t) next_len);
+    memcpy(response_header + 2, &num, sizeof num);
+    num = htons((uint16_t) page_len);
+    memcpy(response_header + 4, &num, sizeof num);
+
+    struct iovec response[3];
+    int n_iov = 0;
+    response[n_iov].iov_base = response_header;
+    response[n_iov].iov_len = HEADER_LEN;
+    n_iov++;
+    if (next_len > 0) {
+        response[n_iov].iov_base = node->key;
+        response[n_iov].iov_len = next_len;
+        n_iov++;
+    }
+    if (page_len > 0) {
+        response[n_iov].iov_base = page;
+        response[n_iov].iov_len = page_len;
+        n_iov++;
+    }
+
+    ssize_t status = send_iov(conn, response, n_iov);
+    buf->start += request_len;
+    if (status == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    stats_record(OP_GET, start_ns - buf->recv_ns, now_ns() - start_ns, request_len, (size_t) status);
+    return 0;
+}
+
+/* handle a watch request, the key is the key or prefix to watch, empty to
+ * watch all keys with watch_prefix_flag, and the value a flags byte. The
+ * response carries the key if the watch was added or removed. From then on
+ * the server pushes CMD_NOTIFY frames with the changed key and a value
+ * byte, set_mask or delete_mask for the last change of that key. A
+ * notification without key means notifications were dropped and the client
+ * has to read its keys again. Shared memory clients cannot watch.
+ * Returns -1 if the connection should be closed */
+int serve_watch(connection *conn, char action, uint16_t key_len, uint16_t value_len) {
+    conn_buffer *buf = conn->buf;
+
+    /* discard malformed packages */
+    if (value_len != 1) {
+        return -1;
+    }
+
+    size_t request_len = HEADER_LEN + key_len + value_len;
+    int filled = buffer_fill(conn, request_len);
+    if (filled != 0) {
+        return filled;
+    }
+
+    char *request = buf->data + buf->start;
+    char *key = request + HEADER_LEN;
+    uint8_t flags = (uint8_t) key[key_len];
+    bool ok = (key_len > 0 || flags & watch_prefix_flag) && sub_get(conn) != NULL
+        && sub_watch(conn->sub, key, key_len, flags) == 0;
+
+    uint16_t num;
+    char response_header[HEADER_LEN];
+    response_header[0] = (char) (action ^ acknowledgment_mask);
+    response_header[1] = request[1]; /* transaction_id */
+    num = htons(ok ? key_len : 0);
+    memcpy(response_header + 2, &num, sizeof num);
+    memset(response_header + 4, 0, 2);
+
+    struct iovec response[2];
+    response[0].iov_base = response_header;
+    response[0].iov_len = HEADER_LEN;
+    response[1].iov_base = key;
+    response[1].iov_len = key_len;
+
+    ssize_t status = send_iov(conn, response, ok && key_len > 0 ? 2 : 1);
+    buf->start += request_len;
     if (status == -1) {
-        status = 1;
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    return 0;
+}
+
+/* the responses to the last IDEM_WINDOW requests of a client, the
+ * response to request id is in slot id % IDEM_WINDOW */
+typedef struct idem_client {
+    uint64_t highest;                  /* highest request id seen */
+    uint64_t ids[IDEM_WINDOW];         /* 0 for an empty slot */
+    char responses[IDEM_WINDOW][HEADER_LEN];
+} idem_client;
+
+/* client id -> idem_client */
+static hash_table *idem_clients = NULL;
+static size_t idem_cursor = 0;
+
+/* the cache of client_id, created on its first request. If there are too
+ * many clients an arbitrary one is forgotten. Returns NULL if out of memory */
+idem_client *idem_get(char *client_id) {
+    if (idem_clients == NULL && (idem_clients = ht_create()) == NULL) {
+        return NULL;
+    }
+
+    void *cache;
+    size_t cache_len;
+    if (ht_get_value(idem_clients, client_id, 8, &cache, &cache_len) == 0) {
+        return cache;
+    }
+
+    if (idem_clients->n_elems == MAX_IDEM_CLIENTS) {
+        while (idem_clients->elems[idem_cursor % idem_clients->size] == NULL) {
+            idem_cursor++;
+        }
+        hash_table_elem *victim = idem_clients->elems[idem_cursor % idem_clients->size];
+        ht_delete_key(idem_clients, victim->key, victim->key_len);
+    }
+
+    cache = calloc(1, sizeof (idem_client));
+    if (cache == NULL || ht_adopt_value(idem_clients, client_id, 8, cache, sizeof (idem_client)) == -1) {
+        free(cache);
+        return NULL;
+    }
+    return cache;
+}
+
+/* handle a set or delete that has to be executed at most once although the
+ * client retries it, also on new connections. The key holds a 64 bit client
+ * id, chosen at random by the client, and a 64 bit request id, counting up
+ * from 1 and reused by retries. The value is an ordinary set or delete
+ * request. The response echoes the ids and carries the response to that
+ * request, from the cache if it was executed before. A request IDEM_WINDOW
+ * or more behind the newest request of the client, or behind it and not in
+ * the cache because its first copy arrived late, is answered without ids
+ * and not executed, it could undo a later request.
+ * Returns -1 if the connection should be closed */
+int serve_idempotent(connection *conn, hash_table *tbl, char action, uint16_t key_len, uint16_t value_len) {
+    conn_buffer *buf = conn->buf;
+
+    if (key_len != 16 || value_len < HEADER_LEN) {
+        return -1;
+    }
+
+    size_t request_len = HEADER_LEN + key_len + value_len;
+    int filled = buffer_fill(conn, request_len);
+    if (filled != 0) {
+        return filled;
+    }
+    uint64_t start_ns = now_ns();
+
+    char *request = buf->data + buf->start;
+    char *ids = request + HEADER_LEN;
+    char *inner = ids + key_len;
+    char inner_action;
+    uint16_t inner_key_len;
+    uint16_t inner_value_len;
+    parse_header(inner, &inner_action, &inner_key_len, &inner_value_len);
+
+    /* discard malformed packages, only sets and deletes need this */
+    if ((inner_action & ~(set_mask | delete_mask)) != 0 || inner_action == 0
+            || is_malformed(inner_action, inner_key_len, inner_value_len)
+            || value_len != HEADER_LEN + inner_key_len + inner_value_len) {
+        return -1;
+    }
+
+    /* checked first, a request that is refused must not evict a client */
+    uint64_t request_id = read_u64(ids + 8);
+    if (request_id == 0) {
+        return -1;
+    }
+    idem_client *cache = idem_get(ids);
+    if (cache == NULL) {
+        return -1;
+    }
+
+    size_t slot = request_id % IDEM_WINDOW;
+    bool stale = request_id + IDEM_WINDOW <= cache->highest
+        || (request_id < cache->highest && cache->ids[slot] != request_id);
+    if (!stale && cache->ids[slot] != request_id) {
+        struct iovec inner_response[3];
+        execute_request(tbl, inner, conn_writable(conn), cache->responses[slot], inner_response);
+        cache->ids[slot] = request_id;
+        if (request_id > cache->highest) {
+            cache->highest = request_id;
+        }
+    }
+
+    uint16_t num;
+    char response_header[HEADER_LEN];
+    response_header[0] = (char) (action ^ acknowledgment_mask);
+    response_header[1] = request[1]; /* transaction_id */
+    num = htons(stale ? 0 : key_len);
+    memcpy(response_header + 2, &num, sizeof num);
+    num = htons(stale ? 0 : HEADER_LEN);
+    memcpy(response_header + 4, &num, sizeof num);
+
+    struct iovec response[3];
+    response[0].iov_base = response_header;
+    response[0].iov_len = HEADER_LEN;
+    response[1].iov_base = ids;
+    response[1].iov_len = key_len;
+    response[2].iov_base = cache->responses[slot];
+    response[2].iov_len = HEADER_LEN;
+
+    ssize_t status = send_iov(conn, response, stale ? 1 : 3);
+    buf->start += request_len;
+    if (status == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    stats_record(action_op(inner_action), start_ns - buf->recv_ns, now_ns() - start_ns,
+            request_len, (size_t) status);
+    return 0;
+}
+
+/* handle a command frame, returns -1 if the connection should be closed.
+ * After CMD_REPLICATE the socket belongs to the replica list, so it is
+ * taken away from the connection before that is closed */
+int serve_command(connection *conn, hash_table *tbl, char action, uint16_t key_len, uint16_t value_len) {
+    uint8_t code = (uint8_t) (action & ~(command_mask | acknowledgment_mask));
+    if (code >= CMD_SET_IF_ABSENT && code <= CMD_DECR) {
+        return serve_atomic(conn, tbl, action, key_len, value_len);
+    }
+    if (code == CMD_SCAN) {
+        return serve_scan(conn, tbl, action, key_len, value_len);
+    }
+    if (code == CMD_IDEMPOTENT) {
+        return serve_idempotent(conn, tbl, action, key_len, value_len);
+    }
+    if (code == CMD_WATCH) {
+        return serve_watch(conn, action, key_len, value_len);
+    }
+
+    if (key_len > 0 || value_len > 0) {
+        return -1;
+    }
+    conn->buf->start += HEADER_LEN;
+
+    switch (code) {
+    case CMD_REPLICATE:
+        /* the stream would follow responses that were not sent yet */
+        if (conn->shm.channel != NULL || conn->out_end > conn->out_start
+                || repl_attach(conn->sock, tbl, true) == -1) {
+            return -1;
+        }
+        conn->sock = -1;
+        return -1;
+    case CMD_SNAPSHOT:
+        if (!conn->primary) {
+            return -1;
+        }
+        ht_clear(tbl);
+        return 0;
+    default:
+        return -1;
+    }
+}
+
+/* handle the next request in buf and send the response, returns -1 if
+ * the connection should be closed and INCOMPLETE if the request did not
+ * arrive completely */
+int serve_frame(connection *conn, hash_table *tbl) {
+    conn_buffer *buf = conn->buf;
+    ssize_t status;
+
+    if (buf->start == buf->end) {
+        buf->start = 0;
+        buf->end = 0;
+    }
+
+    int filled = buffer_fill(conn, HEADER_LEN);
+    if (filled != 0) {
+        return filled;
+    }
+
+    /* recv request */
+    char action;
+    uint16_t recv_key_len;
+    uint16_t recv_value_len;
+    parse_header(buf->data + buf->start, &action, &recv_key_len, &recv_value_len);
+
+    if (action & command_mask) {
+        return serve_command(conn, tbl, action, recv_key_len, recv_value_len);
+    }
+
+    if (action & ext_len_mask) {
+        return serve_ext(conn, tbl);
+    }
+
+    if (action & stats_mask) {
+        return serve_stats(conn, tbl, recv_key_len, recv_value_len);
+    }
+
+    if (action & batch_mask) {
+        return serve_batch(conn, tbl, recv_key_len, recv_value_len);
+    }
+
+    /* discard malformed packages */
+    if (is_malformed(action, recv_key_len, recv_value_len)) {
+        return -1;
+    }
+
+    size_t request_len = HEADER_LEN + recv_key_len + recv_value_len;
+    filled = buffer_fill(conn, request_len);
+    if (filled != 0) {
+        return filled;
+    }
+
+    uint64_t start_ns = now_ns();
+    char response_header[HEADER_LEN];
+    struct iovec response[3];
+    int n_iov = execute_request(tbl, buf->data + buf->start, conn_writable(conn), response_header, response);
+
+    status = send_iov(conn, response, n_iov);
+    buf->start += request_len;
+    if (status == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        return -1;
+    }
+
+    stats_record(action_op(action), start_ns - buf->recv_ns, now_ns() - start_ns,
+            request_len, (size_t) status);
+
+    return 0;
+}
+
+/* like serve_frame, counting the frames applied from our primary */
+int serve_request(connection *conn, hash_table *tbl) {
+    int status = serve_frame(conn, tbl);
+    if (status == 0 && conn->primary) {
+        repl_applied++;
+        repl_applied_ns = now_ns();
+    }
+    return status;
+}
+
+/* set up a non-blocking connection for sock, returns -1 on error or if
+ * there is no buffer left */
+int conn_open(connection *conn, int sock) {
+    int flags = fcntl(sock, F_GETFL);
+    if (flags == -1 || fcntl(sock, F_SETFL, flags | O_NONBLOCK) == -1) {
+        fprintf(stderr, "fcntl: %s\n", strerror(errno));
+        return -1;
+    }
+
+    memset(conn, 0, sizeof *conn);
+    conn->sock = sock;
+    conn->buf = buffer_get();
+    if (conn->buf == NULL) {
+        fprintf(stderr, "buffer_get: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+void conn_close(connection *conn) {
+    if (conn->sub != NULL) {
+        sub_free(conn->sub);
+    }
+    buffer_put(conn->buf);
+    free(conn->value);
+    free(conn->out);
+    shm_close(&conn->shm);
+    if (conn->sock != -1) {
+        close(conn->sock);
+    }
+}
+
+/* true if there is input that serve_request can start on right away */
+bool conn_has_input(connection *conn) {
+    return (conn->buf->end > conn->buf->start && !conn->partial)
+        || (conn->shm.channel != NULL && ring_readable(conn->shm.in) > 0);
+}
+
+/* serve requests of conn, with readable set also if nothing is buffered,
+ * until its last request is incomplete or the client has to read its
+ * responses first. Returns -1 if the connection should be closed */
+int conn_serve(connection *conn, hash_table *tbl, bool readable) {
+    while ((readable || conn_has_input(conn)) && !conn_backlogged(conn)) {
+        int status = serve_request(conn, tbl);
+        if (status == -1) {
+            return -1;
+        }
+        conn->partial = status == INCOMPLETE;
+        if (conn->partial) {
+            return 0;
+        }
+        readable = false;
+    }
+    return 0;
+}
+
+/* listen on a unix domain socket at path, returns the socket or -1 */
+int listen_unix(char *path) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+    unlink(path); /* left over from an earlier run */
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
         fprintf(stderr, "bind: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+    if (listen(sock, 20) == -1) {
+        fprintf(stderr, "listen: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+/* let a blocked read on sock poll the device queue for busy_poll_us
+ * instead of waiting for the interrupt, returns -1 if that is not allowed */
+int set_busy_poll(int sock) {
+    if (busy_poll_us == 0) {
+        return 0;
+    }
+    if (setsockopt(sock, SOL_SOCKET, SO_BUSY_POLL, &busy_poll_us, sizeof busy_poll_us) == -1) {
+        return -1;
+    }
+#ifdef SO_PREFER_BUSY_POLL
+    /* keep the device from raising interrupts while we poll it */
+    int prefer = 1;
+    if (setsockopt(sock, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof prefer) == -1) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+/* run only on cpu. Memory is placed on the numa node of the cpu that first
+ * touches it, so pinning before the table and the buffers are allocated
+ * keeps them local */
+int pin_to_cpu(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof set, &set) == -1) {
+        fprintf(stderr, "sched_setaffinity: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* accept a client on the listener of the given type and add it to conns */
+void accept_client(int sock, listener_type type, connection *conns, int *n_conns) {
+    int conn_sock = accept(sock, NULL, NULL);
+    if (conn_sock == -1) {
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+        return;
+    }
+
+    if (*n_conns == MAX_CONNS) {
+        close(conn_sock);
+        return;
+    }
+
+    if (type == LISTEN_TCP) {
+        set_busy_poll(conn_sock); /* checked on the listener in run_server */
+    }
+
+    connection *conn = &conns[*n_conns];
+    if (conn_open(conn, conn_sock) == -1) {
+        close(conn_sock);
+        return;
+    }
+
+    if (type == LISTEN_SHM && shm_accept(conn_sock, &conn->shm) == -1) {
+        conn_close(conn);
+        return;
+    }
+
+    (*n_conns)++;
+}
+
+/* hand the listeners and the table to a new server connecting to the
+ * upgrade socket. The table goes over as a memfd snapshot written by
+ * table_save, the connection then streams our remaining changes like a
+ * replica that needs no snapshot. Our own copies of the listeners are
+ * closed, so new clients only reach the new server, and we serve the
+ * clients we have until they are gone */
+void hand_over(int listeners[N_LISTENERS], hash_table *tbl) {
+    int sock = accept(listeners[LISTEN_UPGRADE], NULL, NULL);
+    if (sock == -1) {
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+        return;
+    }
+
+    int fds[N_LISTENERS + 1];
+    int n_fds = 0;
+    uint8_t present = 0; /* bit i is set if listener i is handed over */
+    for (int i = 0; i < N_LISTENERS; i++) {
+        if (i != LISTEN_UPGRADE && listeners[i] != -1) {
+            fds[n_fds++] = listeners[i];
+            present |= (uint8_t) (1 << i);
+        }
+    }
+
+    int memfd = table_save(tbl);
+    if (memfd == -1) {
+        close(sock);
+        return;
+    }
+    fds[n_fds++] = memfd;
+
+    int status = send_fds(sock, fds, n_fds, &present, sizeof present);
+    close(memfd);
+    if (status == -1 || repl_attach(sock, tbl, false) == -1) {
+        close(sock);
+        return;
+    }
+
+    for (int i = 0; i < N_LISTENERS; i++) {
+        if (listeners[i] != -1) {
+            close(listeners[i]);
+            listeners[i] = -1;
+        }
+    }
+    draining = true;
+    drain_deadline_ns = now_ns() + DRAIN_TIMEOUT_NS;
+}
+
+/* true once a draining server has no clients left and sent all changes */
+bool drained(connection *conns, int n_conns) {
+    for (int i = 0; i < n_conns; i++) {
+        if (!conns[i].primary) {
+            return false;
+        }
+    }
+    for (int i = 0; i < n_replicas; i++) {
+        if (repl_wants_write(&replicas[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* serve clients on all listeners until the process is killed or has
+ * drained after handing over to a new server.
+ * Every connection has one entry in fds for its socket or doorbell and
+ * one for the control socket of a shared memory channel, followed by one
+ * entry per replica. If primary_sock is not -1 it is the replication
+ * stream of our primary and is served like a client, the same goes for
+ * predecessor_sock, the changes of the server we took over from */
+void event_loop(int listeners[N_LISTENERS], int primary_sock, int predecessor_sock, hash_table *tbl) {
+    connection *conns = calloc(MAX_CONNS, sizeof *conns);
+    struct pollfd *fds = calloc(N_LISTENERS + 2 * MAX_CONNS + MAX_REPLICAS, sizeof *fds);
+    int n_conns = 0;
+
+    if (primary_sock != -1 && conn_open(&conns[n_conns], primary_sock) == 0) {
+        conns[n_conns++].primary = true;
+    }
+    if (predecessor_sock != -1 && conn_open(&conns[n_conns], predecessor_sock) == 0) {
+        conns[n_conns].primary = true;
+        conns[n_conns++].predecessor = true;
+    }
+
+    /* FIXME keyboard interrupt */
+    while (!draining || (!drained(conns, n_conns) && now_ns() < drain_deadline_ns)) {
+        for (int i = 0; i < N_LISTENERS; i++) {
+            fds[i].fd = listeners[i];
+            fds[i].events = POLLIN;
+        }
+        for (int i = 0; i < n_conns; i++) {
+            struct pollfd *pfd = &fds[N_LISTENERS + 2 * i];
+            bool shm = conns[i].shm.channel != NULL;
+            pfd[0].fd = shm ? conns[i].shm.doorbell : conns[i].sock;
+            pfd[0].events = POLLIN;
+            /* the doorbell also rings when the client made room for
+             * responses, a socket waits for POLLOUT and takes no requests
+             * while the client does not read */
+            if (!shm && conn_backlogged(&conns[i])) {
+                pfd[0].events = 0;
+            }
+            if (!shm && (conns[i].out_end > conns[i].out_start
+                    || (conns[i].sub != NULL && sub_wants_write(conns[i].sub)))) {
+                pfd[0].events |= POLLOUT;
+            }
+            pfd[1].fd = shm ? conns[i].sock : -1;
+            pfd[1].events = POLLIN;
+        }
+        /* replicas never write, so input means they hung up */
+        struct pollfd *repl_fds = &fds[N_LISTENERS + 2 * n_conns];
+        int n_polled_replicas = n_replicas;
+        for (int i = 0; i < n_replicas; i++) {
+            repl_fds[i].fd = replicas[i].sock;
+            repl_fds[i].events = (short) (POLLIN | (repl_wants_write(&replicas[i]) ? POLLOUT : 0));
+        }
+
+        /* the trace is written while we would wait anyway */
+        if (trace != NULL) {
+            trace_flush(trace);
+        }
+
+        int timeout = draining ? DRAIN_POLL_MS : -1;
+        if (spin) {
+            timeout = 0;
+        }
+        if (poll(fds, (nfds_t) (N_LISTENERS + 2 * n_conns + n_replicas), timeout) == -1) {
+            if (errno != EINTR) {
+                fprintf(stderr, "poll: %s\n", strerror(errno));
+            }
+            continue;
+        }
+
+        /* backwards, so removing a connection does not skip another one */
+        for (int i = n_conns - 1; i >= 0; i--) {
+            struct pollfd *pfd = &fds[N_LISTENERS + 2 * i];
+            connection *conn = &conns[i];
+            bool closed = false;
+
+            if (pfd[1].revents) {
+                /* clients never write to the control socket, so this is a hang up */
+                closed = true;
+            } else {
+                if (conn->shm.channel != NULL && pfd[0].revents) {
+                    doorbell_clear(conn->shm.doorbell);
+                }
+                /* requests wait behind responses the client did not read,
+                 * a request that was incomplete is parsed again once more
+                 * input arrived */
+                closed = conn_flush(conn) == -1
+                    || conn_serve(conn, tbl, pfd[0].revents & ~POLLOUT) == -1;
+            }
+
+            /* changes made by connections served later in this round are
+             * pushed in the next one, poll returns at once for POLLOUT */
+            if (!closed && conn->sub != NULL) {
+                closed = sub_push(conn) == -1;
+            }
+
+            if (closed) {
+                if (conn->predecessor) {
+                    fprintf(stderr, "upgrade: the old server is done\n");
+                } else if (conn->primary) {
+                    fprintf(stderr, "replicate: lost the connection to the primary\n");
+                }
+                conn_close(conn);
+                *conn = conns[n_conns - 1];
+                n_conns--;
+            }
+        }
+
+        /* replicas attached in this round were not polled, they are at the end */
+        for (int i = n_polled_replicas - 1; i >= 0; i--) {
+            if (repl_fds[i].revents & (POLLIN | POLLERR | POLLHUP)) {
+                repl_detach(i);
+            }
+        }
+        /* send what this round changed right away */
+        for (int i = n_replicas - 1; i >= 0; i--) {
+            if (repl_pump(&replicas[i], tbl) == -1) {
+                repl_detach(i);
+            }
+        }
+
+        for (int i = 0; i < N_LISTENERS; i++) {
+            if (!(fds[i].revents & POLLIN) || listeners[i] == -1) {
+                continue;
+            }
+            if (i == LISTEN_UPGRADE) {
+                hand_over(listeners, tbl);
+            } else {
+                accept_client(listeners[i], (listener_type) i, conns, &n_conns);
+            }
+        }
+    }
+
+    for (int i = 0; i < n_conns; i++) {
+        conn_close(&conns[i]);
+    }
+    while (n_replicas > 0) {
+        repl_detach(n_replicas - 1);
+    }
+    free(fds);
+    free(conns);
+}
+
+/* connect to the primary at host and port and ask for its replication
+ * stream, returns the socket or -1 */
+int connect_primary(char *host, char *port) {
+    int status;
+    struct addrinfo hints;
+    struct addrinfo *primary_info;
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    if ((status = getaddrinfo(host, port, &hints, &primary_info)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    int sock = socket(primary_info->ai_family, primary_info->ai_socktype, primary_info->ai_protocol);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
         goto cleanup;
     }
 
-    status = listen(sock, 20);
-    if (status == -1) {
-        status = 1;
+    if (connect(sock, primary_info->ai_addr, primary_info->ai_addrlen) == -1) {
+        fprintf(stderr, "connect: %s\n", strerror(errno));
+        close(sock);
+        sock = -1;
+        goto cleanup;
+    }
+
+    char request[HEADER_LEN] = { (char) (command_mask | CMD_REPLICATE), 0, 0, 0, 0, 0 };
+    if (send(sock, request, sizeof request, 0) == -1) {
+        fprintf(stderr, "send: %s\n", strerror(errno));
+        close(sock);
+        sock = -1;
+    }
+
+cleanup:
+    freeaddrinfo(primary_info);
+    return sock;
+}
+
+/* listen on a tcp port, returns the socket or -1 */
+int listen_tcp(char *port) {
+    int status;
+    struct addrinfo hints;
+    struct addrinfo *servinfo;  // will point to the results
+
+    memset(&hints, 0, sizeof hints); // make sure the struct is empty
+    hints.ai_family = AF_UNSPEC;     // don't care IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
+    hints.ai_flags = AI_PASSIVE;     // fill in my IP for me
+
+    if ((status = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) {
+        fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(status));
+        return -1;
+    }
+
+    int sock = socket(servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    if (bind(sock, servinfo->ai_addr, servinfo->ai_addrlen) == -1) {
         fprintf(stderr, "bind: %s\n", strerror(errno));
+        close(sock);
+        sock = -1;
         goto cleanup;
     }
 
-    /* FIXME keyboard interrupt */
-    while (1) {
-        serve(sock, tbl);
+    if (listen(sock, 20) == -1) {
+        fprintf(stderr, "listen: %s\n", strerror(errno));
+        close(sock);
+        sock = -1;
     }
 
 cleanup:
-    close(sock);
     freeaddrinfo(servinfo);
+    return sock;
+}
+
+/* connect to the upgrade socket of a running server at path and take its
+ * listeners and table, see hand_over. Returns the socket the old server
+ * streams its remaining changes on, or -1 */
+int take_over(char *path, int listeners[N_LISTENERS], hash_table *tbl) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+
+    if (connect(sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        fprintf(stderr, "connect: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int fds[MAX_HANDOVER_FDS];
+    uint8_t present;
+    int n_fds = recv_fds(sock, fds, MAX_HANDOVER_FDS, &present, sizeof present);
+    if (n_fds < 1) {
+        close(sock);
+        return -1;
+    }
+
+    /* the listeners in order, the snapshot last */
+    int memfd = fds[n_fds - 1];
+    int n = 0;
+    for (int i = 0; i < N_LISTENERS && n < n_fds - 1; i++) {
+        if (present & (1 << i)) {
+            listeners[i] = fds[n++];
+        }
+    }
+
+    int status = table_load(tbl, memfd);
+    close(memfd);
+    if (status == -1) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/* what main read from the command line */
+typedef struct server_options {
+    char *port;
+    char *unix_path;     /* NULL for tcp only */
+    char *primary_host;  /* NULL unless the server is a replica */
+    char *primary_port;
+    char *upgrade_path;  /* where a new server may take over, or NULL */
+    char *takeover_path; /* upgrade socket of the server we replace, or NULL */
+    bool ordered;
+    int cpu;             /* the cpu to run on, -1 for any */
+    int busy_poll_us;
+    bool spin;
+    char *trace_path;    /* record requests there, or NULL */
+    bool trace_values;   /* with the hash of every value */
+} server_options;
+
+/* serve on a tcp port and, if unix_path is given, on a unix domain socket at
+ * unix_path and a shared memory listener at unix_path.shm. If primary_host
+ * is given the server is a read only replica of the server there. With
+ * ordered the keys are also kept in order for scans. With takeover_path
+ * the listeners and the table are taken from the server listening for an
+ * upgrade there, which then exits. cpu, busy_poll_us and spin trade cpu
+ * time for latency. With trace_path requests are recorded for replay */
+int run_server(server_options *opts) {
+    if (opts->cpu != -1 && pin_to_cpu(opts->cpu) == -1) {
+        return 1;
+    }
+    busy_poll_us = opts->busy_poll_us;
+    spin = opts->spin;
+    /* the debug log stays off the hot path, the default build leaves it
+     * out and needs no log thread */
+    if (log_enabled(LOG_DEBUG) && log_open(stdout) == -1) {
+        return 1;
+    }
+    if (opts->trace_path != NULL) {
+        trace = trace_open(opts->trace_path, opts->trace_values);
+        if (trace == NULL) {
+            log_close();
+            return 1;
+        }
+    }
+
+    hash_table *tbl = ht_create();
+    int listeners[N_LISTENERS];
+    int primary_sock = -1;
+    int predecessor_sock = -1;
+    int status = 1;
+
+    for (int i = 0; i < N_LISTENERS; i++) {
+        listeners[i] = -1;
+    }
+
+    if (opts->ordered && ht_enable_index(tbl) == -1) {
+        fprintf(stderr, "ht_enable_index: out of memory\n");
+        goto cleanup;
+    }
+
+    if (opts->takeover_path != NULL) {
+        predecessor_sock = take_over(opts->takeover_path, listeners, tbl);
+        if (predecessor_sock == -1) {
+            goto cleanup;
+        }
+    }
+
+    if (listeners[LISTEN_TCP] == -1) {
+        listeners[LISTEN_TCP] = listen_tcp(opts->port);
+        if (listeners[LISTEN_TCP] == -1) {
+            goto cleanup;
+        }
+    }
+    /* more than net.core.busy_read needs CAP_NET_ADMIN */
+    if (set_busy_poll(listeners[LISTEN_TCP]) == -1) {
+        fprintf(stderr, "busy poll: %s\n", strerror(errno));
+        goto cleanup;
+    }
+
+    if (opts->unix_path != NULL && listeners[LISTEN_UNIX] == -1) {
+        char shm_path[sizeof ((struct sockaddr_un *) 0)->sun_path];
+        snprintf(shm_path, sizeof shm_path, "%s.shm", opts->unix_path);
+
+        listeners[LISTEN_UNIX] = listen_unix(opts->unix_path);
+        listeners[LISTEN_SHM] = listen_unix(shm_path);
+        if (listeners[LISTEN_UNIX] == -1 || listeners[LISTEN_SHM] == -1) {
+            goto cleanup;
+        }
+    }
+
+    /* after take_over, the old server is done with the path */
+    if (opts->upgrade_path != NULL) {
+        listeners[LISTEN_UPGRADE] = listen_unix(opts->upgrade_path);
+        if (listeners[LISTEN_UPGRADE] == -1) {
+            goto cleanup;
+        }
+    }
+
+    if (opts->primary_host != NULL) {
+        primary_sock = connect_primary(opts->primary_host, opts->primary_port);
+        if (primary_sock == -1) {
+            goto cleanup;
+        }
+        read_only = true;
+    }
+
+    event_loop(listeners, primary_sock, predecessor_sock, tbl);
+    status = 0;
+    predecessor_sock = -1; /* closed by event_loop */
+
+cleanup:
+    for (int i = 0; i < N_LISTENERS; i++) {
+        if (listeners[i] != -1) {
+            close(listeners[i]);
+        }
+    }
+    if (predecessor_sock != -1) {
+        close(predecessor_sock);
+    }
+    if (trace != NULL) {
+        trace_close(trace);
+        trace = NULL;
+    }
+    log_close();
     ht_destroy(tbl);
     return status;
 }
 
 #ifndef TEST
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        printf("usage: %s <port>", argv[0]);
+    server_options opts;
+    bool usage = false;
+    int opt;
+
+    memset(&opts, 0, sizeof opts);
+    opts.cpu = -1;
+    while ((opt = getopt(argc, argv, "ir:u:t:c:b:sT:V")) != -1) {
+        if (opt == 'i') {
+            opts.ordered = true;
+        } else if (opt == 'r' && strrchr(optarg, ':') != NULL) {
+            /* host:port, the host may contain colons itself */
+            opts.primary_host = optarg;
+            opts.primary_port = strrchr(optarg, ':');
+            *opts.primary_port++ = '\0';
+        } else if (opt == 'u') {
+            opts.upgrade_path = optarg;
+        } else if (opt == 't') {
+            opts.takeover_path = optarg;
+        } else if (opt == 'c') {
+            opts.cpu = atoi(optarg);
+        } else if (opt == 'b') {
+            opts.busy_poll_us = atoi(optarg);
+        } else if (opt == 's') {
+            opts.spin = true;
+        } else if (opt == 'T') {
+            opts.trace_path = optarg;
+        } else if (opt == 'V') {
+            opts.trace_values = true;
+        } else {
+            usage = true;
+        }
+    }
+
+    int n_args = argc - optind;
+    if (usage || (n_args != 1 && n_args != 2)) {
+        printf("usage: %s [-i] [-r <primary host>:<primary port>] [-u <upgrade socket path>] "
+               "[-t <upgrade socket path of the old server>] [-c <cpu>] [-b <busy poll us>] [-s] "
+               "[-T <trace path> [-V]] <port> [<unix socket path>]\n", argv[0]);
+        return 1;
     }
 
-    return run_server(argv[1]);
+    opts.port = argv[optind];
+    opts.unix_path = n_args == 2 ? argv[optind + 1] : NULL;
+    return run_server(&opts);
 }
 #endif
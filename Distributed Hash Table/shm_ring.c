@@ -0,0 +1,282 @@
+#define _GNU_SOURCE /* memfd_create */
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+#include "shm_ring.h"
+
+size_t ring_readable(shm_ring *ring) {
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    return (size_t) (head - ring->tail);
+}
+
+size_t ring_writable(shm_ring *ring) {
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    return SHM_RING_LEN - (size_t) (ring->head - tail);
+}
+
+/* consume len bytes, the caller checked ring_readable */
+void ring_read(shm_ring *ring, void *dest, size_t len) {
+    size_t offset = ring->tail % SHM_RING_LEN;
+    size_t first = SHM_RING_LEN - offset < len ? SHM_RING_LEN - offset : len;
+    memcpy(dest, ring->data + offset, first);
+    memcpy((char *) dest + first, ring->data, len - first);
+    __atomic_store_n(&ring->tail, ring->tail + len, __ATOMIC_RELEASE);
+}
+
+/* append len bytes, the caller checked ring_writable */
+void ring_write(shm_ring *ring, const void *src, size_t len) {
+    size_t offset = ring->head % SHM_RING_LEN;
+    size_t first = SHM_RING_LEN - offset < len ? SHM_RING_LEN - offset : len;
+    memcpy(ring->data + offset, src, first);
+    memcpy(ring->data, (const char *) src + first, len - first);
+    __atomic_store_n(&ring->head, ring->head + len, __ATOMIC_RELEASE);
+}
+
+void doorbell_ring(int doorbell) {
+    uint64_t one = 1;
+    if (write(doorbell, &one, sizeof one) == -1) {
+        fprintf(stderr, "doorbell_ring: %s\n", strerror(errno));
+    }
+}
+
+/* block until the doorbell was rung at least once since the last wait */
+void doorbell_wait(int doorbell) {
+    uint64_t count;
+    while (read(doorbell, &count, sizeof count) == -1 && errno == EINTR) {
+    }
+}
+
+/* reset the server's doorbell after poll found it rung, it is non-blocking
+ * so this never waits */
+void doorbell_clear(int doorbell) {
+    uint64_t count;
+    while (read(doorbell, &count, sizeof count) == -1 && errno == EINTR) {
+    }
+}
+
+/* map the channel of memfd */
+static shm_channel *map_channel(int memfd) {
+    void *addr = mmap(NULL, sizeof (shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (addr == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return NULL;
+    }
+    return addr;
+}
+
+/* create a channel for the client connected to control_sock and pass the
+ * memfd and both doorbells to it. The control socket stays open, it tells
+ * the server when the client goes away */
+int shm_accept(int control_sock, shm_endpoint *ep) {
+    int fds[3] = { -1, -1, -1 };
+    fds[0] = memfd_create("kv_shm_channel", MFD_CLOEXEC);
+    fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK); /* server doorbell */
+    fds[2] = eventfd(0, EFD_CLOEXEC); /* client doorbell */
+    if (fds[0] == -1 || fds[1] == -1 || fds[2] == -1) {
+        fprintf(stderr, "shm_accept: %s\n", strerror(errno));
+        goto error;
+    }
+    if (ftruncate(fds[0], sizeof (shm_channel)) == -1) {
+        fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+        goto error;
+    }
+
+    ep->channel = map_channel(fds[0]);
+    if (ep->channel == NULL) {
+        goto error;
+    }
+    ep->in = &ep->channel->requests;
+    ep->out = &ep->channel->responses;
+    ep->doorbell = fds[1];
+    ep->peer_doorbell = fds[2];
+
+    char dummy = 0;
+    struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof fds)];
+    memset(control, 0, sizeof control);
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof fds);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof fds);
+
+    if (sendmsg(control_sock, &msg, 0) == -1) {
+        fprintf(stderr, "sendmsg: %s\n", strerror(errno));
+        munmap(ep->channel, sizeof (shm_channel));
+        goto error;
+    }
+
+    /* the client keeps its own mapping */
+    close(fds[0]);
+    return 0;
+
+error:
+    for (int i = 0; i < 3; i++) {
+        if (fds[i] != -1) {
+            close(fds[i]);
+        }
+    }
+    ep->channel = NULL;
+    return -1;
+}
+
+/* connect to the shared memory listener at path, the returned control
+ * socket has to stay open as long as the channel is used */
+int shm_connect(char *path, shm_endpoint *ep) {
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock == -1) {
+        fprintf(stderr, "socket: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+    if (connect(sock, (struct sockaddr *) &addr, sizeof addr) == -1) {
+        fprintf(stderr, "connect: %s\n", strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    int fds[3];
+    char dummy;
+    struct iovec iov = { .iov_base = &dummy, .iov_len = 1 };
+    char control[CMSG_SPACE(sizeof fds)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    struct cmsghdr *cmsg;
+    if (recvmsg(sock, &msg, 0) <= 0 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL
+            || cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof fds)) {
+        fprintf(stderr, "shm_connect: no channel received\n");
+        close(sock);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof fds);
+
+    ep->channel = map_channel(fds[0]);
+    close(fds[0]);
+    if (ep->channel == NULL) {
+        close(fds[1]);
+        close(fds[2]);
+        close(sock);
+        return -1;
+    }
+    ep->in = &ep->channel->responses;
+    ep->out = &ep->channel->requests;
+    ep->doorbell = fds[2];
+    ep->peer_doorbell = fds[1];
+
+    return sock;
+}
+
+void shm_close(shm_endpoint *ep) {
+    if (ep->channel == NULL) {
+        return;
+    }
+    munmap(ep->channel, sizeof (shm_channel));
+    close(ep->doorbell);
+    close(ep->peer_doorbell);
+    ep->channel = NULL;
+}
+
+/* like recv, read up to len bytes without waiting, returns -1 with errno
+ * EAGAIN if the ring is empty */
+ssize_t shm_try_recv(shm_endpoint *ep, void *dest, size_t len) {
+    size_t available = ring_readable(ep->in);
+    if (available == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (available > len) {
+        available = len;
+    }
+    /* a full ring means the other side may wait for space */
+    bool was_full = ring_writable(ep->in) == 0;
+    ring_read(ep->in, dest, available);
+    if (was_full) {
+        doorbell_ring(ep->peer_doorbell);
+    }
+    return (ssize_t) available;
+}
+
+/* like recv, read up to len bytes, blocks until at least one is available */
+ssize_t shm_recv(shm_endpoint *ep, void *dest, size_t len) {
+    ssize_t status;
+    while ((status = shm_try_recv(ep, dest, len)) == -1) {
+        doorbell_wait(ep->doorbell);
+    }
+    return status;
+}
+
+/* like writev without waiting, writes as much as fits into the ring and
+ * returns -1 with errno EAGAIN if nothing does. The other side rings our
+ * doorbell when it reads from a full ring */
+ssize_t shm_try_writev(shm_endpoint *ep, const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        size_t space = ring_writable(ep->out);
+        size_t len = iov[i].iov_len < space ? iov[i].iov_len : space;
+        ring_write(ep->out, iov[i].iov_base, len);
+        total += (ssize_t) len;
+        if (len < iov[i].iov_len) {
+            break;
+        }
+    }
+
+    if (total == 0 && ring_writable(ep->out) == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    doorbell_ring(ep->peer_doorbell);
+    return total;
+}
+
+/* like writev, blocks until everything is in the ring */
+ssize_t shm_writev(shm_endpoint *ep, const struct iovec *iov, int iovcnt) {
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+        const char *src = iov[i].iov_base;
+        size_t len = iov[i].iov_len;
+        while (len > 0) {
+            size_t space;
+            while ((space = ring_writable(ep->out)) == 0) {
+                doorbell_ring(ep->peer_doorbell);
+                doorbell_wait(ep->doorbell);
+            }
+            if (space > len) {
+                space = len;
+            }
+            ring_write(ep->out, src, space);
+            src += space;
+            len -= space;
+            total += (ssize_t) space;
+        }
+    }
+
+    doorbell_ring(ep->peer_doorbell);
+    return total;
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* capacity of one direction of a shared memory channel */
+#define SHM_RING_LEN (1 << 20)
+
+/* single producer, single consumer byte ring. head and tail count all bytes
+ * ever written and read, they live on separate cache lines */
+typedef struct shm_ring {
+    uint64_t head;
+    char head_pad[56];
+    uint64_t tail;
+    char tail_pad[56];
+    char data[SHM_RING_LEN];
+} shm_ring;
+
+/* a client writes frames into requests and the server answers into
+ * responses, each side rings the other's doorbell (an eventfd) after it
+ * made progress */
+typedef struct shm_channel {
+    shm_ring requests;
+    shm_ring responses;
+} shm_channel;
+
+/* one side of a channel */
+typedef struct shm_endpoint {
+    shm_channel *channel;
+    shm_ring *in;
+    shm_ring *out;
+    int doorbell;      /* rung by the other side */
+    int peer_doorbell; /* rung by us */
+} shm_endpoint;
+
+size_t ring_readable(shm_ring *ring);
+size_t ring_writable(shm_ring *ring);
+void ring_read(shm_ring *ring, void *dest, size_t len);
+void ring_write(shm_ring *ring, const void *src, size_t len);
+
+void doorbell_ring(int doorbell);
+void doorbell_wait(int doorbell);
+void doorbell_clear(int doorbell);
+
+int shm_accept(int control_sock, shm_endpoint *ep);
+int shm_connect(char *path, shm_endpoint *ep);
+void shm_close(shm_endpoint *ep);
+ssize_t shm_recv(shm_endpoint *ep, void *dest, size_t len);
+ssize_t shm_try_recv(shm_endpoint *ep, void *dest, size_t len);
+ssize_t shm_writev(shm_endpoint *ep, const struct iovec *iov, int iovcnt);
+ssize_t shm_try_writev(shm_endpoint *ep, const struct iovec *iov, int iovcnt);
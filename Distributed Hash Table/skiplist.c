@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "skiplist.h"
+
+/* compare two keys, the result has the sign of a - b */
+int sl_compare(void *a, size_t a_len, void *b, size_t b_len) {
+    int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (cmp != 0) {
+        return cmp;
+    }
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/* allocate a node with level forward pointers, returns NULL if out of memory */
+static sl_node *node_create(int level) {
+    sl_node *node = calloc(1, sizeof *node + (size_t) level * sizeof node->next[0]);
+    if (node != NULL) {
+        node->level = level;
+    }
+    return node;
+}
+
+/* allocate an empty skiplist, returns NULL if out of memory */
+skiplist *sl_create(void) {
+    skiplist *sl = malloc(sizeof *sl);
+    if (sl == NULL) {
+        return NULL;
+    }
+    sl->head = node_create(SL_MAX_LEVEL);
+    if (sl->head == NULL) {
+        free(sl);
+        return NULL;
+    }
+    sl->level = 1;
+    sl->n_nodes = 0;
+    sl->rng = 0x9E3779B97F4A7C15ULL;
+    return sl;
+}
+
+/* every level holds a quarter of the nodes of the level below */
+static int random_level(skiplist *sl) {
+    /* xorshift64 */
+    sl->rng ^= sl->rng << 13;
+    sl->rng ^= sl->rng >> 7;
+    sl->rng ^= sl->rng << 17;
+
+    uint64_t bits = sl->rng;
+    int level = 1;
+    while (level < SL_MAX_LEVEL && (bits & 3) == 0) {
+        bits >>= 2;
+        level++;
+    }
+    return level;
+}
+
+/* fill update with the last node before key on every level */
+static void find_predecessors(skiplist *sl, void *key, size_t key_len, sl_node **update) {
+    sl_node *node = sl->head;
+    for (int i = sl->level - 1; i >= 0; i--) {
+        while (node->next[i] != NULL
+                && sl_compare(node->next[i]->key, node->next[i]->key_len, key, key_len) < 0) {
+            node = node->next[i];
+        }
+        update[i] = node;
+    }
+}
+
+/* insert key or replace the data of an existing key,
+ * returns -1 if out of memory */
+int sl_insert(skiplist *sl, void *key, size_t key_len, void *data) {
+    sl_node *update[SL_MAX_LEVEL];
+    find_predecessors(sl, key, key_len, update);
+
+    sl_node *next = update[0]->next[0];
+    if (next != NULL && sl_compare(next->key, next->key_len, key, key_len) == 0) {
+        next->key = key;
+        next->data = data;
+        return 0;
+    }
+
+    int level = random_level(sl);
+    sl_node *node = node_create(level);
+    if (node == NULL) {
+        return -1;
+    }
+    node->key = key;
+    node->key_len = key_len;
+    node->data = data;
+
+    for (int i = sl->level; i < level; i++) {
+        update[i] = sl->head;
+    }
+    if (level > sl->level) {
+        sl->level = level;
+    }
+
+    for (int i = 0; i < level; i++) {
+        node->next[i] = update[i]->next[i];
+        update[i]->next[i] = node;
+    }
+    sl->n_nodes++;
+
+    return 0;
+}
+
+/* remove key, returns -1 if it is not in the list */
+int sl_remove(skiplist *sl, void *key, size_t key_len) {
+    sl_node *update[SL_MAX_LEVEL];
+    find_predecessors(sl, key, key_len, update);
+
+    sl_node *node = update[0]->next[0];
+    if (node == NULL || sl_compare(node->key, node->key_len, key, key_len) != 0) {
+        return -1;
+    }
+
+    for (int i = 0; i < node->level; i++) {
+        update[i]->next[i] = node->next[i];
+    }
+    while (sl->level > 1 && sl->head->next[sl->level - 1] == NULL) {
+        sl->level--;
+    }
+    free(node);
+    sl->n_nodes--;
+
+    return 0;
+}
+
+/* the first node with a key not less than key, or NULL. The nodes after
+ * it follow in order through next[0] */
+sl_node *sl_seek(skiplist *sl, void *key, size_t key_len) {
+    sl_node *update[SL_MAX_LEVEL];
+    find_predecessors(sl, key, key_len, update);
+    return update[0]->next[0];
+}
+
+/* remove all nodes */
+void sl_clear(skiplist *sl) {
+    sl_node *node = sl->head->next[0];
+    while (node != NULL) {
+        sl_node *next = node->next[0];
+        free(node);
+        node = next;
+    }
+    memset(sl->head->next, 0, SL_MAX_LEVEL * sizeof sl->head->next[0]);
+    sl->level = 1;
+    sl->n_nodes = 0;
+}
+
+void sl_destroy(skiplist *sl) {
+    sl_clear(sl);
+    free(sl->head);
+    free(sl);
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/* a node has between 1 and SL_MAX_LEVEL forward pointers */
+#define SL_MAX_LEVEL 16
+
+/* keys are ordered like memcmp, a key sorts before its extensions. The
+ * key memory belongs to whoever inserted it and has to stay valid until
+ * the node is removed */
+typedef struct sl_node {
+    void *key;
+    size_t key_len;
+    void *data;
+    int level;
+    struct sl_node *next[];
+} sl_node;
+
+typedef struct skiplist {
+    sl_node *head;
+    int level;    /* highest level in use */
+    size_t n_nodes;
+    uint64_t rng; /* state of the level generator */
+} skiplist;
+
+skiplist *sl_create(void);
+int sl_insert(skiplist *sl, void *key, size_t key_len, void *data);
+int sl_remove(skiplist *sl, void *key, size_t key_len);
+sl_node *sl_seek(skiplist *sl, void *key, size_t key_len);
+int sl_compare(void *a, size_t a_len, void *b, size_t b_len);
+void sl_clear(skiplist *sl);
+void sl_destroy(skiplist *sl);
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+
+static op_stats stats[N_OPS];
+
+static const char *op_names[N_OPS] = {
+    "get",
+    "set",
+    "delete",
+    "batch"
+};
+
+/* monotonic time in nanoseconds, not affected by changes of the wall clock */
+uint64_t now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/* small values get a bucket each, larger values share a bucket with the
+ * values that have the same most significant bit and the next HIST_SUB_BITS */
+static size_t bucket_index(uint64_t value) {
+    if (value < HIST_SUB_BUCKETS) {
+        return value;
+    }
+
+    int msb = 63 - __builtin_clzll(value);
+    size_t sub = (value >> (msb - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+    return (size_t) (msb - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+/* largest value that falls into bucket index */
+static uint64_t bucket_value(size_t index) {
+    if (index < HIST_SUB_BUCKETS) {
+        return index;
+    }
+
+    int msb = (int) (index / HIST_SUB_BUCKETS) + HIST_SUB_BITS - 1;
+    uint64_t sub = index % HIST_SUB_BUCKETS;
+    return ((HIST_SUB_BUCKETS + sub + 1) << (msb - HIST_SUB_BITS)) - 1;
+}
+
+void hist_record(histogram *h, uint64_t value) {
+    h->buckets[bucket_index(value)]++;
+    h->count++;
+    h->sum += value;
+    if (value > h->max) {
+        h->max = value;
+    }
+}
+
+/* value below which a fraction p of the recorded values lie */
+uint64_t hist_percentile(histogram *h, double p) {
+    if (h->count == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t) (p * (double) h->count);
+    if (rank >= h->count) {
+        rank = h->count - 1;
+    }
+
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            uint64_t value = bucket_value(i);
+            return value < h->max ? value : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+void stats_record(op_type op, uint64_t queue_ns, uint64_t process_ns, size_t bytes_in, size_t bytes_out) {
+    op_stats *s = &stats[op];
+    hist_record(&s->queue_ns, queue_ns);
+    hist_record(&s->process_ns, process_ns);
+    hist_record(&s->bytes_in, bytes_in);
+    hist_record(&s->bytes_out, bytes_out);
+}
+
+static size_t dump_histogram(char *out, size_t out_len, const char *op, const char *name, histogram *h) {
+    int len = snprintf(out, out_len,
+            "%s %s count=%llu mean=%llu p50=%llu p99=%llu p999=%llu max=%llu\n",
+            op, name, (unsigned long long) h->count,
+            (unsigned long long) (h->count ? h->sum / h->count : 0),
+            (unsigned long long) hist_percentile(h, 0.5),
+            (unsigned long long) hist_percentile(h, 0.99),
+            (unsigned long long) hist_percentile(h, 0.999),
+            (unsigned long long) h->max);
+
+    if (len < 0 || out_len == 0) {
+        return 0;
+    }
+    return (size_t) len < out_len ? (size_t) len : out_len - 1;
+}
+
+/* write a human readable summary of all operations to out,
+ * returns the number of bytes written */
+size_t stats_dump(char *out, size_t out_len) {
+    size_t len = 0;
+    for (int op = 0; op < N_OPS; op++) {
+        op_stats *s = &stats[op];
+        if (s->queue_ns.count == 0) {
+            continue;
+        }
+        len += dump_histogram(out + len, out_len - len, op_names[op], "queue_ns", &s->queue_ns);
+        len += dump_histogram(out + len, out_len - len, op_names[op], "process_ns", &s->process_ns);
+        len += dump_histogram(out + len, out_len - len, op_names[op], "bytes_in", &s->bytes_in);
+        len += dump_histogram(out + len, out_len - len, op_names[op], "bytes_out", &s->bytes_out);
+    }
+
+    return len;
+}
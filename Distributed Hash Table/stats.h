@@ -0,0 +1,36 @@
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+/* each power of two is split into 2^HIST_SUB_BITS buckets,
+ * so a recorded value is off by at most 1/16 */
+#define HIST_SUB_BITS 4
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+typedef struct histogram {
+    uint64_t count;
+    uint64_t sum;
+    uint64_t max;
+    uint64_t buckets[HIST_BUCKETS];
+} histogram;
+
+typedef enum op_type {
+    OP_GET,
+    OP_SET,
+    OP_DELETE,
+    OP_BATCH,
+    N_OPS
+} op_type;
+
+typedef struct op_stats {
+    histogram queue_ns;   /* time a complete request waited in the buffer */
+    histogram process_ns; /* time from parsing to the sent response */
+    histogram bytes_in;
+    histogram bytes_out;
+} op_stats;
+
+uint64_t now_ns(void);
+void hist_record(histogram *h, uint64_t value);
+uint64_t hist_percentile(histogram *h, double p);
+void stats_record(op_type op, uint64_t queue_ns, uint64_t process_ns, size_t bytes_in, size_t bytes_out);
+size_t stats_dump(char *out, size_t out_len);
@@ -30,6 +30,11 @@ int main() {
     assert(ht_get_value(tbl, "key1", 4, &res, &res_len) == 0);
     assert(memcmp(res, "new-value", 9) == 0);
 
+    /* every set hands out a new version */
+    assert(ht_find(tbl, "key1", 4)->version == 4);
+    assert(ht_find(tbl, "key2", 4)->version == 2);
+    assert(ht_find(tbl, "non-existant", 12) == NULL);
+
     assert(ht_delete_key(tbl, "key2", 4) == 0);
     assert(ht_delete_key(tbl, "key3", 4) == 0);
     assert(ht_delete_key(tbl, "non-existant", 12) == -1);
@@ -66,6 +71,17 @@ int main() {
         assert(memcmp(value, res, value_len) == 0);
     }
 
+    /* the index holds every key once, in order */
+    assert(ht_enable_index(tbl) == 0);
+    assert(tbl->index->n_nodes == tbl->n_elems);
+    for (sl_node *node = tbl->index->head->next[0]; node->next[0] != NULL; node = node->next[0]) {
+        sl_node *next = node->next[0];
+        assert(sl_compare(node->key, node->key_len, next->key, next->key_len) < 0);
+    }
+    assert(ht_set_value(tbl, "new", 3, "value", 5) == 0);
+    assert(sl_seek(tbl->index, "new", 3)->data == ht_find(tbl, "new", 3));
+    assert(ht_delete_key(tbl, "new", 3) == 0);
+
     /* delete, delete, get */
     for (int i = 0; i < N_TESTS; i++) {
         char key[BUFFER_LEN];
@@ -84,6 +100,7 @@ int main() {
         assert(ht_get_value(tbl, key, key_len, &res, &res_len) == -1);
         assert(res == NULL);
     }
+    assert(tbl->index->n_nodes == 0);
     ht_destroy(tbl);
 
     printf("all tests passed.\n");
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE /* memfd_create in shm_ring.c */
 #include <stdlib.h>
 #include <stdio.h>
 #include <sys/types.h>
@@ -7,21 +8,44 @@
 #include <string.h>
 #include <errno.h>
 #include <assert.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 #define TEST
 #include "server.c"
 #include "hash_table.c"
+#include "skiplist.c"
+#include "stats.c"
+#include "shm_ring.c"
+#include "upgrade.c"
+#include "trace.c"
+#include "log.c"
 
 #define DEL 1
 #define SET 2
 #define GET 4
 #define ACK 8
+#define BATCH 16
+#define EXT 32
+/* a command frame with the given code */
+#define CMD(code) ((char) (128 | (code)))
+/* client id 7 and a request id, the key of an idempotent request */
+#define IDS(request) 0, 0, 0, 0, 0, 0, 0, 7, 0, 0, 0, 0, 0, 0, 0, request
 
 #define SERVER_PORT "2000"
+#define TRACE_PATH "/tmp/test_server.trace"
+#define PARTIAL_PATH "/tmp/test_server_partial"
+#define PARTIAL_SHM_PATH "/tmp/test_server_partial_shm"
+/* gets of a large value whose responses a client does not read for a while */
+#define LARGE_LEN 60000
+#define N_LARGE_GETS 100
+/* a client of serve_client that sends nothing for that long is closed, a
+ * malformed request that stays incomplete ends like that */
+#define CLIENT_IDLE_MS 1000
 
 #define MAX_LEN 256
 #define N_MALFORMED 7
-#define N_MSGS 9
+#define N_MSGS 28
 
 char malformed_msgs[N_MALFORMED][MAX_LEN] = {
     /* completely malformed, no complete header */
@@ -59,7 +83,33 @@ char msgs[N_MSGS][MAX_LEN] = {
     {GET, 7, 0, 1, 0, 0, 'b'},
     {DEL, 8, 0, 1, 0, 0, 'a'},
     {GET, 9, 0, 1, 0, 0, 'a'},
-    {DEL, 10, 0, 1, 0, 0, 'a'}
+    {DEL, 10, 0, 1, 0, 0, 'a'},
+    /* batch of a set and a get, 15 bytes of body */
+    {BATCH, 11, 0, 2, 0, 15, SET, 1, 0, 1, 0, 1, 'c', '4', GET, 2, 0, 1, 0, 0, 'c'},
+    /* extended frames with 32 bit lengths */
+    {EXT | SET, 12, 0, 0, 0, 1, 0, 0, 0, 1, 'd', '5'},
+    {EXT | GET, 13, 0, 0, 0, 1, 0, 0, 0, 0, 'd'},
+    /* set if absent, compare and swap and counters, 'e' gets version 6 */
+    {CMD(3), 14, 0, 1, 0, 1, 'e', '1'},
+    {CMD(3), 15, 0, 1, 0, 1, 'e', '9'},
+    {CMD(4), 16, 0, 1, 0, 9, 'e', 0, 0, 0, 0, 0, 0, 0, 6, '2'},
+    {CMD(4), 17, 0, 1, 0, 9, 'e', 0, 0, 0, 0, 0, 0, 0, 6, '3'},
+    {CMD(5), 18, 0, 1, 0, 8, 'f', 0, 0, 0, 0, 0, 0, 0, 5},
+    {CMD(6), 19, 0, 1, 0, 0, 'f'},
+    /* a page of two keys from the start, then the keys starting with 'e' */
+    {CMD(7), 20, 0, 0, 0, 3, 0, 0, 2},
+    {CMD(7), 21, 0, 0, 0, 4, 3, 0, 0, 'e'},
+    /* idempotent requests, a retry of request 1 is answered from the cache,
+     * after request 100 request 2 is too old to tell. request 99 arrives
+     * after 100 and is not executed, it could undo what 100 did */
+    {CMD(18), 22, 0, 16, 0, 8, IDS(1), SET, 1, 0, 1, 0, 1, 'g', '1'},
+    {CMD(18), 23, 0, 16, 0, 8, IDS(2), SET, 2, 0, 1, 0, 1, 'g', '2'},
+    {CMD(18), 24, 0, 16, 0, 8, IDS(1), SET, 3, 0, 1, 0, 1, 'g', '1'},
+    {GET, 25, 0, 1, 0, 0, 'g'},
+    {CMD(18), 26, 0, 16, 0, 7, IDS(100), DEL, 4, 0, 1, 0, 0, 'g'},
+    {CMD(18), 27, 0, 16, 0, 8, IDS(2), SET, 5, 0, 1, 0, 1, 'g', '2'},
+    {CMD(18), 28, 0, 16, 0, 8, IDS(99), SET, 6, 0, 1, 0, 1, 'g', '3'},
+    {GET, 29, 0, 1, 0, 0, 'g'}
 };
 
 char expected_msgs[N_MSGS][MAX_LEN] = {
@@ -71,7 +121,26 @@ char expected_msgs[N_MSGS][MAX_LEN] = {
     {ACK | GET, 7, 0, 1, 0, 1, 'b', '3'},
     {ACK | DEL, 8, 0, 0, 0, 0},
     {ACK, 9, 0, 0, 0, 0},
-    {ACK, 10, 0, 0, 0, 0}
+    {ACK, 10, 0, 0, 0, 0},
+    {BATCH | ACK, 11, 0, 2, 0, 0, ACK | SET, 1, 0, 0, 0, 0, ACK | GET, 2, 0, 1, 0, 1, 'c', '4'},
+    {EXT | ACK | SET, 12, 0, 0, 0, 0, 0, 0, 0, 0},
+    {EXT | ACK | GET, 13, 0, 0, 0, 1, 0, 0, 0, 1, 'd', '5'},
+    {CMD(3 | ACK), 14, 0, 1, 0, 8, 'e', 0, 0, 0, 0, 0, 0, 0, 6},
+    {CMD(3 | ACK), 15, 0, 0, 0, 8, 0, 0, 0, 0, 0, 0, 0, 6},
+    {CMD(4 | ACK), 16, 0, 1, 0, 8, 'e', 0, 0, 0, 0, 0, 0, 0, 7},
+    {CMD(4 | ACK), 17, 0, 0, 0, 9, 0, 0, 0, 0, 0, 0, 0, 7, '2'},
+    {CMD(5 | ACK), 18, 0, 1, 0, 8, 'f', 0, 0, 0, 0, 0, 0, 0, 5},
+    {CMD(6 | ACK), 19, 0, 1, 0, 8, 'f', 0, 0, 0, 0, 0, 0, 0, 4},
+    {CMD(7 | ACK), 20, 0, 1, 0, 6, 'd', 0, 1, 'b', 0, 1, 'c'},
+    {CMD(7 | ACK), 21, 0, 0, 0, 8, 0, 1, 'e', 0, 0, 0, 1, '2'},
+    {CMD(18 | ACK), 22, 0, 16, 0, 6, IDS(1), ACK | SET, 1, 0, 0, 0, 0},
+    {CMD(18 | ACK), 23, 0, 16, 0, 6, IDS(2), ACK | SET, 2, 0, 0, 0, 0},
+    {CMD(18 | ACK), 24, 0, 16, 0, 6, IDS(1), ACK | SET, 1, 0, 0, 0, 0},
+    {ACK | GET, 25, 0, 1, 0, 1, 'g', '2'},
+    {CMD(18 | ACK), 26, 0, 16, 0, 6, IDS(100), ACK | DEL, 4, 0, 0, 0, 0},
+    {CMD(18 | ACK), 27, 0, 0, 0, 0},
+    {CMD(18 | ACK), 28, 0, 0, 0, 0},
+    {ACK, 29, 0, 0, 0, 0}
 };
 
 int msg_lens[N_MSGS] = {
@@ -83,6 +152,25 @@ int msg_lens[N_MSGS] = {
     7,
     7,
     7,
+    7,
+    21,
+    12,
+    11,
+    8,
+    8,
+    16,
+    16,
+    15,
+    7,
+    9,
+    10,
+    30,
+    30,
+    30,
+    7,
+    29,
+    30,
+    30,
     7
 };
 
@@ -95,6 +183,25 @@ int expected_msg_lens[N_MSGS] = {
     8,
     6,
     6,
+    6,
+    20,
+    10,
+    12,
+    15,
+    14,
+    15,
+    15,
+    15,
+    15,
+    13,
+    14,
+    28,
+    28,
+    28,
+    8,
+    28,
+    6,
+    6,
     6
 };
 
@@ -158,17 +265,404 @@ void test_response(struct addrinfo *client_info) {
     }
 }
 
+/* accept a client and serve it like the event loop does, until it closes
+ * the connection or sends nothing for CLIENT_IDLE_MS */
+void serve_client(int server_sock, hash_table *tbl) {
+    int sock = accept(server_sock, NULL, NULL);
+    if (sock == -1) {
+        fprintf(stderr, "accept: %s\n", strerror(errno));
+        return;
+    }
+    connection conn;
+    assert(conn_open(&conn, sock) == 0);
+
+    bool closed = false;
+    while (!closed) {
+        struct pollfd pfd;
+        pfd.fd = conn.sock;
+        pfd.events = (short) (POLLIN | (conn.out_end > conn.out_start ? POLLOUT : 0));
+        if (poll(&pfd, 1, CLIENT_IDLE_MS) <= 0) {
+            break;
+        }
+        closed = conn_flush(&conn) == -1 || conn_serve(&conn, tbl, pfd.revents & ~POLLOUT) == -1;
+    }
+    conn_close(&conn);
+}
+
 void serve_responses(int server_sock, int n) {
     hash_table *tbl;
     tbl = ht_create(tbl);
+    ht_enable_index(tbl);
 
     for (int i = 0; i < n; i++) {
-        serve(server_sock, tbl);
+        serve_client(server_sock, tbl);
     }
 
     ht_destroy(tbl);
 }
 
+/* stream a table with a large value to a replica over a socket pair,
+ * change it after the snapshot started and compare the copy */
+void test_replication(void) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    hash_table *primary = ht_create();
+    hash_table *copy = ht_create();
+    char key[16];
+    char *large = calloc(UINT16_MAX + 1, 1);
+    for (int i = 0; i < 1000; i++) {
+        int len = snprintf(key, sizeof key, "key%d", i);
+        ht_set_value(primary, key, len, key, len);
+    }
+    ht_set_value(primary, "large", 5, large, UINT16_MAX + 1);
+    ht_set_value(copy, "stale", 5, "x", 1);
+
+    assert(repl_attach(sv[0], primary, true) == 0);
+    assert(repl_pump(&replicas[0], primary) == 0);
+    repl_feed(DEL, "key0", 4, NULL, 0);
+    repl_feed(SET, "new", 3, "v", 1);
+    ht_delete_key(primary, "key0", 4);
+    ht_set_value(primary, "new", 3, "v", 1);
+    while (repl_wants_write(&replicas[0])) {
+        assert(repl_pump(&replicas[0], primary) == 0);
+    }
+    repl_detach(0);
+
+    connection conn;
+    assert(conn_open(&conn, sv[1]) == 0);
+    conn.primary = true;
+    while (serve_request(&conn, copy) == 0) {
+        /* apply the stream until the primary closes it */
+    }
+    conn_close(&conn);
+
+    assert(copy->n_elems == primary->n_elems);
+    for (size_t i = 0; i < primary->size; i++) {
+        for (hash_table_elem *elem = primary->elems[i]; elem != NULL; elem = elem->next) {
+            void *value;
+            size_t value_len;
+            assert(ht_get_value(copy, elem->key, elem->key_len, &value, &value_len) == 0);
+            assert(value_len == elem->value_len && memcmp(value, elem->value, value_len) == 0);
+        }
+    }
+
+    free(large);
+    ht_destroy(copy);
+    ht_destroy(primary);
+}
+
+/* stream values that do not fit into the backlog, one in the snapshot and
+ * one changed while the first is still being sent, to a replica that reads
+ * them as they arrive */
+void test_replication_large(void) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    hash_table *primary = ht_create();
+    hash_table *copy = ht_create();
+    size_t large_len = REPL_BACKLOG_LEN + 1;
+    char *large = malloc(large_len);
+    for (size_t i = 0; i < large_len; i++) {
+        large[i] = (char) i;
+    }
+    ht_set_value(primary, "large", 5, large, large_len);
+    ht_set_value(primary, "small", 5, "s", 1);
+
+    assert(repl_attach(sv[0], primary, true) == 0);
+    assert(repl_pump(&replicas[0], primary) == 0);
+    large[0] = 'x';
+    repl_feed(SET, "other", 5, large, large_len);
+    ht_set_value(primary, "other", 5, large, large_len);
+    repl_feed(SET, "small", 5, "t", 1);
+    ht_set_value(primary, "small", 5, "t", 1);
+
+    connection conn;
+    assert(conn_open(&conn, sv[1]) == 0);
+    conn.primary = true;
+    while (repl_wants_write(&replicas[0])) {
+        assert(repl_pump(&replicas[0], primary) == 0);
+        /* the copy is applied in this process, its changes must not go
+         * back into the stream */
+        n_replicas = 0;
+        while (serve_request(&conn, copy) == 0) {
+            /* apply what arrived so far */
+        }
+        n_replicas = 1;
+    }
+    assert(replicas[0].skipped == 0);
+    repl_detach(0);
+    while (serve_request(&conn, copy) != -1) {
+        /* apply the rest until the primary closes the stream */
+    }
+    conn_close(&conn);
+
+    assert(copy->n_elems == 3);
+    char *keys[] = {"large", "other", "small"};
+    for (int i = 0; i < 3; i++) {
+        void *expected, *value;
+        size_t expected_len, value_len;
+        assert(ht_get_value(primary, keys[i], 5, &expected, &expected_len) == 0);
+        assert(ht_get_value(copy, keys[i], 5, &value, &value_len) == 0);
+        assert(value_len == expected_len && memcmp(value, expected, value_len) == 0);
+    }
+
+    free(large);
+    ht_destroy(copy);
+    ht_destroy(primary);
+}
+
+/* hand a listener and a table snapshot over a socket pair, the copy has
+ * the same values and versions */
+void test_upgrade(void) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    hash_table *tbl = ht_create();
+    hash_table *copy = ht_create();
+    char key[16];
+    for (int i = 0; i < 1000; i++) {
+        int len = snprintf(key, sizeof key, "key%d", i);
+        ht_set_value(tbl, key, len, key, len);
+    }
+    ht_set_value(tbl, "empty", 5, "", 0);
+    ht_set_value(tbl, "key7", 4, "changed", 7);
+
+    int fds[2] = { listen_unix("/tmp/test_server_upgrade"), table_save(tbl) };
+    assert(fds[0] != -1 && fds[1] != -1);
+    uint8_t present = 1;
+    assert(send_fds(sv[0], fds, 2, &present, 1) == 0);
+    close(fds[0]);
+    close(fds[1]);
+
+    int received[MAX_HANDOVER_FDS];
+    present = 0;
+    assert(recv_fds(sv[1], received, MAX_HANDOVER_FDS, &present, 1) == 2 && present == 1);
+    int type;
+    socklen_t type_len = sizeof type;
+    assert(getsockopt(received[0], SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 && type == SOCK_STREAM);
+    assert(table_load(copy, received[1]) == 0);
+    close(received[0]);
+    close(received[1]);
+    unlink("/tmp/test_server_upgrade");
+
+    assert(copy->n_elems == tbl->n_elems && copy->version == tbl->version);
+    for (size_t i = 0; i < tbl->size; i++) {
+        for (hash_table_elem *elem = tbl->elems[i]; elem != NULL; elem = elem->next) {
+            hash_table_elem *found = ht_find(copy, elem->key, elem->key_len);
+            assert(found != NULL && found->version == elem->version);
+            assert(found->value_len == elem->value_len && memcmp(found->value, elem->value, elem->value_len) == 0);
+        }
+    }
+
+    close(sv[0]);
+    close(sv[1]);
+    ht_destroy(copy);
+    ht_destroy(tbl);
+}
+
+/* the gets, sets and deletes of msgs as the server recorded them, the
+ * inner requests of the batch one by one */
+void test_trace(void) {
+    struct {
+        uint8_t action;
+        char *key;
+        char *value;
+    } expected[] = {
+        {SET, "a", "1"}, {GET, "a", ""}, {SET, "a", "2"}, {GET, "a", ""}, {SET, "b", "3"},
+        {GET, "b", ""}, {DEL, "a", ""}, {GET, "a", ""}, {DEL, "a", ""},
+        {SET, "c", "4"}, {GET, "c", ""}, {EXT | SET, "d", "5"}, {EXT | GET, "d", ""}
+    };
+
+    FILE *file = trace_open_read(TRACE_PATH);
+    assert(file != NULL);
+    trace_entry *e = malloc(sizeof *e);
+    uint64_t last_ns = 0;
+    for (size_t i = 0; i < sizeof expected / sizeof expected[0]; i++) {
+        assert(trace_read(file, e) == 1);
+        assert(e->action == expected[i].action && e->arrival_ns >= last_ns);
+        assert(e->key_len == 1 && e->key[0] == expected[i].key[0]);
+        assert(e->value_len == strlen(expected[i].value));
+        assert(e->flags == TRACE_VALUE_HASH && e->value_hash == trace_hash(expected[i].value, e->value_len));
+        last_ns = e->arrival_ns;
+    }
+
+    free(e);
+    fclose(file);
+    unlink(TRACE_PATH);
+}
+
+/* watch a prefix over a socket pair, changes of one key are coalesced and
+ * too many changed keys turn into one overflow notification */
+void test_watch(void) {
+    int sv[2];
+    assert(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+
+    hash_table *tbl = ht_create();
+    connection conn;
+    assert(conn_open(&conn, sv[0]) == 0);
+
+    char request[] = {CMD(16), 1, 0, 4, 0, 1, 'f', 'i', 'l', 'm', 1};
+    char expected_ack[] = {CMD(16 | ACK), 1, 0, 4, 0, 0, 'f', 'i', 'l', 'm'};
+    char recv_buffer[16];
+    assert(send(sv[1], request, sizeof request, 0) == sizeof request);
+    assert(serve_request(&conn, tbl) == 0);
+    assert(recv(sv[1], recv_buffer, sizeof recv_buffer, 0) == sizeof expected_ack);
+    assert(memcmp(recv_buffer, expected_ack, sizeof expected_ack) == 0);
+
+    publish_change(SET, "film1", 5, "a", 1);
+    publish_change(SET, "other", 5, "b", 1);
+    publish_change(SET, "film1", 5, "c", 1);
+    publish_change(DEL, "film1", 5, NULL, 0);
+    assert(sub_push(&conn) == 0);
+    char expected_notification[] = {CMD(17), 0, 0, 5, 0, 1, 'f', 'i', 'l', 'm', '1', DEL};
+    assert(recv(sv[1], recv_buffer, sizeof recv_buffer, 0) == sizeof expected_notification);
+    assert(memcmp(recv_buffer, expected_notification, sizeof expected_notification) == 0);
+
+    char key[16];
+    for (int i = 0; i < MAX_PENDING_NOTIFICATIONS; i++) {
+        int len = snprintf(key, sizeof key, "film%d", i);
+        publish_change(SET, key, len, "d", 1);
+    }
+    publish_change(DEL, "film0", 5, NULL, 0);
+    assert(!conn.sub->overflow && conn.sub->pending->n_elems == MAX_PENDING_NOTIFICATIONS);
+    int len = snprintf(key, sizeof key, "film%d", MAX_PENDING_NOTIFICATIONS);
+    publish_change(SET, key, len, "d", 1);
+    assert(conn.sub->overflow);
+    assert(sub_push(&conn) == 0);
+    char expected_overflow[] = {CMD(17), 0, 0, 0, 0, 0};
+    assert(recv(sv[1], recv_buffer, sizeof recv_buffer, 0) == sizeof expected_overflow);
+    assert(memcmp(recv_buffer, expected_overflow, sizeof expected_overflow) == 0);
+
+    conn_close(&conn);
+    close(sv[1]);
+    ht_destroy(tbl);
+}
+
+/* a client of the unix socket at path that gives up on a response after 2s */
+int connect_unix_path(char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    assert(sock != -1 && connect(sock, (struct sockaddr *) &addr, sizeof addr) == 0);
+
+    struct timeval timeout;
+    timeout.tv_sec = 2;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+    return sock;
+}
+
+/* receive exactly len bytes or fail */
+void recv_all(int sock, char *dest, size_t len) {
+    size_t received = 0;
+    while (received < len) {
+        ssize_t status = recv(sock, dest + received, len - received, 0);
+        assert(status > 0);
+        received += (size_t) status;
+    }
+}
+
+/* the event loop in a child: a socket client and a shared memory client
+ * send part of a request and another client pipelines gets of a large value
+ * without reading the responses. Meanwhile one more client is served, then
+ * the others complete their requests and read all responses */
+void test_nonblocking(void) {
+    int listeners[N_LISTENERS] = { -1, -1, -1, -1 };
+    listeners[LISTEN_UNIX] = listen_unix(PARTIAL_PATH);
+    listeners[LISTEN_SHM] = listen_unix(PARTIAL_SHM_PATH);
+    assert(listeners[LISTEN_UNIX] != -1 && listeners[LISTEN_SHM] != -1);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        hash_table *tbl = ht_create();
+        event_loop(listeners, -1, -1, tbl);
+        _exit(0);
+    }
+    close(listeners[LISTEN_UNIX]);
+    close(listeners[LISTEN_SHM]);
+
+    char recv_buffer[16];
+    char ack[] = {SET | ACK, 0, 0, 0, 0, 0};
+
+    /* fill the queue of a client that does not read */
+    int reader = connect_unix_path(PARTIAL_PATH);
+    char *set_large = calloc(HEADER_LEN + 1 + LARGE_LEN, 1);
+    memcpy(set_large, (char []) {SET, 1, 0, 1, LARGE_LEN >> 8, LARGE_LEN & 0xff, 'l'}, HEADER_LEN + 1);
+    assert(send(reader, set_large, HEADER_LEN + 1 + LARGE_LEN, 0) == HEADER_LEN + 1 + LARGE_LEN);
+    ack[1] = 1;
+    recv_all(reader, recv_buffer, sizeof ack);
+    assert(memcmp(recv_buffer, ack, sizeof ack) == 0);
+    char get_large[] = {GET, 2, 0, 1, 0, 0, 'l'};
+    for (int i = 0; i < N_LARGE_GETS; i++) {
+        assert(send(reader, get_large, sizeof get_large, 0) == sizeof get_large);
+    }
+
+    /* half a header on a socket and a shared memory channel */
+    int partial = connect_unix_path(PARTIAL_PATH);
+    char set_a[] = {SET, 3, 0, 1, 0, 1, 'a', '1'};
+    assert(send(partial, set_a, 3, 0) == 3);
+    shm_endpoint shm;
+    int control_sock = shm_connect(PARTIAL_SHM_PATH, &shm);
+    assert(control_sock != -1);
+    char set_s[] = {SET, 4, 0, 1, 0, 1, 's', '1'};
+    struct iovec iov = { .iov_base = set_s, .iov_len = 4 };
+    assert(shm_writev(&shm, &iov, 1) == 4);
+
+    /* neither holds up another client */
+    int served = connect_unix_path(PARTIAL_PATH);
+    char set_b[] = {SET, 5, 0, 1, 0, 1, 'b', '2'};
+    char get_b[] = {GET, 6, 0, 1, 0, 0, 'b'};
+    char expected_get[] = {GET | ACK, 6, 0, 1, 0, 1, 'b', '2'};
+    assert(send(served, set_b, sizeof set_b, 0) == sizeof set_b);
+    ack[1] = 5;
+    recv_all(served, recv_buffer, sizeof ack);
+    assert(memcmp(recv_buffer, ack, sizeof ack) == 0);
+    assert(send(served, get_b, sizeof get_b, 0) == sizeof get_b);
+    recv_all(served, recv_buffer, sizeof expected_get);
+    assert(memcmp(recv_buffer, expected_get, sizeof expected_get) == 0);
+
+    /* the rest of the partial requests */
+    assert(send(partial, set_a + 3, sizeof set_a - 3, 0) == sizeof set_a - 3);
+    ack[1] = 3;
+    recv_all(partial, recv_buffer, sizeof ack);
+    assert(memcmp(recv_buffer, ack, sizeof ack) == 0);
+    iov.iov_base = set_s + 4;
+    iov.iov_len = sizeof set_s - 4;
+    assert(shm_writev(&shm, &iov, 1) == sizeof set_s - 4);
+    size_t received = 0;
+    while (received < sizeof ack) {
+        received += (size_t) shm_recv(&shm, recv_buffer + received, sizeof ack - received);
+    }
+    ack[1] = 4;
+    assert(memcmp(recv_buffer, ack, sizeof ack) == 0);
+
+    /* every queued response arrives */
+    size_t response_len = HEADER_LEN + 1 + LARGE_LEN;
+    char *responses = malloc(N_LARGE_GETS * response_len);
+    recv_all(reader, responses, N_LARGE_GETS * response_len);
+    for (int i = 0; i < N_LARGE_GETS; i++) {
+        char *response = responses + i * response_len;
+        char expected_header[] = {GET | ACK, 2, 0, 1, LARGE_LEN >> 8, LARGE_LEN & 0xff, 'l'};
+        assert(memcmp(response, expected_header, sizeof expected_header) == 0);
+        assert(response[response_len - 1] == 0);
+    }
+
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    shm_close(&shm);
+    close(control_sock);
+    close(reader);
+    close(partial);
+    close(served);
+    free(responses);
+    free(set_large);
+    unlink(PARTIAL_PATH);
+    unlink(PARTIAL_SHM_PATH);
+}
+
 int main(int argc, char *argv[]) {
     struct addrinfo client_hints;
     struct addrinfo *client_info;
@@ -214,12 +708,15 @@ int main(int argc, char *argv[]) {
         goto cleanup;
     }
 
+    trace = trace_open(TRACE_PATH, true);
     if (fork() == 0) {
         test_response(client_info);
         _exit(0);
     } else {
         serve_responses(server_sock, N_MSGS);
     }
+    trace_close(trace);
+    trace = NULL;
 
     if (fork() == 0) {
         test_malformed(client_info);
@@ -228,6 +725,13 @@ int main(int argc, char *argv[]) {
         serve_responses(server_sock, N_MALFORMED);
     }
 
+    test_replication();
+    test_replication_large();
+    test_watch();
+    test_nonblocking();
+    test_upgrade();
+    test_trace();
+
     printf("%s: all tests passed\n", argv[0]);
 cleanup:
     close(server_sock);
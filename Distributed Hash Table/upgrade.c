@@ -0,0 +1,184 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+
+#include "upgrade.h"
+
+/* a table snapshot starts with this header, every entry is key_len,
+ * value_len and version as 64 bit numbers followed by key and value */
+typedef struct snapshot_header {
+    char magic[8];
+    uint64_t n_elems;
+    uint64_t version;
+} snapshot_header;
+
+static const char snapshot_magic[8] = "KVSNAP1";
+
+/* send data_len bytes of data with n_fds file descriptors attached,
+ * returns -1 on error */
+int send_fds(int sock, int *fds, int n_fds, void *data, size_t data_len) {
+    char control[CMSG_SPACE(MAX_HANDOVER_FDS * sizeof (int))];
+    memset(control, 0, sizeof control);
+    struct iovec iov = { .iov_base = data, .iov_len = data_len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE((size_t) n_fds * sizeof (int));
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN((size_t) n_fds * sizeof (int));
+    memcpy(CMSG_DATA(cmsg), fds, (size_t) n_fds * sizeof (int));
+
+    if (sendmsg(sock, &msg, 0) == -1) {
+        fprintf(stderr, "sendmsg: %s\n", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/* receive what send_fds sent, data_len bytes go to data.
+ * Returns the number of file descriptors or -1 */
+int recv_fds(int sock, int *fds, int max_fds, void *data, size_t data_len) {
+    char control[CMSG_SPACE(MAX_HANDOVER_FDS * sizeof (int))];
+    struct iovec iov = { .iov_base = data, .iov_len = data_len };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof control;
+
+    ssize_t status = recvmsg(sock, &msg, MSG_WAITALL);
+    if (status == -1) {
+        fprintf(stderr, "recvmsg: %s\n", strerror(errno));
+        return -1;
+    }
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if ((size_t) status != data_len || cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS) {
+        fprintf(stderr, "recv_fds: no file descriptors received\n");
+        return -1;
+    }
+
+    int n_fds = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof (int));
+    if (n_fds > max_fds) {
+        fprintf(stderr, "recv_fds: too many file descriptors\n");
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), (size_t) n_fds * sizeof (int));
+    return n_fds;
+}
+
+/* write all entries of tbl to a new memfd, returns the memfd or -1 */
+int table_save(hash_table *tbl) {
+    size_t len = sizeof (snapshot_header);
+    for (size_t i = 0; i < tbl->size; i++) {
+        for (hash_table_elem *elem = tbl->elems[i]; elem != NULL; elem = elem->next) {
+            len += 3 * sizeof (uint64_t) + elem->key_len + elem->value_len;
+        }
+    }
+
+    int memfd = memfd_create("kv_table_snapshot", MFD_CLOEXEC);
+    if (memfd == -1) {
+        fprintf(stderr, "memfd_create: %s\n", strerror(errno));
+        return -1;
+    }
+    if (ftruncate(memfd, (off_t) len) == -1) {
+        fprintf(stderr, "ftruncate: %s\n", strerror(errno));
+        close(memfd);
+        return -1;
+    }
+    char *snapshot = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (snapshot == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        close(memfd);
+        return -1;
+    }
+
+    snapshot_header header;
+    memcpy(header.magic, snapshot_magic, sizeof header.magic);
+    header.n_elems = tbl->n_elems;
+    header.version = tbl->version;
+    memcpy(snapshot, &header, sizeof header);
+
+    char *cur = snapshot + sizeof header;
+    for (size_t i = 0; i < tbl->size; i++) {
+        for (hash_table_elem *elem = tbl->elems[i]; elem != NULL; elem = elem->next) {
+            uint64_t lens[3] = { elem->key_len, elem->value_len, elem->version };
+            memcpy(cur, lens, sizeof lens);
+            cur += sizeof lens;
+            memcpy(cur, elem->key, elem->key_len);
+            cur += elem->key_len;
+            memcpy(cur, elem->value, elem->value_len);
+            cur += elem->value_len;
+        }
+    }
+
+    munmap(snapshot, len);
+    return memfd;
+}
+
+/* add the entries of a snapshot written by table_save to tbl, versions
+ * are kept. Returns -1 if the snapshot is broken */
+int table_load(hash_table *tbl, int memfd) {
+    off_t file_len = lseek(memfd, 0, SEEK_END);
+    if (file_len < (off_t) sizeof (snapshot_header)) {
+        fprintf(stderr, "table_load: snapshot too short\n");
+        return -1;
+    }
+    size_t len = (size_t) file_len;
+
+    char *snapshot = mmap(NULL, len, PROT_READ, MAP_SHARED, memfd, 0);
+    if (snapshot == MAP_FAILED) {
+        fprintf(stderr, "mmap: %s\n", strerror(errno));
+        return -1;
+    }
+
+    int status = -1;
+    snapshot_header header;
+    memcpy(&header, snapshot, sizeof header);
+    if (memcmp(header.magic, snapshot_magic, sizeof header.magic) != 0) {
+        fprintf(stderr, "table_load: not a snapshot\n");
+        goto cleanup;
+    }
+
+    size_t offset = sizeof header;
+    for (uint64_t i = 0; i < header.n_elems; i++) {
+        uint64_t lens[3];
+        if (len - offset < sizeof lens) {
+            goto broken;
+        }
+        memcpy(lens, snapshot + offset, sizeof lens);
+        offset += sizeof lens;
+        if (len - offset < lens[0] || len - offset - lens[0] < lens[1]) {
+            goto broken;
+        }
+
+        char *key = snapshot + offset;
+        char *value = key + lens[0];
+        if (ht_set_value(tbl, key, lens[0], value, lens[1]) == -1) {
+            goto broken;
+        }
+        ht_find(tbl, key, lens[0])->version = lens[2];
+        offset += lens[0] + lens[1];
+    }
+    tbl->version = header.version;
+    status = 0;
+    goto cleanup;
+
+broken:
+    fprintf(stderr, "table_load: snapshot broken\n");
+cleanup:
+    munmap(snapshot, len);
+    return status;
+}
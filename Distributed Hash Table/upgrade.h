@@ -0,0 +1,10 @@
+#pragma once
+#include "hash_table.h"
+
+/* the most file descriptors handed over at once */
+#define MAX_HANDOVER_FDS 8
+
+int send_fds(int sock, int *fds, int n_fds, void *data, size_t data_len);
+int recv_fds(int sock, int *fds, int max_fds, void *data, size_t data_len);
+int table_save(hash_table *tbl);
+int table_load(hash_table *tbl, int memfd);
@@ -0,0 +1,69 @@
+#!/bin/bash
+
+# spread N_KEYS keys over a chord of N_INSTANCES servers and print the keys
+# every server holds, with their mean and variance.
+# usage: ./balance.sh [n_instances] [n_keys] [server options, -v <n> for
+# n virtual nodes per server]
+
+N_INSTANCES=${1:-8}
+N_KEYS=${2:-1000}
+shift 2
+SERVER_OPTS="$@"
+STARTPORT=2048
+MAX=65536 # 2^16
+DIR=`mktemp -d`
+PORTS=()
+PROCS=()
+
+# random distinct ids, servers with virtual nodes derive theirs instead
+IDS=(`shuf -i 0-$(($MAX - 1)) -n $N_INSTANCES`)
+
+for ((i=0; i<$N_INSTANCES; i++))
+do
+    NEW_PORT=`expr $STARTPORT + $i`
+    if [ $i -eq 0 ]
+    then
+        ./server $SERVER_OPTS localhost $NEW_PORT ${IDS[$i]} > $DIR/out.$i &
+    else
+        REGISTRATION_PORT=${PORTS[(($RANDOM % i))]}
+        ./server $SERVER_OPTS localhost $NEW_PORT localhost $REGISTRATION_PORT ${IDS[$i]} > $DIR/out.$i &
+    fi
+    PORTS[$i]=$NEW_PORT
+    PROCS[$i]=$!
+    sleep 0.05
+done
+
+echo waiting for servers to stabilize chord
+sleep 10
+
+# random hex keys, the hashes of key1, key2, ... only cover a few parts of
+# the ring
+KEYS=(`od -An -tx4 -N $((4 * $N_KEYS)) /dev/urandom`)
+for KEY in ${KEYS[@]}
+do
+    RANDOM_PORT=${PORTS[(($RANDOM % N_INSTANCES))]}
+    timeout 5 ./client localhost $RANDOM_PORT set "$KEY" "value" > /dev/null
+done
+
+# SIGUSR1 makes a server print its keys
+kill -USR1 ${PROCS[@]}
+sleep 1
+
+echo "setup: $N_INSTANCES servers, $N_KEYS keys, options: ${SERVER_OPTS:-none}"
+for ((i=0; i<$N_INSTANCES; i++))
+do
+    grep -a "^keys total:" $DIR/out.$i | tail -n 1 | cut -d' ' -f3
+done | awk '{ n[NR] = $1; sum += $1 }
+    END {
+        mean = sum / NR
+        for (i = 1; i <= NR; i++) {
+            var += (n[i] - mean) ^ 2
+            if (n[i] > max) max = n[i]
+            printf "%d ", n[i]
+        }
+        var /= NR
+        printf "\nkeys: %d mean: %.1f variance: %.1f stddev: %.1f max/mean: %.2f\n", sum, mean, var, sqrt(var), max / mean
+    }'
+
+kill ${PROCS[@]}
+rm -r $DIR
@@ -1,5 +1,6 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <inttypes.h>
 #include <sys/types.h>
@@ -8,16 +9,211 @@
 #include <string.h>
 #include <errno.h>
 #include <arpa/inet.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+
+#include "hash_table.h"
 
 #define HEADER_LEN 6
 
 const uint8_t del_mask = 1;
 const uint8_t set_mask = 1 << 1;
 const uint8_t get_mask = 1 << 2;
+const uint8_t iterative_mask = 1 << 5;
+const uint8_t referral_mask = 1 << 6;
+/* in a request the referral bit asks any replica of the key to answer */
+const uint8_t replica_mask = 1 << 6;
+
+/* a referral carries the next node as value, ip, port, id */
+#define REFERRAL_LEN (4 + 2 + 2)
+/* more referrals than that means the ring is broken */
+#define MAX_REFERRALS 32
+/* a request without answer is sent again, the ring may be repairing */
+#define MAX_RETRIES 3
+#define MAX_CACHED 1024
+/* -h keeps the latencies of the last gets, a get not answered within their
+ * 95th percentile is sent to a replica as well. with fewer the delay is
+ * not known yet */
+#define HISTORY_LEN 100
+#define MIN_HISTORY 20
 
 char transaction_id = 0;
 
-int send_msg(int sock, struct addrinfo *servinfo, uint8_t action, char *key, char *val) {
+/* a node the client learned from a referral, taken to be responsible from
+ * its id up to the next id in the cache */
+typedef struct ring_node {
+    struct sockaddr_in address;
+    uint16_t id;
+} ring_node;
+
+/* the ring cache, -c keeps it in a file between runs */
+static ring_node cache[MAX_CACHED];
+static size_t n_cached = 0;
+
+void cache_add(ring_node *rn) {
+    for (size_t i = 0; i < n_cached; i++) {
+        if (cache[i].id == rn->id) {
+            cache[i] = *rn;
+            return;
+        }
+    }
+
+    if (n_cached < MAX_CACHED) {
+        cache[n_cached++] = *rn;
+    }
+}
+
+void cache_remove(uint16_t id) {
+    for (size_t i = 0; i < n_cached; i++) {
+        if (cache[i].id == id) {
+            cache[i] = cache[--n_cached];
+            return;
+        }
+    }
+}
+
+/* the cached node whose range contains hash, NULL if the cache is empty */
+ring_node *cache_lookup(uint16_t hash) {
+    ring_node *best = NULL;
+    uint16_t best_offset = 0;
+    for (size_t i = 0; i < n_cached; i++) {
+        uint16_t offset = hash - cache[i].id;
+        if (best == NULL || offset < best_offset) {
+            best = &cache[i];
+            best_offset = offset;
+        }
+    }
+
+    return best;
+}
+
+/* the first cached node after rn on another server, which keeps the first
+ * copies of its keys. NULL if there is none */
+ring_node *cache_replica(ring_node *rn) {
+    ring_node *best = NULL;
+    uint16_t best_offset = 0;
+    for (size_t i = 0; i < n_cached; i++) {
+        uint16_t offset = cache[i].id - rn->id;
+        bool same_server = cache[i].address.sin_addr.s_addr == rn->address.sin_addr.s_addr
+            && cache[i].address.sin_port == rn->address.sin_port;
+        if (!same_server && (best == NULL || offset < best_offset)) {
+            best = &cache[i];
+            best_offset = offset;
+        }
+    }
+
+    return best;
+}
+
+/* one node per line, id ip port */
+void cache_load(char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return; /* nothing learned yet */
+    }
+
+    ring_node rn;
+    char ip[INET_ADDRSTRLEN];
+    uint16_t port;
+    memset(&rn, 0, sizeof rn);
+    rn.address.sin_family = AF_INET;
+    while (fscanf(file, "%" SCNu16 " %15s %" SCNu16, &rn.id, ip, &port) == 3) {
+        if (inet_pton(AF_INET, ip, &rn.address.sin_addr) == 1) {
+            rn.address.sin_port = htons(port);
+            cache_add(&rn);
+        }
+    }
+
+    fclose(file);
+}
+
+void cache_save(char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < n_cached; i++) {
+        fprintf(file, "%" PRIu16 " %s %" PRIu16 "\n", cache[i].id, inet_ntoa(cache[i].address.sin_addr), ntohs(cache[i].address.sin_port));
+    }
+
+    fclose(file);
+}
+
+/* get latencies in nanoseconds, oldest first */
+static long history[HISTORY_LEN];
+static size_t n_history = 0;
+
+/* one latency per line */
+void history_load(char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return; /* no get yet */
+    }
+
+    long latency;
+    while (fscanf(file, "%ld", &latency) == 1) {
+        if (n_history == HISTORY_LEN) {
+            memmove(history, history + 1, (HISTORY_LEN - 1) * sizeof *history);
+            n_history--;
+        }
+        history[n_history++] = latency;
+    }
+
+    fclose(file);
+}
+
+void history_save(char *path, long latency) {
+    if (n_history == HISTORY_LEN) {
+        memmove(history, history + 1, (HISTORY_LEN - 1) * sizeof *history);
+        n_history--;
+    }
+    history[n_history++] = latency;
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        return;
+    }
+
+    for (size_t i = 0; i < n_history; i++) {
+        fprintf(file, "%ld\n", history[i]);
+    }
+
+    fclose(file);
+}
+
+int compare_long(const void *a, const void *b) {
+    long x = *(const long *) a;
+    long y = *(const long *) b;
+    return (x > y) - (x < y);
+}
+
+/* the 95th percentile of the history in milliseconds, rounded up, -1 if
+ * the history is too short */
+int hedge_delay_ms(void) {
+    if (n_history < MIN_HISTORY) {
+        return -1;
+    }
+
+    long sorted[HISTORY_LEN];
+    memcpy(sorted, history, n_history * sizeof *history);
+    qsort(sorted, n_history, sizeof *sorted, compare_long);
+    long p95 = sorted[n_history * 95 / 100];
+    return (int) ((p95 + 999999) / 1000000);
+}
+
+/* return timedifference in nanoseconds */
+long timediff(struct timespec start, struct timespec end) {
+    long sec_diff = end.tv_sec - start.tv_sec;
+    long nsec_diff = end.tv_nsec - start.tv_nsec;
+    /* 1000000000 ns = 1s*/
+    return sec_diff * 1000000000 + nsec_diff;
+}
+
+int send_msg(int sock, struct sockaddr *addr, socklen_t addr_len, uint8_t action, char *key, char *val) {
     uint16_t key_len = strlen(key);
     uint16_t val_len = strlen(val);
     int msg_len = HEADER_LEN + key_len + val_len;
@@ -48,18 +244,24 @@ int send_msg(int sock, struct addrinfo *servinfo, uint8_t action, char *key, cha
     memcpy(cur_msg, val, val_len);
     cur_msg += val_len;
 
-    if (sendto(sock, msg, msg_len, 0, servinfo->ai_addr, servinfo->ai_addrlen) < 0) {
+    if (sendto(sock, msg, msg_len, 0, addr, addr_len) < 0) {
         fprintf(stderr, "sendto: %s\n", strerror(errno));
     }
     free(msg);
 }
 
-int recv_msg(int sock) {
+/* returns 1 and fills referral if the answer is a referral, -1 if no answer
+ * arrived */
+int recv_msg(int sock, ring_node *referral) {
     struct sockaddr_storage their_addr;
-    socklen_t addr_size;
+    socklen_t addr_size = sizeof their_addr;
 
     char *msg = calloc(HEADER_LEN, sizeof *msg);
-    recvfrom(sock, msg, HEADER_LEN, MSG_PEEK, (struct sockaddr *)&their_addr, &addr_size);
+    if (recvfrom(sock, msg, HEADER_LEN, MSG_PEEK, (struct sockaddr *)&their_addr, &addr_size) < HEADER_LEN) {
+        fprintf(stderr, "recvfrom: %s\n", strerror(errno));
+        free(msg);
+        return -1;
+    }
 
     uint16_t key_len;
     uint16_t val_len;
@@ -87,13 +289,52 @@ int recv_msg(int sock) {
     memcpy(recv_val, cur_msg, val_len);
     cur_msg += val_len;
 
+    if (action & referral_mask && val_len == REFERRAL_LEN) {
+        memset(referral, 0, sizeof *referral);
+        referral->address.sin_family = AF_INET;
+        memcpy(&referral->address.sin_addr, recv_val, 4);
+        memcpy(&referral->address.sin_port, recv_val + 4, 2);
+        memcpy(&referral->id, recv_val + 6, 2);
+        referral->id = ntohs(referral->id);
+        printf("recv referral: id=%" PRIu16 " ip=%s port=%" PRIu16 "\n", referral->id, inet_ntoa(referral->address.sin_addr), ntohs(referral->address.sin_port));
+        free(recv_key);
+        free(recv_val);
+        free(msg);
+        return 1;
+    }
+
     printf("recv message: action=%"PRIu8 " transaction_id=%c key=%s value=%s\n", action, transaction_id, recv_key, recv_val);
+    free(recv_key);
+    free(recv_val);
     free(msg);
+    return 0;
 }
 
 int main(int argc, char **argv) {
+    /* -i asks for referrals instead of forwarding, -c <file> keeps the
+     * nodes learned from them, -h <file> the latencies that decide when a
+     * get is hedged. hedging needs the cache to know the replicas */
+    char *prog = argv[0];
+    bool iterative = false;
+    char *cache_path = NULL;
+    char *history_path = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "ic:h:")) != -1) {
+        if (c == 'i') {
+            iterative = true;
+        } else if (c == 'c') {
+            cache_path = optarg;
+        } else if (c == 'h') {
+            history_path = optarg;
+        } else {
+            return 1;
+        }
+    }
+    argv += optind - 1;
+    argc -= optind - 1;
+
     if (argc != 6) {
-        printf("usage %s <ip> <port> <action> <key> <value>", argv[0]);
+        printf("usage %s [-i] [-c <cache>] [-h <history>] <ip> <port> <action> <key> <value>", prog);
         return 1;
     }
 
@@ -133,8 +374,85 @@ int main(int argc, char **argv) {
         break;
     }
 
-    send_msg(sock, servinfo, request_action, key, value);
-    recv_msg(sock);
+    /* ask the node the cache knows responsible, or the given one */
+    struct sockaddr *dest = servinfo->ai_addr;
+    socklen_t dest_len = servinfo->ai_addrlen;
+    ring_node *cached = NULL;
+    ring_node *replica = NULL;
+    int hedge_ms = -1;
+    ring_node referral;
+    memset(&referral, 0, sizeof referral);
+    /* a node may be gone, give up on an answer after a second */
+    struct timeval timeout = { .tv_sec=1, .tv_usec=0 };
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0) {
+        fprintf(stderr, "setsockopt: %s\n", strerror(errno));
+    }
+
+    if (iterative) {
+        request_action |= iterative_mask;
+
+        if (cache_path != NULL) {
+            cache_load(cache_path);
+        }
+        cached = cache_lookup(string_hash(key, strlen(key)));
+        if (cached != NULL) {
+            referral = *cached;
+            dest = (struct sockaddr *)&referral.address;
+            dest_len = sizeof referral.address;
+            replica = cache_replica(cached);
+        }
+    }
+
+    if (history_path != NULL && request_action & get_mask) {
+        history_load(history_path);
+        hedge_ms = hedge_delay_ms();
+    }
+
+    struct timespec start, end;
 
+    //1. time stamp before request transmition
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int retries = 0;
+    for (int i = 0; i < MAX_REFERRALS; i++) {
+        send_msg(sock, dest, dest_len, request_action, key, value);
+        if (i == 0 && replica != NULL && hedge_ms >= 0) {
+            /* the owner is slow, whoever of it and the replica answers
+             * first wins */
+            struct pollfd pfd = { .fd=sock, .events=POLLIN, .revents=0 };
+            if (poll(&pfd, 1, hedge_ms) == 0) {
+                send_msg(sock, (struct sockaddr *)&replica->address, sizeof replica->address, request_action | replica_mask, key, value);
+            }
+        }
+        status = recv_msg(sock, &referral);
+
+        if (status == 1) {
+            /* go on with the node we were referred to */
+            cache_add(&referral);
+            dest = (struct sockaddr *)&referral.address;
+            dest_len = sizeof referral.address;
+        } else if (status == -1 && dest != servinfo->ai_addr) {
+            /* start over at the given node */
+            cache_remove(referral.id);
+            dest = servinfo->ai_addr;
+            dest_len = servinfo->ai_addrlen;
+        } else if (status == -1 && retries < MAX_RETRIES) {
+            retries++;
+        } else {
+            break;
+        }
+    }
+
+    //2. time stamp
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("The DHT request needed: %ld Nanoseconds.\n", timediff(start, end));
+
+    if (history_path != NULL && request_action & get_mask && status == 0) {
+        history_save(history_path, timediff(start, end));
+    }
+
+    if (cache_path != NULL) {
+        cache_save(cache_path);
+    }
     freeaddrinfo(servinfo);
 }
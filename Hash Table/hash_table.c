@@ -146,6 +146,32 @@ int ht_delete_key(hash_table *tbl, void *key, size_t key_len) {
     return -1;
 }
 
+/* the next element in bucket order whose key hashes into the ring range
+ * [start, end), the whole ring if start == end. continues after elem, or at
+ * the head of bucket *bucket if elem is NULL. *bucket is set to the bucket
+ * of the result, to tbl->size if there is none */
+hash_table_elem *ht_next_in_range(hash_table *tbl, size_t *bucket, hash_table_elem *elem, uint16_t start, uint16_t end) {
+    if (*bucket >= tbl->size) {
+        *bucket = tbl->size;
+        return NULL;
+    }
+
+    hash_table_elem *list = elem != NULL ? elem->next : tbl->elems[*bucket];
+    while (1) {
+        for (; list != NULL; list = list->next) {
+            uint16_t offset = string_hash(list->key, list->key_len) - start;
+            if (start == end || offset < (uint16_t) (end - start)) {
+                return list;
+            }
+        }
+
+        if (++*bucket == tbl->size) {
+            return NULL;
+        }
+        list = tbl->elems[*bucket];
+    }
+}
+
 /* destroy and free hash table */
 void ht_destroy(hash_table *tbl) {
     for (size_t i = 0; i < tbl->size; i++) {
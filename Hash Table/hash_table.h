@@ -18,5 +18,6 @@ hash_table *ht_create();
 int ht_get_value(hash_table *tbl, void *key, size_t key_len, void **res, size_t *res_len);
 int ht_set_value(hash_table *tbl, void *key, size_t key_len, void *value, size_t value_len);
 int ht_delete_key(hash_table *tbl, void *key, size_t key_len);
+hash_table_elem *ht_next_in_range(hash_table *tbl, size_t *bucket, hash_table_elem *elem, uint16_t start, uint16_t end);
 void ht_destroy(hash_table *tbl);
 uint16_t string_hash(void *p_in, size_t str_len);
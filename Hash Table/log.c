@@ -0,0 +1,510 @@
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/eventfd.h>
+
+#include "log.h"
+
+/* single producer, single consumer ring like shm_ring.c, the thread that
+ * logs writes and the background thread reads. head and tail count all
+ * bytes ever written and read */
+typedef struct log_ring {
+    uint64_t head;
+    char head_pad[56];
+    uint64_t tail;
+    char tail_pad[56];
+    uint64_t dropped; /* records that did not fit, counted by the producer */
+    uint64_t reported; /* of those, by the background thread */
+    struct log_ring *next;
+    char data[LOG_RING_LEN];
+} log_ring;
+
+/* a record starts with its header, then come the arguments in the order
+ * of the format: numbers and pointers as 8 bytes, strings as a 2 byte
+ * length and their bytes */
+typedef struct log_header {
+    uint32_t len; /* of the whole record */
+    int32_t level;
+    uint64_t ns;
+    const char *fmt;
+} log_header;
+
+/* one conversion of a format */
+typedef struct log_spec {
+    const char *start; /* the % */
+    const char *length_at; /* behind flags, width and precision */
+    int stars; /* widths and precisions taken from the arguments */
+    int precision; /* -1 if none, -2 if from the arguments */
+    char length[3];
+    char conversion;
+} log_spec;
+
+typedef enum arg_kind {
+    ARG_NONE,
+    ARG_INT,
+    ARG_UINT,
+    ARG_DOUBLE,
+    ARG_STRING,
+    ARG_POINTER,
+    ARG_COUNT
+} arg_kind;
+
+static const char *level_names[] = { "debug", "info", "warn", "error" };
+
+/* every thread that logged, new ones go in front */
+static log_ring *rings = NULL;
+static __thread log_ring *own_ring = NULL;
+
+static FILE *log_out = NULL;
+static bool running = false;
+static bool stopping = false;
+static pthread_t log_thread;
+static uint64_t start_ns = 0;
+/* the background thread blocks on it while the rings are empty */
+static int wake_fd = -1;
+
+static uint64_t log_clock_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/* parse the conversion at p, which points at a % */
+static const char *parse_spec(const char *p, log_spec *s) {
+    s->start = p++;
+    s->stars = 0;
+    s->precision = -1;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+        p++;
+    }
+    if (*p == '*') {
+        s->stars++;
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            s->stars++;
+            s->precision = -2;
+            p++;
+        } else {
+            s->precision = 0;
+            while (*p >= '0' && *p <= '9') {
+                s->precision = s->precision * 10 + (*p++ - '0');
+            }
+        }
+    }
+    s->length_at = p;
+    size_t n = 0;
+    while (n < 2 && *p != '\0' && strchr("hlLzjtq", *p) != NULL) {
+        s->length[n++] = *p++;
+    }
+    s->length[n] = '\0';
+    s->conversion = *p;
+    if (*p != '\0') {
+        p++;
+    }
+
+    return p;
+}
+
+static arg_kind spec_kind(log_spec *s) {
+    switch (s->conversion) {
+    case 'd': case 'i': case 'c':
+        return ARG_INT;
+    case 'u': case 'o': case 'x': case 'X':
+        return ARG_UINT;
+    case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+        return ARG_DOUBLE;
+    case 's':
+        return ARG_STRING;
+    case 'p':
+        return ARG_POINTER;
+    case 'n':
+        return ARG_COUNT;
+    default:
+        return ARG_NONE; /* %% */
+    }
+}
+
+/* the next argument, promoted the way the length modifier says */
+static int64_t read_int(va_list *ap, const char *length) {
+    if (strcmp(length, "hh") == 0) {
+        return (signed char) va_arg(*ap, int);
+    } else if (length[0] == 'h') {
+        return (short) va_arg(*ap, int);
+    } else if (strcmp(length, "ll") == 0 || length[0] == 'q') {
+        return __extension__ va_arg(*ap, long long); /* %lld is c99 */
+    } else if (length[0] == 'l') {
+        return va_arg(*ap, long);
+    } else if (length[0] == 'z') {
+        return va_arg(*ap, ssize_t);
+    } else if (length[0] == 'j') {
+        return va_arg(*ap, intmax_t);
+    } else if (length[0] == 't') {
+        return va_arg(*ap, ptrdiff_t);
+    }
+    return va_arg(*ap, int);
+}
+
+static uint64_t read_uint(va_list *ap, const char *length) {
+    if (strcmp(length, "hh") == 0) {
+        return (unsigned char) va_arg(*ap, int);
+    } else if (length[0] == 'h') {
+        return (unsigned short) va_arg(*ap, int);
+    } else if (strcmp(length, "ll") == 0 || length[0] == 'q') {
+        return __extension__ va_arg(*ap, unsigned long long);
+    } else if (length[0] == 'l') {
+        return va_arg(*ap, unsigned long);
+    } else if (length[0] == 'z') {
+        return va_arg(*ap, size_t);
+    } else if (length[0] == 'j') {
+        return va_arg(*ap, uintmax_t);
+    } else if (length[0] == 't') {
+        return (uint64_t) va_arg(*ap, ptrdiff_t);
+    }
+    return va_arg(*ap, unsigned int);
+}
+
+/* write the header and the arguments of fmt to rec, which holds
+ * LOG_MAX_RECORD bytes, and return the length. what does not fit is left
+ * out, formatting stops there */
+static size_t build_record(char *rec, int level, const char *fmt, va_list *ap) {
+    char *cur = rec + sizeof (log_header);
+    char *end = rec + LOG_MAX_RECORD;
+    for (const char *p = fmt; *p != '\0';) {
+        if (*p != '%') {
+            p++;
+            continue;
+        }
+
+        log_spec s;
+        p = parse_spec(p, &s);
+        uint64_t slots[3];
+        int n_slots = 0;
+        int precision = s.precision;
+        for (int i = 0; i < s.stars; i++) {
+            int star = va_arg(*ap, int);
+            slots[n_slots++] = (uint64_t) (int64_t) star;
+            if (i == s.stars - 1 && s.precision == -2) {
+                precision = star < 0 ? -1 : star;
+            }
+        }
+
+        arg_kind kind = spec_kind(&s);
+        if (kind == ARG_INT) {
+            slots[n_slots++] = (uint64_t) read_int(ap, s.length);
+        } else if (kind == ARG_UINT) {
+            slots[n_slots++] = read_uint(ap, s.length);
+        } else if (kind == ARG_DOUBLE) {
+            double d = s.length[0] == 'L' ? (double) va_arg(*ap, long double) : va_arg(*ap, double);
+            memcpy(&slots[n_slots++], &d, sizeof d);
+        } else if (kind == ARG_POINTER) {
+            slots[n_slots++] = (uintptr_t) va_arg(*ap, void *);
+        } else if (kind == ARG_COUNT) {
+            (void) va_arg(*ap, void *); /* nothing is counted */
+        }
+
+        size_t slots_len = (size_t) n_slots * sizeof *slots;
+        if ((size_t) (end - cur) < slots_len + (kind == ARG_STRING ? sizeof (uint16_t) : 0)) {
+            break;
+        }
+        memcpy(cur, slots, slots_len);
+        cur += slots_len;
+
+        if (kind == ARG_STRING) {
+            const char *str = va_arg(*ap, const char *);
+            if (str == NULL) {
+                str = "(null)";
+            }
+            size_t len = precision >= 0 ? strnlen(str, (size_t) precision) : strlen(str);
+            /* some room for the arguments after it */
+            size_t room = (size_t) (end - cur) > 2 + 64 ? (size_t) (end - cur) - 2 - 64 : 0;
+            if (len > room) {
+                len = room;
+            }
+            uint16_t len16 = (uint16_t) len;
+            memcpy(cur, &len16, sizeof len16);
+            memcpy(cur + sizeof len16, str, len);
+            cur += sizeof len16 + len;
+        }
+    }
+
+    log_header h;
+    h.len = (uint32_t) (cur - rec);
+    h.level = level;
+    h.ns = log_clock_ns() - start_ns;
+    h.fmt = fmt;
+    memcpy(rec, &h, sizeof h);
+    return h.len;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+/* format one record as a line of out */
+static void format_record(const char *rec, FILE *out) {
+    log_header h;
+    memcpy(&h, rec, sizeof h);
+    const char *cur = rec + sizeof h;
+    const char *end = rec + h.len;
+
+    fprintf(out, "%" PRIu64 ".%06" PRIu64 " %s: ", h.ns / 1000000000, h.ns / 1000 % 1000000,
+            h.level >= LOG_DEBUG && h.level <= LOG_ERROR ? level_names[h.level] : "?");
+    const char *p = h.fmt;
+    while (*p != '\0') {
+        const char *text = p;
+        while (*p != '\0' && *p != '%') {
+            p++;
+        }
+        fwrite(text, 1, (size_t) (p - text), out);
+        if (*p == '\0') {
+            break;
+        }
+
+        log_spec s;
+        p = parse_spec(p, &s);
+        arg_kind kind = spec_kind(&s);
+        if (kind == ARG_NONE) {
+            fputc('%', out);
+            continue;
+        }
+        size_t needed = (size_t) s.stars * sizeof (uint64_t);
+        if (kind != ARG_COUNT) {
+            needed += kind == ARG_STRING ? sizeof (uint16_t) : sizeof (uint64_t);
+        }
+        if ((size_t) (end - cur) < needed) {
+            fputs("...", out); /* cut when it was written */
+            break;
+        }
+
+        /* the conversion with widths filled in and the length modifier
+         * the stored argument has */
+        char spec[64];
+        size_t spec_len = 0;
+        for (const char *q = s.start; q < s.length_at && spec_len < sizeof spec - 24; q++) {
+            if (*q != '*') {
+                spec[spec_len++] = *q;
+                continue;
+            }
+            int64_t star;
+            memcpy(&star, cur, sizeof star);
+            cur += sizeof star;
+            if (spec_len > 0 && spec[spec_len - 1] == '.' && star < 0) {
+                spec_len--; /* a negative precision counts as none */
+            } else {
+                spec_len += (size_t) snprintf(spec + spec_len, 24, "%" PRId64, star);
+            }
+        }
+        if (kind == ARG_INT || kind == ARG_UINT) {
+            if (s.conversion != 'c') {
+                spec[spec_len++] = 'j';
+            }
+        }
+        spec[spec_len++] = s.conversion;
+        spec[spec_len] = '\0';
+
+        uint64_t slot = 0;
+        if (kind != ARG_STRING && kind != ARG_COUNT) {
+            memcpy(&slot, cur, sizeof slot);
+            cur += sizeof slot;
+        }
+        if (kind == ARG_INT && s.conversion == 'c') {
+            fprintf(out, spec, (int) slot);
+        } else if (kind == ARG_INT) {
+            fprintf(out, spec, (intmax_t) slot);
+        } else if (kind == ARG_UINT) {
+            fprintf(out, spec, (uintmax_t) slot);
+        } else if (kind == ARG_DOUBLE) {
+            double d;
+            memcpy(&d, &slot, sizeof d);
+            fprintf(out, spec, d);
+        } else if (kind == ARG_POINTER) {
+            fprintf(out, spec, (void *) (uintptr_t) slot);
+        } else if (kind == ARG_STRING) {
+            uint16_t len;
+            memcpy(&len, cur, sizeof len);
+            cur += sizeof len;
+            if ((size_t) (end - cur) < len) {
+                break;
+            }
+            char str[LOG_MAX_RECORD];
+            memcpy(str, cur, len);
+            str[len] = '\0';
+            cur += len;
+            fprintf(out, spec, str);
+        }
+    }
+    fputc('\n', out);
+}
+#pragma GCC diagnostic pop
+
+/* copy len bytes at offset from the tail without consuming them */
+static void ring_peek(log_ring *ring, void *dest, size_t len) {
+    size_t offset = ring->tail % LOG_RING_LEN;
+    size_t first = LOG_RING_LEN - offset < len ? LOG_RING_LEN - offset : len;
+    memcpy(dest, ring->data + offset, first);
+    memcpy((char *) dest + first, ring->data, len - first);
+}
+
+/* format everything in the rings, returns the number of records */
+static size_t drain(void) {
+    /* pairs with the fence in log_write: either the producer sees the tail
+     * we stored and wakes us, or we see its head here */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    size_t n = 0;
+    for (log_ring *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+        uint64_t dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+        if (dropped != r->reported) {
+            fprintf(log_out, "log: %" PRIu64 " records dropped, the ring was full\n", dropped - r->reported);
+            r->reported = dropped;
+        }
+
+        uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        while (head - r->tail >= sizeof (log_header)) {
+            char rec[LOG_MAX_RECORD];
+            log_header h;
+            ring_peek(r, &h, sizeof h);
+            ring_peek(r, rec, h.len);
+            __atomic_store_n(&r->tail, r->tail + h.len, __ATOMIC_RELEASE);
+            format_record(rec, log_out);
+            n++;
+        }
+    }
+
+    return n;
+}
+
+static void *run_log_thread(void *arg) {
+    (void) arg;
+    while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        if (drain() == 0) {
+            fflush(log_out);
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof count) == -1 && errno != EINTR) {
+                fprintf(stderr, "read: %s\n", strerror(errno));
+                break;
+            }
+        }
+    }
+
+    drain();
+    fflush(log_out);
+    return NULL;
+}
+
+/* wake the background thread */
+static void wake(void) {
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof one) == -1 && errno != EAGAIN) {
+        fprintf(stderr, "write: %s\n", strerror(errno));
+    }
+}
+
+int log_open(FILE *out) {
+    log_out = out;
+    start_ns = log_clock_ns();
+    stopping = false;
+    wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        fprintf(stderr, "eventfd: %s\n", strerror(errno));
+        return -1;
+    }
+    int status = pthread_create(&log_thread, NULL, run_log_thread, NULL);
+    if (status != 0) {
+        fprintf(stderr, "pthread_create: %s\n", strerror(status));
+        close(wake_fd);
+        wake_fd = -1;
+        return -1;
+    }
+    __atomic_store_n(&running, true, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* the ring of the calling thread, NULL if there is no memory for one */
+static log_ring *get_ring(void) {
+    if (own_ring != NULL) {
+        return own_ring;
+    }
+
+    log_ring *r = malloc(sizeof *r);
+    if (r == NULL) {
+        return NULL;
+    }
+    r->head = 0;
+    r->tail = 0;
+    r->dropped = 0;
+    r->reported = 0;
+    r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    own_ring = r;
+    return r;
+}
+
+void log_write(int level, const char *fmt, ...) {
+    char rec[LOG_MAX_RECORD];
+    va_list ap;
+    va_start(ap, fmt);
+    size_t len = build_record(rec, level, fmt, &ap);
+    va_end(ap);
+
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        format_record(rec, stdout);
+        return;
+    }
+
+    log_ring *r = get_ring();
+    uint64_t tail = r == NULL ? 0 : __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (r == NULL || LOG_RING_LEN - (size_t) (r->head - tail) < len) {
+        if (r != NULL) {
+            __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        }
+        return; /* never wait for the background thread */
+    }
+
+    size_t offset = r->head % LOG_RING_LEN;
+    size_t first = LOG_RING_LEN - offset < len ? LOG_RING_LEN - offset : len;
+    memcpy(r->data + offset, rec, first);
+    memcpy(r->data, rec + first, len - first);
+    __atomic_store_n(&r->head, r->head + len, __ATOMIC_RELEASE);
+
+    /* only a ring that was empty can have the background thread asleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->tail, __ATOMIC_RELAXED) == r->head - len) {
+        wake();
+    }
+}
+
+/* the other threads are done logging by now, their rings go as well */
+void log_close(void) {
+    if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&running, false, __ATOMIC_RELEASE);
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    wake();
+    pthread_join(log_thread, NULL);
+    close(wake_fd);
+    wake_fd = -1;
+
+    log_ring *r = rings;
+    while (r != NULL) {
+        log_ring *next = r->next;
+        free(r);
+        r = next;
+    }
+    rings = NULL;
+    own_ring = NULL;
+}
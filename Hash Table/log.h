@@ -0,0 +1,41 @@
+#pragma once
+#include <stdint.h>
+#include <stdio.h>
+
+/* a log record is the raw arguments of a printf format, written into a
+ * ring of the calling thread without locks or system calls. a background
+ * thread formats the records and writes them out */
+#define LOG_DEBUG 0
+#define LOG_INFO 1
+#define LOG_WARN 2
+#define LOG_ERROR 3
+
+/* calls below LOG_LEVEL compile to nothing, make LOG_LEVEL=0 keeps them
+ * all */
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+/* a constant, a block under if (log_enabled(level)) goes away as well */
+#define log_enabled(level) ((level) >= LOG_LEVEL)
+
+/* the format has to be a literal, it is read again when the record is
+ * formatted. the arguments are checked against it at every level */
+#define log_at(level, ...) do { if (log_enabled(level)) log_write(level, __VA_ARGS__); } while (0)
+#define log_debug(...) log_at(LOG_DEBUG, __VA_ARGS__)
+#define log_info(...) log_at(LOG_INFO, __VA_ARGS__)
+#define log_warn(...) log_at(LOG_WARN, __VA_ARGS__)
+#define log_error(...) log_at(LOG_ERROR, __VA_ARGS__)
+
+/* bytes of the ring of every thread that logs, a record that does not fit
+ * is dropped and counted */
+#define LOG_RING_LEN (1 << 20)
+/* strings are cut so that a record fits */
+#define LOG_MAX_RECORD 1024
+
+/* start the background thread writing to out. until then records are
+ * formatted right away. returns -1 on error */
+int log_open(FILE *out);
+void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+/* write out what is left and stop the background thread */
+void log_close(void);
@@ -0,0 +1,104 @@
+#!/bin/bash
+
+# re-run the measurements.txt scenario on a chord of N_INSTANCES nodes:
+# set, get and delete key1 to key9, each on a random node, and print the
+# time of every request, the mean number of hops and the udp datagrams
+# per request.
+# usage: ./measure.sh [n_instances] [server options, -F turns fingers off,
+# -R relays answers along the chain]
+# ITERATIVE=1 ./measure.sh ... sends iterative requests from a client with a
+# ring cache, warmed up by one pass of the requests before the measured one
+
+N_INSTANCES=${1:-9}
+shift
+SERVER_OPTS="$@"
+STARTPORT=2048
+MAX=65536 # 2^16
+DIR=`mktemp -d`
+PORTS=()
+PROCS=()
+CLIENT_OPTS=
+if [ -n "$ITERATIVE" ]
+then
+    CLIENT_OPTS="-i -c $DIR/cache"
+fi
+
+# random distinct ids spread over the whole id space
+IDS=(`shuf -i 0-$(($MAX - 1)) -n $N_INSTANCES`)
+
+# every node traces the external messages it handles, a forwarded request
+# shows up once per node it passes
+for ((i=0; i<$N_INSTANCES; i++))
+do
+    NEW_PORT=`expr $STARTPORT + $i`
+    if [ $i -eq 0 ]
+    then
+        ./server -T $DIR/trace.$i $SERVER_OPTS localhost $NEW_PORT ${IDS[$i]} > /dev/null &
+    else
+        REGISTRATION_PORT=${PORTS[(($RANDOM % i))]}
+        ./server -T $DIR/trace.$i $SERVER_OPTS localhost $NEW_PORT localhost $REGISTRATION_PORT ${IDS[$i]} > /dev/null &
+    fi
+    PORTS[$i]=$NEW_PORT
+    PROCS[$i]=$!
+    sleep 0.05
+done
+
+# one fix-fingers round every 500ms refreshes all 16 fingers in 8s
+echo waiting for servers to stabilize chord
+sleep 10
+
+# all udp datagrams received on this system
+udp_in() {
+    awk '/^Udp:/ && $2 ~ /^[0-9]/ { print $2 }' /proc/net/snmp
+}
+
+# the fix-fingers rounds keep sending, their rate is subtracted below
+IDLE_START=`udp_in`
+sleep 2
+IDLE=$((`udp_in` - $IDLE_START))
+
+# a trace is its 8 byte magic and one 20 byte record per message, the keys
+# are all 4 bytes long
+trace_records() {
+    RECORDS=0
+    for ((i=0; i<$N_INSTANCES; i++))
+    do
+        SIZE=`stat -c %s $DIR/trace.$i`
+        RECORDS=$(($RECORDS + ($SIZE - 8) / 20))
+    done
+    echo $RECORDS
+}
+
+run_requests() {
+    for ((i=1; i<=9; i++))
+    do
+        for ACTION in set get del
+        do
+            RANDOM_PORT=${PORTS[(($RANDOM % N_INSTANCES))]}
+            TIME=`timeout 2 ./client $CLIENT_OPTS localhost $RANDOM_PORT $ACTION "key$i" "value$i" | grep -a Nanoseconds | cut -d' ' -f5`
+            echo "$ACTION \"key$i\" \"value$i\": ${TIME:-lost}"
+        done
+    done
+}
+
+if [ -n "$ITERATIVE" ]
+then
+    run_requests > /dev/null
+fi
+
+echo "setup: $N_INSTANCES nodes all running on one system, options: ${SERVER_OPTS:-none} ${CLIENT_OPTS:+iterative}"
+echo "in nanoseconds:"
+N_REQUESTS=27
+RECORDS_START=`trace_records`
+UDP_START=`udp_in`
+START=`date +%s%N`
+run_requests
+
+UDP=$((`udp_in` - $UDP_START))
+ELAPSED=$((`date +%s%N` - $START))
+RECORDS=$((`trace_records` - $RECORDS_START))
+awk "BEGIN { printf \"nodes per request: %.2f\\n\", $RECORDS / $N_REQUESTS }"
+awk "BEGIN { printf \"datagrams per request: %.2f\\n\", ($UDP - $IDLE * $ELAPSED / 2000000000) / $N_REQUESTS }"
+
+kill ${PROCS[@]}
+rm -r $DIR
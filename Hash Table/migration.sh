@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# check that keys survive changes of the ring: set N_KEYS keys on a single
+# node, let N_INSTANCES - 1 nodes join, get all keys, let N_LEAVES of the
+# joined nodes leave one after the other and get all keys again.
+# usage: ./migration.sh [n_instances] [n_keys] [n_leaves] [server options]
+
+N_INSTANCES=${1:-8}
+N_KEYS=${2:-500}
+N_LEAVES=${3:-4}
+shift 3
+SERVER_OPTS="$@"
+STARTPORT=2048
+MAX=65536 # 2^16
+PORTS=()
+PROCS=()
+
+IDS=(`shuf -i 0-$(($MAX - 1)) -n $N_INSTANCES`)
+KEYS=(`od -An -tx4 -N $((4 * $N_KEYS)) /dev/urandom`)
+
+# the number of keys a get through a random running node finds
+get_keys() {
+    FOUND=0
+    for KEY in ${KEYS[@]}
+    do
+        RANDOM_PORT=${PORTS[(($RANDOM % ${#PORTS[@]}))]}
+        if timeout 5 ./client localhost $RANDOM_PORT get "$KEY" "" | grep -aq "value=v$KEY"
+        then
+            FOUND=$(($FOUND + 1))
+        fi
+    done
+    echo $FOUND
+}
+
+./server $SERVER_OPTS localhost $STARTPORT ${IDS[0]} > /dev/null &
+PORTS[0]=$STARTPORT
+PROCS[0]=$!
+sleep 0.5
+
+for KEY in ${KEYS[@]}
+do
+    timeout 5 ./client localhost $STARTPORT set "$KEY" "v$KEY" > /dev/null
+done
+
+for ((i=1; i<$N_INSTANCES; i++))
+do
+    NEW_PORT=`expr $STARTPORT + $i`
+    REGISTRATION_PORT=${PORTS[(($RANDOM % i))]}
+    ./server $SERVER_OPTS localhost $NEW_PORT localhost $REGISTRATION_PORT ${IDS[$i]} > /dev/null &
+    PORTS[$i]=$NEW_PORT
+    PROCS[$i]=$!
+    sleep 0.05
+done
+
+echo waiting for servers to stabilize chord
+sleep 5
+
+echo "setup: $N_INSTANCES nodes, $N_KEYS keys set on the first, options: ${SERVER_OPTS:-none}"
+echo "found after $(($N_INSTANCES - 1)) joins: `get_keys`"
+
+# SIGTERM makes a node hand its keys over and exit
+for ((i=1; i<=$N_LEAVES; i++))
+do
+    START=`date +%s%N`
+    kill ${PROCS[$i]}
+    wait ${PROCS[$i]}
+    echo "leave $i took $(((`date +%s%N` - $START) / 1000000)) ms"
+    PORTS=($STARTPORT `seq $(($STARTPORT + $i + 1)) $(($STARTPORT + $N_INSTANCES - 1))`)
+    sleep 1
+done
+PROCS=(${PROCS[0]} ${PROCS[@]:$(($N_LEAVES + 1))})
+
+# fingers of other nodes point at the nodes that left until the fix-fingers
+# rounds replace them, a request sent over one of them is lost
+sleep 8
+echo "found after $N_LEAVES leaves: `get_keys`"
+
+# no need to hand the keys over at the end
+kill -KILL ${PROCS[@]}
+wait
@@ -0,0 +1,134 @@
+#!/bin/bash
+
+# check that keys survive failures and that hedged gets keep the tail of the
+# latencies short: set N_KEYS keys on a chord of N_INSTANCES nodes, kill
+# N_KILLS nodes with SIGKILL one after the other and get all keys, then
+# stall one node over and over with SIGSTOP and print percentiles of get
+# latencies without and with hedging.
+# usage: ./replication.sh [n_instances] [n_keys] [n_kills] [server options,
+# -k <n> keeps n copies of every key]
+
+N_INSTANCES=${1:-8}
+N_KEYS=${2:-300}
+N_KILLS=${3:-2}
+shift 3
+SERVER_OPTS="$@"
+STARTPORT=2048
+MAX=65536 # 2^16
+DIR=`mktemp -d`
+PORTS=()
+PROCS=()
+
+IDS=(`shuf -i 0-$(($MAX - 1)) -n $N_INSTANCES`)
+KEYS=(`od -An -tx4 -N $((4 * $N_KEYS)) /dev/urandom`)
+
+# the number of keys a get through a random running node finds
+get_keys() {
+    FOUND=0
+    for KEY in ${KEYS[@]}
+    do
+        RANDOM_PORT=${PORTS[(($RANDOM % ${#PORTS[@]}))]}
+        if timeout 5 ./client localhost $RANDOM_PORT get "$KEY" "" | grep -aq "value=v$KEY"
+        then
+            FOUND=$(($FOUND + 1))
+        fi
+    done
+    echo $FOUND
+}
+
+# iterative gets of all keys with the client options, one latency in
+# nanoseconds or lost per line
+get_latencies() {
+    for KEY in ${KEYS[@]}
+    do
+        RANDOM_PORT=${PORTS[(($RANDOM % ${#PORTS[@]}))]}
+        OUT=`timeout 5 ./client -i "$@" localhost $RANDOM_PORT get "$KEY" "" | tr -d "\\000"`
+        if echo "$OUT" | grep -aq "value=v$KEY"
+        then
+            echo "$OUT" | grep -a Nanoseconds | cut -d' ' -f5
+        else
+            echo lost
+        fi
+    done
+}
+
+percentiles() {
+    grep -v lost | sort -n | awk '{ t[NR] = $1 / 1000000 }
+        END {
+            printf "p50: %.1f ms p95: %.1f ms p99: %.1f ms max: %.1f ms", t[int(NR * 0.5) + 1], t[int(NR * 0.95) + 1], t[int(NR * 0.99) + 1], t[NR]
+        }'
+}
+
+for ((i=0; i<$N_INSTANCES; i++))
+do
+    NEW_PORT=`expr $STARTPORT + $i`
+    if [ $i -eq 0 ]
+    then
+        ./server $SERVER_OPTS localhost $NEW_PORT ${IDS[$i]} > /dev/null &
+    else
+        REGISTRATION_PORT=${PORTS[(($RANDOM % i))]}
+        ./server $SERVER_OPTS localhost $NEW_PORT localhost $REGISTRATION_PORT ${IDS[$i]} > /dev/null &
+    fi
+    PORTS[$i]=$NEW_PORT
+    PROCS[$i]=$!
+    sleep 0.05
+done
+
+echo waiting for servers to stabilize chord
+sleep 10
+
+for KEY in ${KEYS[@]}
+do
+    RANDOM_PORT=${PORTS[(($RANDOM % ${#PORTS[@]}))]}
+    timeout 5 ./client localhost $RANDOM_PORT set "$KEY" "v$KEY" > /dev/null
+done
+
+echo "setup: $N_INSTANCES nodes, $N_KEYS keys, options: ${SERVER_OPTS:-none}"
+echo "found: `get_keys`"
+
+# the successor notices a failure within a second, then a restore and new
+# copies follow
+for ((i=1; i<=$N_KILLS; i++))
+do
+    kill -KILL ${PROCS[$i]}
+    PORTS=($STARTPORT `seq $(($STARTPORT + $i + 1)) $(($STARTPORT + $N_INSTANCES - 1))`)
+    sleep 4
+done
+PROCS=(${PROCS[0]} ${PROCS[@]:$(($N_KILLS + 1))})
+
+# until the fix-fingers rounds replace the fingers to killed nodes, a request
+# sent over one of them is lost
+sleep 8
+echo "found after $N_KILLS kills: `get_keys`"
+
+# one pass fills the ring cache and the latency history
+get_latencies -c $DIR/cache -h $DIR/history > /dev/null
+
+# stalls of 200ms are too short for the neighbours to take the node for
+# dead, its answers are late
+STALLED=${PROCS[1]}
+(
+    while kill -STOP $STALLED 2> /dev/null
+    do
+        sleep 0.2
+        kill -CONT $STALLED
+        sleep 0.2
+    done
+) &
+STALLER=$!
+
+cp $DIR/cache $DIR/cache.plain
+get_latencies -c $DIR/cache.plain > $DIR/plain
+echo "one node stalled, lost: `grep -c lost $DIR/plain` `percentiles < $DIR/plain`"
+# the client hedges after the 95th percentile of the history, in whole ms
+HEDGE=`sort -n $DIR/history | awk '{ t[NR] = $1 } END { printf "%d ms", int((t[int(NR * 0.95) + 1] + 999999) / 1000000) }'`
+cp $DIR/cache $DIR/cache.hedged
+get_latencies -c $DIR/cache.hedged -h $DIR/history > $DIR/hedged
+echo "hedged after $HEDGE, lost: `grep -c lost $DIR/hedged` `percentiles < $DIR/hedged`"
+
+kill $STALLER
+wait $STALLER 2> /dev/null
+kill -CONT $STALLED
+kill -KILL ${PROCS[@]}
+wait 2> /dev/null
+rm -r $DIR
@@ -7,6 +7,9 @@
 #include <errno.h>
 #include <assert.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -14,18 +17,44 @@
 #include <netdb.h>
 
 #include "hash_table.h"
+#include "trace.h"
+#include "log.h"
 
 /* hash_table definitions */
 const uint8_t delete_mask = 1;
 const uint8_t set_mask = 1 << 1;
 const uint8_t get_mask = 1 << 2;
 const uint8_t acknowledgment_mask = 1 << 3;
-const uint8_t reserved_mask = 0xF0;
-
-/* the length of an internal message, header, ip, port, id */
-#define INTL_MSG_LEN (1 + 4 + 2 + 2)
+/* a forwarded request carries the address of the client after the value */
+const uint8_t origin_mask = 1 << 4;
+/* an iterative request is not forwarded, a node that is not responsible
+ * answers with a referral to the next node instead */
+const uint8_t iterative_mask = 1 << 5;
+/* a referral carries the next node as value, ip, port, id */
+const uint8_t referral_mask = 1 << 6;
+#define REFERRAL_LEN (4 + 2 + 2)
+/* a request with the referral bit is a hedged read, a replica of the key
+ * answers it from its copy, a node without one stays silent */
+const uint8_t replica_mask = 1 << 6;
+
+/* the length of an internal message, header, destination id, ip, port, id.
+ * the virtual nodes of a server share its address, the destination id says
+ * which of them a message is for */
+#define INTL_MSG_LEN (1 + 2 + 4 + 2 + 2)
+/* a lookup appends the target id and the finger it is for */
+#define INTL_LOOKUP_LEN (INTL_MSG_LEN + 2 + 1)
+/* a successor list appends a count and that many ip, port, id */
+#define N_SUCCESSORS 4
+#define MAX_INTL_MSG_LEN (INTL_MSG_LEN + 1 + N_SUCCESSORS * (4 + 2 + 2))
 #define EXT_HEADER_LEN 6
+/* the client address of a forwarded request, ip, port */
+#define ORIGIN_LEN (4 + 2)
 #define ADDR_LEN sizeof(in_addr)
+/* the largest external message */
+#define MAX_EXT_MSG_LEN (EXT_HEADER_LEN + 2 * UINT16_MAX + ORIGIN_LEN)
+/* a message, key and value copies with terminators, a response and a
+ * forwarded response all fit, so the arena never runs out */
+#define ARENA_LEN (4 * (MAX_EXT_MSG_LEN + 16))
 
 /* mask used to distinguish internal from external messages */
 const uint8_t internal_mask = 1 << 7;
@@ -34,6 +63,51 @@ const uint8_t internal_mask = 1 << 7;
 const uint8_t join_mask = 1;
 const uint8_t notify_mask = 1 << 1;
 const uint8_t stabilize_mask = 1 << 2;
+const uint8_t lookup_mask = 1 << 3;
+const uint8_t finger_mask = 1 << 4;
+const uint8_t successors_mask = 1 << 5;
+/* a handoff moves keys to the node now responsible for them, its kind and
+ * a sequence number follow the internal message */
+const uint8_t handoff_mask = 1 << 6;
+#define HANDOFF_BATCH 0 /* a count and that many key length, value length, key, value */
+#define HANDOFF_ACK 1 /* the batch with the sequence number arrived */
+#define HANDOFF_LEAVE 2 /* the sender leaves, its successor list follows */
+#define HANDOFF_COPY 3 /* a batch for the copies of the receiver */
+/* a set or delete of the owner for the copies of the receiver, acked like a
+ * batch. its action, key length, value length, key, value */
+#define HANDOFF_WRITE 4
+#define HANDOFF_HEADER_LEN (INTL_MSG_LEN + 1 + 2)
+/* batches fill the largest udp payload */
+#define MAX_HANDOFF_LEN 65507
+/* a batch not acked by then is sent again, at most HANDOFF_RETRIES times,
+ * then the keys stay where they are */
+#define HANDOFF_TIMEOUT_MS 250
+#define HANDOFF_RETRIES 8
+/* writes to replicas that may wait for their ack at once */
+#define MAX_WRITES 256
+/* the handoffs of a vnode: its keys to their owner, its copies of a range
+ * its predecessor took over, its keys to each of its replicas */
+#define MOVE_HANDOFF 0
+#define RESTORE_HANDOFF 1
+#define COPY_HANDOFF 2
+#define N_HANDOFFS (COPY_HANDOFF + N_SUCCESSORS)
+
+/* one finger per bit of the id space */
+#define N_FINGERS 16
+/* a fix-fingers round refreshes one finger */
+#define FIX_FINGERS_MS 500
+/* a lookup of a fix-fingers round not answered by then lost its way at
+ * the node it was sent to */
+#define FINGER_TIMEOUT_MS 1000
+/* a stabilize round asks the successor for its predecessor and list */
+#define STABILIZE_MS 250
+/* a successor that did not answer that long is dead, the next one in the
+ * list takes over */
+#define SUCCESSOR_TIMEOUT_MS 1000
+/* a predecessor that did not stabilize that long is dead. shorter than
+ * SUCCESSOR_TIMEOUT_MS, so the node taking over finds the place free */
+#define PREDECESSOR_TIMEOUT_MS 750
+#define CHECK_PREDECESSOR_MS 250
 
 struct server_info {
     struct sockaddr_in address;
@@ -47,25 +121,202 @@ typedef struct dht_node {
     struct server_info *next;
 } dht_node;
 
-/* FIXME good practice to have this as global variable ? */
-static dht_node node = { .self=NULL, .prev=NULL, .next=NULL };
+/* finger i is the node responsible for self + 2^i, a finger that is not
+ * valid is either unknown or ourself */
+typedef struct finger_table {
+    struct server_info node[N_FINGERS];
+    bool valid[N_FINGERS];
+    /* the lookup for finger i was sent at asked_ms, 0 if answered, to the
+     * node with asked_id */
+    long asked_ms[N_FINGERS];
+    uint16_t asked_id[N_FINGERS];
+    int next_fix; /* finger refreshed by the next fix-fingers round */
+} finger_table;
+
+/* the keys of tbl in a range go to dest one batch at a time. a batch stays
+ * in the table until it is acked, so a lost datagram loses no keys */
+typedef struct handoff {
+    bool active;
+    bool rescan; /* the keys changed meanwhile, scan again when done */
+    char kind; /* of the batches, HANDOFF_BATCH or HANDOFF_COPY */
+    hash_table *tbl;
+    /* copies, and keys when we leave, stay and are served until we are
+     * gone, skip are the keys of bucket that were sent */
+    bool keep;
+    size_t skip;
+    struct server_info dest;
+    /* the ring range of the keys that move, the whole ring if start == end */
+    uint16_t start;
+    uint16_t end;
+    size_t bucket; /* the next batch starts at this bucket */
+    size_t table_size; /* a resize mixes the buckets, the scan starts over */
+    uint16_t seq;
+    char *batch; /* MAX_HANDOFF_LEN bytes */
+    size_t batch_len; /* of the batch in flight, 0 if none */
+    long sent_ms;
+    int retries;
+} handoff;
+
+/* one position on the ring. a server hosts -v of them, they share its
+ * socket and event loop, each has its own range and hash table */
+typedef struct vnode {
+    int sock;
+    dht_node node;
+    /* node points into these, so replacing a neighbour needs no allocation */
+    struct server_info self_info;
+    struct server_info prev_info;
+    /* successors[0] is node.next, the others take over when it fails */
+    struct server_info successors[N_SUCCESSORS];
+    int n_successors;
+    /* when the neighbours were last heard of */
+    long next_heard_ms;
+    long prev_heard_ms;
+    finger_table fingers;
+    hash_table *tbl;
+    /* copies of the keys of the predecessors we are a replica for */
+    hash_table *replicas;
+    /* a leaving vnode hands all keys to its predecessor, handed_off once
+     * that is done */
+    bool leaving;
+    bool handed_off;
+    handoff handoffs[N_HANDOFFS];
+    uint16_t next_seq; /* of the next batch, an ack names the batch it is for */
+} vnode;
+
+#define MAX_VNODES 64
+static vnode vnodes[MAX_VNODES];
+static int n_vnodes = 1;
+
+/* a write sent to a replica and not acked yet, handoff_round sends it again.
+ * a newer write of the key to the same replica replaces it, so a late retry
+ * never overwrites a newer value */
+typedef struct replica_write {
+    bool used;
+    vnode *vn;
+    struct server_info dest;
+    uint16_t seq;
+    char *msg; /* the key is at WRITE_HEADER_LEN */
+    size_t msg_len;
+    uint16_t key_len;
+    long sent_ms;
+    int retries;
+} replica_write;
+
+#define WRITE_HEADER_LEN (HANDOFF_HEADER_LEN + 1 + 2 + 2)
+static replica_write writes[MAX_WRITES];
+
+/* -F forwards to the successor only, as before finger tables */
+static bool use_fingers = true;
+/* -R passes answers back along the forwarding chain instead of sending
+ * them to the client directly */
+static bool relay = false;
+/* -k keeps every key on its owner and the next k - 1 successors on other
+ * servers, a key survives k - 1 failures */
+#define MAX_REPLICATION (N_SUCCESSORS + 1)
+static int replication = 1;
+
+/* a request we forwarded and still wait the answer for. the transaction id
+ * is replaced by the index of its entry, so the answer finds it again */
+#define MAX_PENDING 256
+/* an answer that takes longer is given up, the client has to retry */
+#define PENDING_TIMEOUT_MS 1000
+
+typedef struct pending_request {
+    bool used;
+    char transaction_id; /* the id the origin chose */
+    struct sockaddr_storage origin;
+    socklen_t origin_len;
+    long deadline_ms;
+} pending_request;
+
+static pending_request pending[MAX_PENDING];
+static int next_pending = 0;
+
+/* bump allocator for everything that lives only while one message is
+ * handled, arena_reset releases it all at once */
+typedef struct arena {
+    char *data;
+    size_t len;
+    size_t used;
+} arena;
+
+static arena msg_arena = { .data=NULL, .len=0, .used=0 };
+
+/* size bytes from the arena, aligned for any type */
+void *arena_alloc(arena *a, size_t size) {
+    size_t start = (a->used + 15) & ~(size_t) 15;
+    assert(start + size <= a->len); /* ARENA_LEN covers the largest message */
+    a->used = start + size;
+    return a->data + start;
+}
+
+void arena_reset(arena *a) {
+    a->used = 0;
+}
+
+/* external requests are recorded here unless it is NULL, see -T */
+static trace_writer *trace = NULL;
+
+/* monotonic milliseconds, for the timers of the main loop */
+long now_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* a free pending entry, or -1 if MAX_PENDING requests are in flight */
+int pending_alloc(void) {
+    for (int i = 0; i < MAX_PENDING; i++) {
+        int idx = (next_pending + i) % MAX_PENDING;
+        if (!pending[idx].used) {
+            next_pending = (idx + 1) % MAX_PENDING;
+            pending[idx].used = true;
+            return idx;
+        }
+    }
+
+    return -1;
+}
+
+/* drop requests whose answer did not arrive in time, returns the next
+ * deadline or -1 if nothing is pending */
+long expire_pending(long now) {
+    long next_deadline = -1;
+    for (int i = 0; i < MAX_PENDING; i++) {
+        if (!pending[i].used) {
+            continue;
+        }
+
+        if (pending[i].deadline_ms <= now) {
+            fprintf(stderr, "expire_pending: no answer for transaction %d\n", pending[i].transaction_id);
+            pending[i].used = false;
+        } else if (next_deadline == -1 || pending[i].deadline_ms < next_deadline) {
+            next_deadline = pending[i].deadline_ms;
+        }
+    }
 
-bool is_key_in_range(dht_node node, char *key, size_t key_len) {
+    return next_deadline;
+}
+
+bool is_id_in_range(vnode *vn, uint16_t id) {
     /* chord only contains one node */
-    if (node.next == NULL) {
+    if (vn->node.next == NULL) {
         return true;
     }
 
-    uint16_t start_id = ntohs(node.self->id);
-    uint16_t end_id = ntohs(node.next->id);
-    uint16_t hash_val = string_hash(key, key_len);
+    uint16_t start_id = ntohs(vn->node.self->id);
+    uint16_t end_id = ntohs(vn->node.next->id);
 
     uint16_t end_offset = end_id - start_id;
-    uint16_t val_offset = hash_val - start_id;
+    uint16_t val_offset = id - start_id;
 
     return val_offset < end_offset;
 }
 
+bool is_key_in_range(vnode *vn, char *key, size_t key_len) {
+    return is_id_in_range(vn, string_hash(key, key_len));
+}
+
 bool is_in_range(struct server_info *start, struct server_info *end, struct server_info *val) {
     uint16_t start_id = ntohs(start->id);
     uint16_t end_id = ntohs(end->id);
@@ -77,13 +328,47 @@ bool is_in_range(struct server_info *start, struct server_info *end, struct serv
     return val_offset < end_offset;
 }
 
-void print_server_info(struct server_info *srv) {
-    if (srv == NULL) {
-        printf("None\n");
-        return;
+/* the id finger i is responsible for */
+uint16_t finger_target(vnode *vn, int i) {
+    return (uint16_t) (ntohs(vn->node.self->id) + (1 << i));
+}
+
+/* the known node closest to target without passing it, the next hop for
+ * everything about target */
+struct server_info *closest_preceding_node(vnode *vn, uint16_t target) {
+    uint16_t self_id = ntohs(vn->node.self->id);
+    uint16_t target_offset = target - self_id;
+
+    for (int i = N_FINGERS - 1; use_fingers && i >= 0; i--) {
+        if (!vn->fingers.valid[i]) {
+            continue;
+        }
+
+        uint16_t offset = ntohs(vn->fingers.node[i].id) - self_id;
+        if (offset > 0 && offset <= target_offset) {
+            return &vn->fingers.node[i];
+        }
     }
 
-    printf("id=%" PRIu16 " ip=%s port=%" PRIu16 "\n", ntohs(srv->id), inet_ntoa(srv->address.sin_addr), ntohs(srv->address.sin_port));
+    return vn->node.next;
+}
+
+/* a server in a log record. the log thread formats the ip, inet_ntoa would
+ * do it on the hot path */
+#define SERVER_FMT "id=%" PRIu16 " ip=%u.%u.%u.%u port=%" PRIu16
+#define IP_BYTE(srv, i) (unsigned) ((const uint8_t *) &(srv)->address.sin_addr)[i]
+#define SERVER_ARGS(srv) ntohs((srv)->id), IP_BYTE(srv, 0), IP_BYTE(srv, 1), IP_BYTE(srv, 2), IP_BYTE(srv, 3), \
+    ntohs((srv)->address.sin_port)
+
+/* log what and srv, which may be NULL */
+void log_server(int level, const char *what, struct server_info *srv) {
+    if (!log_enabled(level)) {
+        return;
+    } else if (srv == NULL) {
+        log_write(level, "%s: None", what);
+    } else {
+        log_write(level, "%s: " SERVER_FMT, what, SERVER_ARGS(srv));
+    }
 }
 
 int send_msg(int sock, char *msg, size_t msg_len, struct server_info *dest) {
@@ -105,16 +390,16 @@ struct sockaddr_in get_address(uint32_t ip_address, uint16_t port) {
     return addr;
 }
 
-char *fill_intl_msg(char action, struct server_info *srv, size_t *len) {
+/* write an internal message to msg, which holds INTL_MSG_LEN bytes */
+void fill_intl_msg(char *msg, char action, struct server_info *srv) {
     assert(sizeof (struct in_addr) == sizeof (uint32_t));
-    assert(INTL_MSG_LEN == (sizeof srv->address.sin_addr + sizeof srv->id + sizeof srv->address.sin_port + 1));
+    assert(INTL_MSG_LEN == (sizeof srv->address.sin_addr + sizeof srv->id + sizeof srv->address.sin_port + 3));
 
-    char *msg = calloc(INTL_MSG_LEN, sizeof *msg);
-    char *ret_msg = msg; /* pointer to start of array */
-
-    msg[0] |= internal_mask;
-    msg[0] |= action;
+    msg[0] = internal_mask | action;
     msg++;
+    /* the destination id is filled in by send_intl_msg */
+    memset(msg, 0, sizeof srv->id);
+    msg += sizeof srv->id;
 
     struct in_addr ip_address = srv->address.sin_addr;
     uint16_t port = srv->address.sin_port;
@@ -125,25 +410,47 @@ char *fill_intl_msg(char action, struct server_info *srv, size_t *len) {
     memcpy(msg, &port, sizeof port);
     msg += sizeof port;
     memcpy(msg, &id, sizeof id);
-    msg += sizeof id;
+}
+
+/* write a lookup for target on behalf of srv to msg, which holds
+ * INTL_LOOKUP_LEN bytes */
+void fill_lookup_msg(char *msg, char action, struct server_info *srv, uint16_t target, uint8_t finger) {
+    fill_intl_msg(msg, action, srv);
+    target = htons(target);
+    memcpy(msg + INTL_MSG_LEN, &target, sizeof target);
+    msg[INTL_MSG_LEN + sizeof target] = (char) finger;
+}
 
-    *len = INTL_MSG_LEN;
-    return ret_msg;
+/* append the client address of a request, ORIGIN_LEN bytes */
+void fill_origin(char *dest, struct sockaddr_in *addr) {
+    memcpy(dest, &addr->sin_addr, sizeof addr->sin_addr);
+    memcpy(dest + sizeof addr->sin_addr, &addr->sin_port, sizeof addr->sin_port);
 }
 
-struct server_info *parse_msg(char *msg, size_t msg_len) {
+struct sockaddr_in parse_origin(char *src) {
+    struct sockaddr_in addr;
+
+    addr.sin_family = AF_INET;
+    memcpy(&addr.sin_addr, src, sizeof addr.sin_addr); /* already in network byte order */
+    memcpy(&addr.sin_port, src + sizeof addr.sin_addr, sizeof addr.sin_port);
+    memset(addr.sin_zero, '\0', sizeof addr.sin_zero);
+
+    return addr;
+}
+
+struct server_info parse_msg(char *msg, size_t msg_len) {
     assert(msg[0] & internal_mask);
-    assert(msg_len == INTL_MSG_LEN);
+    assert(msg_len >= INTL_MSG_LEN);
 
     uint16_t port;
     uint16_t id;
     uint32_t ip;
-    struct server_info *res = malloc(sizeof *res);
-    memcpy(&ip, msg+1, sizeof ip);
-    memcpy(&port, msg+5, sizeof port);
-    memcpy(&id, msg+7, sizeof id);
+    struct server_info res;
+    memcpy(&ip, msg+3, sizeof ip);
+    memcpy(&port, msg+7, sizeof port);
+    memcpy(&id, msg+9, sizeof id);
 
-    res->id = id;
+    res.id = id;
 
     assert(sizeof (struct in_addr) == sizeof ip);
     struct sockaddr_in addr;
@@ -153,12 +460,17 @@ struct server_info *parse_msg(char *msg, size_t msg_len) {
     memcpy(&(addr.sin_addr.s_addr), &ip, sizeof ip); /* ip already in network byte order */
     memset(addr.sin_zero, '\0', sizeof addr.sin_zero);
 
-    res->address = addr;
+    res.address = addr;
 
     return res;
 }
 
-void print_msg(char *msg, size_t msg_len) {
+/* log what and an internal message at debug level */
+void log_msg(const char *what, char *msg, size_t msg_len) {
+    if (!log_enabled(LOG_DEBUG)) {
+        return;
+    }
+
     char *action;
     if (msg[0] & join_mask) {
         action = "join";
@@ -166,27 +478,38 @@ void print_msg(char *msg, size_t msg_len) {
         action = "notify";
     } else if (msg[0] & stabilize_mask) {
         action = "stabilize";
+    } else if (msg[0] & lookup_mask) {
+        action = "lookup";
+    } else if (msg[0] & finger_mask) {
+        action = "finger";
+    } else if (msg[0] & successors_mask) {
+        action = "successors";
+    } else if (msg[0] & handoff_mask) {
+        action = "handoff";
     } else {
         action = "unkwnon action";
     }
 
-    struct server_info *srv = parse_msg(msg, msg_len);
-    printf("action: %s, data: ", action);
-    print_server_info(srv);
-    free(srv);
-
-    printf("\n");
+    struct server_info srv = parse_msg(msg, msg_len);
+    if (msg[0] & (lookup_mask | finger_mask) && msg_len == INTL_LOOKUP_LEN) {
+        uint16_t target;
+        memcpy(&target, msg + INTL_MSG_LEN, sizeof target);
+        log_debug("%s: action: %s, data: " SERVER_FMT " target=%" PRIu16 " finger=%d", what, action, SERVER_ARGS(&srv),
+                ntohs(target), msg[INTL_MSG_LEN + sizeof target]);
+    } else {
+        log_debug("%s: action: %s, data: " SERVER_FMT, what, action, SERVER_ARGS(&srv));
+    }
 }
 
 int send_intl_msg(int sock, char *msg, size_t msg_len, struct server_info *dest) {
-    assert(msg_len == INTL_MSG_LEN);
-    printf("sending message to: ");
-    print_server_info(dest);
-    print_msg(msg, msg_len);
+    assert(msg_len >= INTL_MSG_LEN && msg_len <= MAX_HANDOFF_LEN);
+    memcpy(msg + 1, &dest->id, sizeof dest->id);
+    log_server(LOG_DEBUG, "sending message to", dest);
+    log_msg("sent", msg, msg_len);
     send_msg(sock, msg, msg_len, dest);
 }
 
-ssize_t join(int sock, char *registration_ip, char *registration_port) {
+ssize_t join(vnode *vn, char *registration_ip, char *registration_port) {
     /* send own ip to registration node */
     ssize_t status;
     struct addrinfo hints;
@@ -197,12 +520,10 @@ ssize_t join(int sock, char *registration_ip, char *registration_port) {
     hints.ai_socktype = SOCK_DGRAM;  // TCP stream sockets
     getaddrinfo(registration_ip, registration_port, &hints, &registration_info);
 
-    size_t msg_len;
-    char *msg;
-    msg = fill_intl_msg(join_mask, node.self, &msg_len);
-    status = sendto(sock, msg, msg_len, 0, registration_info->ai_addr, registration_info->ai_addrlen);
+    char msg[INTL_MSG_LEN];
+    fill_intl_msg(msg, join_mask, vn->node.self);
+    status = sendto(vn->sock, msg, sizeof msg, 0, registration_info->ai_addr, registration_info->ai_addrlen);
 
-    free(msg);
     freeaddrinfo(registration_info);
     return status;
 }
@@ -210,182 +531,1135 @@ ssize_t join(int sock, char *registration_ip, char *registration_port) {
 int notify(int sock, struct server_info *dest, struct server_info *srv) {
     /* send prev_ip */
     ssize_t status;
-    size_t msg_len;
-    char *msg;
-    msg = fill_intl_msg(notify_mask, srv, &msg_len);
+    char msg[INTL_MSG_LEN];
+    fill_intl_msg(msg, notify_mask, srv);
 
-    send_intl_msg(sock, msg, msg_len, dest);
+    send_intl_msg(sock, msg, sizeof msg, dest);
     if (status < 0) {
         fprintf(stderr, "notify: %s\n", strerror(errno));
     }
 
-    free(msg);
     return status;
 }
 
-int stabilize(int sock, struct server_info *dest) {
+int stabilize(vnode *vn, struct server_info *dest) {
     /* fill in own ip, send to next */
     ssize_t status;
-    size_t msg_len;
-    char *msg;
+    char msg[INTL_MSG_LEN];
 
-    msg = fill_intl_msg(stabilize_mask, node.self, &msg_len);
-    send_intl_msg(sock, msg, msg_len, dest);
+    fill_intl_msg(msg, stabilize_mask, vn->node.self);
+    send_intl_msg(vn->sock, msg, sizeof msg, dest);
 
-    free(msg);
     return status;
 }
 
-void set_next(int sock, struct server_info *next) {
-    if (node.next != NULL) {
-        free(node.next);
+/* ask the ring who is responsible for the target of finger i, the answer
+ * comes back as a finger message */
+void fix_finger(vnode *vn, int i) {
+    uint16_t target = finger_target(vn, i);
+
+    if (is_id_in_range(vn, target)) {
+        /* that is us */
+        vn->fingers.valid[i] = false;
+        return;
+    }
+
+    char msg[INTL_LOOKUP_LEN];
+    struct server_info *hop = closest_preceding_node(vn, target);
+    fill_lookup_msg(msg, lookup_mask, vn->node.self, target, (uint8_t) i);
+    send_intl_msg(vn->sock, msg, sizeof msg, hop);
+    vn->fingers.asked_ms[i] = now_ms();
+    vn->fingers.asked_id[i] = hop->id;
+}
+
+/* stop routing over a node that seems to be gone */
+void forget_node(vnode *vn, uint16_t id) {
+    for (int i = 0; i < N_FINGERS; i++) {
+        if (vn->fingers.valid[i] && vn->fingers.node[i].id == id) {
+            vn->fingers.valid[i] = false;
+        }
+    }
+}
+
+/* one fix-fingers round */
+void fix_fingers(vnode *vn) {
+    if (!use_fingers || vn->node.next == NULL || vn->leaving) {
+        return;
+    }
+
+    long now = now_ms();
+    for (int i = 0; i < N_FINGERS; i++) {
+        if (vn->fingers.asked_ms[i] != 0 && now - vn->fingers.asked_ms[i] > FINGER_TIMEOUT_MS) {
+            vn->fingers.asked_ms[i] = 0;
+            if (vn->fingers.asked_id[i] != vn->node.next->id) {
+                forget_node(vn, vn->fingers.asked_id[i]); /* the successor has its own timeout */
+            }
+        }
+    }
+
+    fix_finger(vn, vn->fingers.next_fix);
+    vn->fingers.next_fix = (vn->fingers.next_fix + 1) % N_FINGERS;
+}
+
+/* the local vnode with id, NULL if there is none */
+vnode *find_vnode(uint16_t id) {
+    for (int i = 0; i < n_vnodes; i++) {
+        if (vnodes[i].node.self->id == id) {
+            return &vnodes[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* both run on one server */
+bool is_same_server(struct server_info *a, struct server_info *b) {
+    return a->address.sin_addr.s_addr == b->address.sin_addr.s_addr && a->address.sin_port == b->address.sin_port;
+}
+
+void start_handoff(vnode *vn);
+void start_stream(vnode *vn, handoff *h, char kind, hash_table *tbl, bool keep, struct server_info *dest, uint16_t start, uint16_t end);
+
+void finish_handoff(vnode *vn, handoff *h) {
+    free(h->batch);
+    h->batch = NULL;
+    h->batch_len = 0;
+    h->active = false;
+    if (h == &vn->handoffs[MOVE_HANDOFF]) {
+        vn->handed_off = vn->leaving;
+    }
+    if (h->rescan) {
+        h->rescan = false;
+        if (h == &vn->handoffs[MOVE_HANDOFF]) {
+            start_handoff(vn);
+        } else {
+            start_stream(vn, h, h->kind, h->tbl, h->keep, &h->dest, h->start, h->end);
+        }
     }
-    node.next = next;
-    stabilize(sock, next);
 }
 
-int handle_join(int sock, char *msg, size_t msg_len) {
+/* send the next batch of keys, the handoff is over when the scan finds
+ * none left */
+void send_batch(vnode *vn, handoff *h) {
+    if (h->tbl->size != h->table_size) {
+        /* the keys moved so far are gone, a new scan finds the rest. kept
+         * keys are sent again, the receiver has them already */
+        h->bucket = 0;
+        h->skip = 0;
+        h->table_size = h->tbl->size;
+    }
+
+    char *cur_batch = h->batch + HANDOFF_HEADER_LEN + 2;
+    uint16_t count = 0;
+    hash_table_elem *elem = NULL;
+    size_t bucket = h->bucket;
+    size_t passed = 0; /* keys of bucket in range */
+    while ((elem = ht_next_in_range(h->tbl, &h->bucket, elem, h->start, h->end)) != NULL) {
+        if (h->bucket != bucket) {
+            bucket = h->bucket;
+            passed = 0;
+            h->skip = 0;
+        }
+        if (passed++ < h->skip) {
+            continue;
+        }
+
+        size_t entry_len = 2 + 2 + elem->key_len + elem->value_len;
+        if (entry_len > (size_t) (h->batch + MAX_HANDOFF_LEN - cur_batch)) {
+            if (count == 0) {
+                fprintf(stderr, "send_batch: %zu byte key and value do not fit a datagram\n", entry_len);
+                continue;
+            }
+            /* the next batch starts at the head of this bucket again, the
+             * keys of this batch are deleted or skipped by then */
+            h->skip = h->keep ? passed - 1 : 0;
+            break;
+        }
+
+        uint16_t num = htons((uint16_t) elem->key_len);
+        memcpy(cur_batch, &num, sizeof num);
+        cur_batch += sizeof num;
+        num = htons((uint16_t) elem->value_len);
+        memcpy(cur_batch, &num, sizeof num);
+        cur_batch += sizeof num;
+        memcpy(cur_batch, elem->key, elem->key_len);
+        cur_batch += elem->key_len;
+        memcpy(cur_batch, elem->value, elem->value_len);
+        cur_batch += elem->value_len;
+        count++;
+    }
+
+    if (count == 0) {
+        finish_handoff(vn, h);
+        return;
+    }
+
+    fill_intl_msg(h->batch, handoff_mask, vn->node.self);
+    h->batch[INTL_MSG_LEN] = h->kind;
+    h->seq = vn->next_seq++;
+    uint16_t num = htons(h->seq);
+    memcpy(h->batch + INTL_MSG_LEN + 1, &num, sizeof num);
+    num = htons(count);
+    memcpy(h->batch + HANDOFF_HEADER_LEN, &num, sizeof num);
+    h->batch_len = (size_t) (cur_batch - h->batch);
+
+    log_info("%s of %" PRIu16 " keys to: " SERVER_FMT, h->kind == HANDOFF_COPY ? "copy" : "handoff", count,
+            SERVER_ARGS(&h->dest));
+    send_intl_msg(vn->sock, h->batch, h->batch_len, &h->dest);
+    h->sent_ms = now_ms();
+    h->retries = 0;
+}
+
+/* send the keys of tbl in [start, end) to dest, as kind batches. a handoff
+ * to another node gives up the one in flight */
+void start_stream(vnode *vn, handoff *h, char kind, hash_table *tbl, bool keep, struct server_info *dest, uint16_t start, uint16_t end) {
+    if (h->active) {
+        if (h->dest.id == dest->id && is_same_server(&h->dest, dest)) {
+            h->rescan = true;
+            return;
+        }
+        free(h->batch);
+        h->batch = NULL;
+        h->batch_len = 0;
+        h->active = false;
+    }
+
+    h->kind = kind;
+    h->tbl = tbl;
+    h->keep = keep;
+    h->dest = *dest;
+    h->start = start;
+    h->end = end;
+    h->batch = malloc(MAX_HANDOFF_LEN);
+    if (h->batch == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return;
+    }
+    h->active = true;
+    h->bucket = 0;
+    h->skip = 0;
+    h->table_size = tbl->size;
+    send_batch(vn, h);
+}
+
+/* the node that takes over our range when we leave, our first predecessor
+ * on another server, the vnodes of ours leave with us. NULL if unknown */
+struct server_info *heir(vnode *vn) {
+    struct server_info *prev = vn->node.prev;
+    for (int i = 0; prev != NULL && is_same_server(prev, vn->node.self); i++) {
+        vnode *local = find_vnode(prev->id);
+        if (local == NULL || i == n_vnodes) {
+            return NULL;
+        }
+        prev = local->node.prev;
+    }
+
+    return prev;
+}
+
+/* move the keys outside our range to the node responsible for them, the
+ * successor after it took part of our range, the predecessor when we
+ * leave. the ring keeps serving in between the batches */
+void start_handoff(vnode *vn) {
+    handoff *h = &vn->handoffs[MOVE_HANDOFF];
+    if (h->active) {
+        h->rescan = true;
+        return;
+    }
+
+    uint16_t self_id = ntohs(vn->node.self->id);
+    if (vn->leaving) {
+        struct server_info *dest = heir(vn);
+        if (dest == NULL) {
+            return; /* until a predecessor stabilizes us */
+        }
+        start_stream(vn, h, HANDOFF_BATCH, vn->tbl, true, dest, self_id, self_id);
+    } else if (vn->node.next != NULL) {
+        /* else the whole ring is ours */
+        start_stream(vn, h, HANDOFF_BATCH, vn->tbl, false, vn->node.next, ntohs(vn->node.next->id), self_id);
+    }
+}
+
+/* the successors that keep copies of our keys, the first replication - 1
+ * of them on servers other than ours and each other's */
+int replica_targets(vnode *vn, struct server_info **targets) {
+    int n = 0;
+    for (int i = 0; i < vn->n_successors && n < replication - 1; i++) {
+        struct server_info *srv = &vn->successors[i];
+        bool taken = is_same_server(srv, vn->node.self);
+        for (int j = 0; j < n; j++) {
+            taken |= is_same_server(srv, targets[j]);
+        }
+        if (!taken) {
+            targets[n++] = srv;
+        }
+    }
+
+    return n;
+}
+
+/* copy all our keys to the replicas that changed since the last call, or
+ * to all of them */
+void copy_to_replicas(vnode *vn, bool all) {
+    if (vn->leaving) {
+        return; /* our heir copies them */
+    }
+
+    struct server_info *targets[N_SUCCESSORS];
+    int n = replica_targets(vn, targets);
+    for (int i = 0; i < n; i++) {
+        handoff *h = &vn->handoffs[COPY_HANDOFF + i];
+        if (!all && h->dest.id == targets[i]->id && is_same_server(&h->dest, targets[i])) {
+            continue;
+        }
+        start_stream(vn, h, HANDOFF_COPY, vn->tbl, true, targets[i], 0, 0);
+    }
+}
+
+/* the entry for a write of key to dest, the one still waiting for its ack
+ * if there is one. NULL if MAX_WRITES are in flight */
+replica_write *write_slot(vnode *vn, struct server_info *dest, char *key, uint16_t key_len) {
+    replica_write *free_slot = NULL;
+    for (int i = 0; i < MAX_WRITES; i++) {
+        replica_write *w = &writes[i];
+        if (!w->used) {
+            free_slot = free_slot == NULL ? w : free_slot;
+        } else if (w->vn == vn && w->dest.id == dest->id && is_same_server(&w->dest, dest)
+                && w->key_len == key_len && memcmp(w->msg + WRITE_HEADER_LEN, key, key_len) == 0) {
+            return w;
+        }
+    }
+
+    return free_slot;
+}
+
+void write_done(replica_write *w) {
+    free(w->msg);
+    w->msg = NULL;
+    w->used = false;
+}
+
+/* pass a set or delete on to the replicas of our keys, each keeps it until
+ * the replica acked it */
+void replicate(vnode *vn, uint8_t action, char *key, uint16_t key_len, char *value, uint16_t value_len) {
+    struct server_info *targets[N_SUCCESSORS];
+    int n = replica_targets(vn, targets);
+    if (n == 0) {
+        return;
+    }
+
+    size_t msg_len = WRITE_HEADER_LEN + (size_t) key_len + value_len;
+    if (msg_len > MAX_HANDOFF_LEN) {
+        fprintf(stderr, "replicate: %zu byte key and value do not fit a datagram\n", msg_len);
+        return;
+    }
+
+    for (int i = 0; i < n; i++) {
+        replica_write *w = write_slot(vn, targets[i], key, key_len);
+        if (w == NULL) {
+            fprintf(stderr, "replicate: %d writes wait for an ack, the copy of id %" PRIu16 " is stale\n",
+                    MAX_WRITES, ntohs(targets[i]->id));
+            continue;
+        }
+        char *msg = malloc(msg_len);
+        if (msg == NULL) {
+            fprintf(stderr, "malloc: %s\n", strerror(errno));
+            continue;
+        }
+        if (w->used) {
+            free(w->msg); /* the newer write replaces it */
+        }
+
+        fill_intl_msg(msg, handoff_mask, vn->node.self);
+        msg[INTL_MSG_LEN] = HANDOFF_WRITE;
+        w->seq = vn->next_seq++;
+        uint16_t num = htons(w->seq);
+        memcpy(msg + INTL_MSG_LEN + 1, &num, sizeof num);
+        char *cur = msg + HANDOFF_HEADER_LEN;
+        *cur++ = (char) action;
+        num = htons(key_len);
+        memcpy(cur, &num, sizeof num);
+        cur += sizeof num;
+        num = htons(value_len);
+        memcpy(cur, &num, sizeof num);
+        cur += sizeof num;
+        memcpy(cur, key, key_len);
+        memcpy(cur + key_len, value, value_len);
+
+        w->used = true;
+        w->vn = vn;
+        w->dest = *targets[i];
+        w->msg = msg;
+        w->msg_len = msg_len;
+        w->key_len = key_len;
+        w->retries = 0;
+        send_intl_msg(vn->sock, msg, msg_len, &w->dest);
+        w->sent_ms = now_ms();
+    }
+}
+
+/* our predecessor took over the range of one that failed, it gets our
+ * copies of the keys in it */
+void restore(vnode *vn) {
+    if (replication == 1 || vn->node.prev == NULL || vn->replicas->n_elems == 0) {
+        return;
+    }
+
+    start_stream(vn, &vn->handoffs[RESTORE_HANDOFF], HANDOFF_BATCH, vn->replicas, true, vn->node.prev,
+            ntohs(vn->node.prev->id), ntohs(vn->node.self->id));
+}
+
+/* one handoff round, sends the batches again that were not acked in time */
+void handoff_round(vnode *vn) {
+    for (int i = 0; i < N_HANDOFFS; i++) {
+        handoff *h = &vn->handoffs[i];
+        if (!h->active || now_ms() - h->sent_ms < HANDOFF_TIMEOUT_MS) {
+            continue;
+        }
+
+        if (++h->retries > HANDOFF_RETRIES) {
+            fprintf(stderr, "handoff_round: no ack from id %" PRIu16 ", the keys stay\n", ntohs(h->dest.id));
+            finish_handoff(vn, h);
+            continue;
+        }
+
+        send_intl_msg(vn->sock, h->batch, h->batch_len, &h->dest);
+        h->sent_ms = now_ms();
+    }
+
+    for (int i = 0; i < MAX_WRITES; i++) {
+        replica_write *w = &writes[i];
+        if (!w->used || w->vn != vn || now_ms() - w->sent_ms < HANDOFF_TIMEOUT_MS) {
+            continue;
+        }
+
+        if (++w->retries > HANDOFF_RETRIES) {
+            fprintf(stderr, "handoff_round: no ack from id %" PRIu16 ", its copy is stale\n", ntohs(w->dest.id));
+            write_done(w);
+            continue;
+        }
+
+        send_intl_msg(vn->sock, w->msg, w->msg_len, &w->dest);
+        w->sent_ms = now_ms();
+    }
+}
+
+/* the successor changed, tell it about us and rebuild the fingers */
+void successor_changed(vnode *vn) {
+    vn->node.next = &vn->successors[0];
+    vn->next_heard_ms = now_ms();
+    stabilize(vn, vn->node.next);
+
+    /* build the whole table right away, the rounds only keep it fresh */
+    for (int i = 0; use_fingers && i < N_FINGERS; i++) {
+        fix_finger(vn, i);
+    }
+
+    /* keys behind a new successor are its now */
+    start_handoff(vn);
+    copy_to_replicas(vn, false);
+}
+
+void set_next(vnode *vn, struct server_info *next) {
+    /* the new successor goes in front of the old ones, next may point
+     * into the list */
+    struct server_info new_next = *next;
+    if (vn->n_successors == N_SUCCESSORS) {
+        vn->n_successors--;
+    }
+    memmove(vn->successors + 1, vn->successors, (size_t) vn->n_successors * sizeof *vn->successors);
+    vn->successors[0] = new_next;
+    vn->n_successors++;
+    successor_changed(vn);
+}
+
+/* one stabilize round, fails over to the next successor if the current one
+ * stopped answering */
+void stabilize_round(vnode *vn) {
+    if (vn->node.next == NULL || vn->leaving) {
+        return;
+    }
+
+    if (now_ms() - vn->next_heard_ms > SUCCESSOR_TIMEOUT_MS) {
+        log_server(LOG_WARN, "successor failed", vn->node.next);
+        forget_node(vn, vn->node.next->id);
+
+        vn->n_successors--;
+        memmove(vn->successors, vn->successors + 1, (size_t) vn->n_successors * sizeof *vn->successors);
+        if (vn->n_successors == 0) {
+            /* all vn->successors are gone, we are on our own */
+            vn->node.next = NULL;
+            return;
+        }
+        successor_changed(vn);
+        return;
+    }
+
+    stabilize(vn, vn->node.next);
+}
+
+/* forget a predecessor that stopped stabilizing, the next node that does
+ * takes its place */
+void check_predecessor(vnode *vn) {
+    if (vn->node.prev != NULL && now_ms() - vn->prev_heard_ms > PREDECESSOR_TIMEOUT_MS) {
+        log_server(LOG_WARN, "predecessor failed", vn->node.prev);
+        vn->node.prev = NULL;
+    }
+}
+
+/* write up to max of our successors to dest, a count and that many ip,
+ * port, id, and return the length. when we leave, the other vnodes of our
+ * server leave as well, the list goes on behind the last of them in a row */
+size_t fill_successors(vnode *vn, char *dest, int max) {
+    vnode *last = vn;
+    for (int i = 0; vn->leaving && i < n_vnodes && last->node.next != NULL && is_same_server(last->node.next, vn->node.self); i++) {
+        vnode *local = find_vnode(last->node.next->id);
+        if (local == NULL) {
+            break;
+        }
+        last = local;
+    }
+
+    int count = 0;
+    char *cur = dest + 1;
+    for (int i = 0; i < last->n_successors && count < max; i++) {
+        if (vn->leaving && is_same_server(&last->successors[i], vn->node.self)) {
+            continue;
+        }
+        fill_origin(cur, &last->successors[i].address);
+        cur += ORIGIN_LEN;
+        memcpy(cur, &last->successors[i].id, sizeof last->successors[i].id);
+        cur += sizeof last->successors[i].id;
+        count++;
+    }
+    dest[0] = (char) count;
+
+    return (size_t) (cur - dest);
+}
+
+/* read a list written by fill_successors into our successors from index
+ * first on */
+int parse_successors(vnode *vn, char *list, size_t list_len, int first) {
+    if (list_len < 1) {
+        return -1;
+    }
+    int count = (uint8_t) list[0];
+    if (list_len != (size_t) (1 + count * (ORIGIN_LEN + 2))) {
+        return -1;
+    }
+
+    vn->n_successors = first;
+    char *cur = list + 1;
+    for (int i = 0; i < count && vn->n_successors < N_SUCCESSORS; i++) {
+        struct server_info srv;
+        srv.address = parse_origin(cur);
+        cur += ORIGIN_LEN;
+        memcpy(&srv.id, cur, sizeof srv.id);
+        cur += sizeof srv.id;
+
+        /* in a small chord the list wraps around to us */
+        if (srv.id == vn->node.self->id) {
+            break;
+        }
+        vn->successors[vn->n_successors++] = srv;
+    }
+
+    return 0;
+}
+
+/* send our successor list to src, which puts us in front of it */
+void send_successors(vnode *vn, struct server_info *dest) {
+    char msg[MAX_INTL_MSG_LEN];
+    fill_intl_msg(msg, successors_mask, vn->node.self);
+
+    /* the last one would fall off the list of dest anyway */
+    size_t list_len = fill_successors(vn, msg + INTL_MSG_LEN, N_SUCCESSORS - 1);
+    send_intl_msg(vn->sock, msg, INTL_MSG_LEN + list_len, dest);
+}
+
+/* tell dest we leave, with our successors to take over if it has us as
+ * its successor */
+void send_leave(vnode *vn, struct server_info *dest) {
+    char msg[HANDOFF_HEADER_LEN + 1 + N_SUCCESSORS * (ORIGIN_LEN + 2)];
+    fill_intl_msg(msg, handoff_mask, vn->node.self);
+    msg[INTL_MSG_LEN] = HANDOFF_LEAVE;
+    memset(msg + INTL_MSG_LEN + 1, 0, 2);
+    size_t list_len = fill_successors(vn, msg + HANDOFF_HEADER_LEN, N_SUCCESSORS);
+    send_intl_msg(vn->sock, msg, HANDOFF_HEADER_LEN + list_len, dest);
+}
+
+int handle_join(vnode *vn, char *msg, size_t msg_len) {
     /* check if responsible, if yes set prev, send notify to source */
-    assert(msg[0] & join_mask && msg[0] & internal_mask);
-    assert(msg_len == INTL_MSG_LEN);
-    struct server_info *srv = parse_msg(msg, msg_len);
+    if (!(msg[0] & join_mask && msg[0] & internal_mask) || msg_len != INTL_MSG_LEN) {
+        return -1; /* a stray or cut off datagram */
+    }
+    struct server_info srv = parse_msg(msg, msg_len);
 
     /* we are the only node in the chord */
-    if (node.next == NULL) {
-        notify(sock, srv, node.self);
-        set_next(sock, srv);
+    if (vn->node.next == NULL) {
+        notify(vn->sock, &srv, vn->node.self);
+        set_next(vn, &srv);
         return 0;
     }
 
-    if (is_in_range(node.self, node.next, srv) || node.next->id == node.self->id) {
-        notify(sock, srv, node.next);
-        set_next(sock, srv);
+    if (is_in_range(vn->node.self, vn->node.next, &srv) || vn->node.next->id == vn->node.self->id) {
+        notify(vn->sock, &srv, vn->node.next);
+        set_next(vn, &srv);
     } else {
-        send_intl_msg(sock, msg, msg_len, node.next);
-        free(srv);
+        send_intl_msg(vn->sock, msg, msg_len, closest_preceding_node(vn, ntohs(srv.id)));
     }
 }
 
-int handle_notify(int sock, char *msg, size_t msg_len) {
+int handle_notify(vnode *vn, char *msg, size_t msg_len) {
     /* parse ip as src_ip, set prev to src_ip */
-    assert(msg[0] & notify_mask && msg[0] & internal_mask);
-    assert(msg_len == INTL_MSG_LEN);
+    if (!(msg[0] & notify_mask && msg[0] & internal_mask) || msg_len != INTL_MSG_LEN) {
+        return -1; /* a stray or cut off datagram */
+    }
 
-    struct server_info *srv = parse_msg(msg, msg_len);
-    if (node.next == NULL || is_in_range(node.self, node.next, srv) && srv->id != node.self->id) {
-        set_next(sock, srv);
-    } else {
-        free(srv);
+    struct server_info srv = parse_msg(msg, msg_len);
+    if (vn->node.next == NULL || is_in_range(vn->node.self, vn->node.next, &srv) && srv.id != vn->node.self->id) {
+        set_next(vn, &srv);
     }
 }
 
-int handle_stabilize(int sock, char *msg, size_t msg_len) {
+int handle_stabilize(vnode *vn, char *msg, size_t msg_len) {
     /* parse ip as dest_ip, fill in prev ip, send notify to dest_ip */
-    assert(msg[0] & stabilize_mask && msg[0] & internal_mask);
-    assert(msg_len == INTL_MSG_LEN);
-    struct server_info *src = parse_msg(msg, msg_len);
+    if (!(msg[0] & stabilize_mask && msg[0] & internal_mask) || msg_len != INTL_MSG_LEN) {
+        return -1; /* a stray or cut off datagram */
+    }
+    struct server_info src = parse_msg(msg, msg_len);
+
+    if (vn->leaving && !is_same_server(&src, vn->node.self)) {
+        /* src still has us as successor, it takes over our range and keys */
+        vn->prev_info = src;
+        vn->node.prev = &vn->prev_info;
+        send_leave(vn, &src);
+        if (!vn->handoffs[MOVE_HANDOFF].active || vn->handoffs[MOVE_HANDOFF].dest.id != src.id) {
+            start_handoff(vn);
+        }
+        return 0;
+    }
 
-    if (node.prev == NULL || is_in_range(node.prev, node.self, src)) {
-        node.prev = src;
+    if (vn->node.prev == NULL || is_in_range(vn->node.prev, vn->node.self, &src)) {
+        /* a predecessor after one that failed or left took over its range,
+         * a new one in between gets the keys from the old one */
+        bool took_over = vn->node.prev == NULL;
+        vn->prev_info = src;
+        vn->node.prev = &vn->prev_info;
+        if (took_over) {
+            restore(vn);
+        }
+    }
+    if (src.id == vn->node.prev->id) {
+        vn->prev_heard_ms = now_ms();
     }
 
-    assert(node.prev != NULL); /* if we notify NULL, something went terribly wrong */
-    notify(sock, src, node.prev);
+    assert(vn->node.prev != NULL); /* if we notify NULL, something went terribly wrong */
+    notify(vn->sock, &src, vn->node.prev);
+    send_successors(vn, &src);
 }
 
-int handle_intl_msg(int sock) {
-    printf("before message:\n");
-    printf("prev: ");
-    print_server_info(node.prev);
+int handle_successors(vnode *vn, char *msg, size_t msg_len) {
+    /* our successor is alive, its list follows it in ours */
+    if (!(msg[0] & successors_mask && msg[0] & internal_mask) || msg_len <= INTL_MSG_LEN) {
+        return -1; /* a stray or cut off datagram */
+    }
+    struct server_info src = parse_msg(msg, msg_len);
+
+    if (vn->node.next == NULL || src.id != vn->node.next->id) {
+        return -1;
+    }
+    if (parse_successors(vn, msg + INTL_MSG_LEN, msg_len - INTL_MSG_LEN, 1) == -1) {
+        return -1;
+    }
+    vn->next_heard_ms = now_ms();
+    copy_to_replicas(vn, false);
+
+    return 0;
+}
+
+/* tell src that its batch or write msg arrived */
+void send_handoff_ack(vnode *vn, char *msg, struct server_info *src) {
+    char ack[HANDOFF_HEADER_LEN];
+    fill_intl_msg(ack, handoff_mask, vn->node.self);
+    ack[INTL_MSG_LEN] = HANDOFF_ACK;
+    memcpy(ack + INTL_MSG_LEN + 1, msg + INTL_MSG_LEN + 1, 2); /* seq */
+    send_intl_msg(vn->sock, ack, sizeof ack, src);
+}
+
+/* store a batch of keys handed to us and ack it. a key we have already was
+ * set here after the handoff began and is newer. copies are the owner's
+ * latest values and replace ours */
+int handle_batch(vnode *vn, char *msg, size_t msg_len) {
+    struct server_info src = parse_msg(msg, msg_len);
+    if (msg_len < HANDOFF_HEADER_LEN + 2) {
+        return -1;
+    }
 
-    printf("next: ");
-    print_server_info(node.next);
+    if (vn->leaving) {
+        /* without an ack the keys stay with src, which should not count on
+         * us anymore */
+        send_leave(vn, &src);
+        return -1;
+    }
 
+    uint16_t count;
+    memcpy(&count, msg + HANDOFF_HEADER_LEN, sizeof count);
+    count = ntohs(count);
+    char *cur_msg = msg + HANDOFF_HEADER_LEN + 2;
+    char *end = msg + msg_len;
+    bool copies = msg[INTL_MSG_LEN] == HANDOFF_COPY;
+    bool stray = false;
+    for (int i = 0; i < count; i++) {
+        uint16_t key_len;
+        uint16_t value_len;
+        if (end - cur_msg < 4) {
+            return -1;
+        }
+        memcpy(&key_len, cur_msg, sizeof key_len);
+        key_len = ntohs(key_len);
+        memcpy(&value_len, cur_msg + 2, sizeof value_len);
+        value_len = ntohs(value_len);
+        cur_msg += 4;
+        if (end - cur_msg < key_len + value_len) {
+            return -1;
+        }
+
+        void *old_value;
+        size_t old_value_len;
+        if (copies) {
+            ht_set_value(vn->replicas, cur_msg, key_len, cur_msg + key_len, value_len);
+        } else if (ht_get_value(vn->tbl, cur_msg, key_len, &old_value, &old_value_len) == -1) {
+            ht_set_value(vn->tbl, cur_msg, key_len, cur_msg + key_len, value_len);
+        }
+        stray |= !copies && !is_key_in_range(vn, cur_msg, key_len);
+        cur_msg += key_len + value_len;
+    }
+
+    send_handoff_ack(vn, msg, &src);
+
+    /* keys for nodes further along the ring move on, our replicas need
+     * copies of the new ones */
+    if (stray) {
+        start_handoff(vn);
+    }
+    if (!copies) {
+        copy_to_replicas(vn, true);
+    }
+    return 0;
+}
+
+/* the batch in flight arrived, delete its keys and send the next one. or
+ * a write to a replica arrived */
+int handle_batch_ack(vnode *vn, char *msg, size_t msg_len) {
+    struct server_info src = parse_msg(msg, msg_len);
+    uint16_t seq;
+    memcpy(&seq, msg + INTL_MSG_LEN + 1, sizeof seq);
+    seq = ntohs(seq);
+    handoff *h = NULL;
+    for (int i = 0; i < N_HANDOFFS && h == NULL; i++) {
+        handoff *cur = &vn->handoffs[i];
+        if (cur->active && cur->batch_len > 0 && src.id == cur->dest.id && seq == cur->seq) {
+            h = cur;
+        }
+    }
+    if (h == NULL) {
+        for (int i = 0; i < MAX_WRITES; i++) {
+            replica_write *w = &writes[i];
+            if (w->used && w->vn == vn && src.id == w->dest.id && seq == w->seq) {
+                write_done(w);
+                return 0;
+            }
+        }
+        return -1; /* late or twice */
+    }
+
+    uint16_t count;
+    memcpy(&count, h->batch + HANDOFF_HEADER_LEN, sizeof count);
+    count = ntohs(count);
+    char *cur_batch = h->batch + HANDOFF_HEADER_LEN + 2;
+    for (int i = 0; i < count && !h->keep; i++) {
+        uint16_t key_len;
+        uint16_t value_len;
+        memcpy(&key_len, cur_batch, sizeof key_len);
+        key_len = ntohs(key_len);
+        memcpy(&value_len, cur_batch + 2, sizeof value_len);
+        value_len = ntohs(value_len);
+        cur_batch += 4;
+        ht_delete_key(h->tbl, cur_batch, key_len);
+        cur_batch += key_len + value_len;
+    }
+
+    h->batch_len = 0;
+    if (h->rescan) {
+        finish_handoff(vn, h); /* and start over, towards the new owner */
+    } else {
+        send_batch(vn, h);
+    }
+    return 0;
+}
+
+/* a neighbour leaves. our successor's range and successors become ours,
+ * our predecessor's place goes to the next node that stabilizes */
+int handle_leave(vnode *vn, char *msg, size_t msg_len) {
+    struct server_info src = parse_msg(msg, msg_len);
+    if (vn->node.prev != NULL && vn->node.prev->id == src.id) {
+        vn->node.prev = NULL;
+    }
+
+    if (vn->node.next != NULL && vn->node.next->id == src.id) {
+        forget_node(vn, src.id);
+        if (parse_successors(vn, msg + HANDOFF_HEADER_LEN, msg_len - HANDOFF_HEADER_LEN, 0) == -1) {
+            return -1;
+        }
+        if (vn->n_successors == 0) {
+            vn->node.next = NULL; /* we are on our own */
+        } else {
+            successor_changed(vn);
+        }
+    }
+
+    handoff *h = &vn->handoffs[MOVE_HANDOFF];
+    if (h->active && h->dest.id == src.id) {
+        /* it takes no keys anymore, they stay until the scan starts over */
+        h->rescan = true;
+        finish_handoff(vn, h);
+    }
+    for (int i = RESTORE_HANDOFF; i < N_HANDOFFS; i++) {
+        h = &vn->handoffs[i];
+        if (h->active && h->dest.id == src.id) {
+            finish_handoff(vn, h);
+        }
+    }
+
+    return 0;
+}
+
+/* a set or delete of a key we keep a copy of, acked once applied */
+int handle_write(vnode *vn, char *msg, size_t msg_len) {
+    struct server_info src = parse_msg(msg, msg_len);
+    if (msg_len < WRITE_HEADER_LEN) {
+        return -1;
+    }
+
+    char *cur = msg + HANDOFF_HEADER_LEN;
+    uint8_t action = (uint8_t) *cur++;
+    uint16_t key_len;
+    uint16_t value_len;
+    memcpy(&key_len, cur, sizeof key_len);
+    key_len = ntohs(key_len);
+    memcpy(&value_len, cur + 2, sizeof value_len);
+    value_len = ntohs(value_len);
+    cur += 4;
+    if (msg_len != (size_t) (cur - msg) + key_len + value_len) {
+        return -1;
+    }
+
+    if (action & delete_mask) {
+        ht_delete_key(vn->replicas, cur, key_len);
+    } else if (action & set_mask) {
+        ht_set_value(vn->replicas, cur, key_len, cur + key_len, value_len);
+    }
+    send_handoff_ack(vn, msg, &src);
+    return 0;
+}
+
+int handle_handoff(vnode *vn, char *msg, size_t msg_len) {
+    if (!(msg[0] & handoff_mask && msg[0] & internal_mask) || msg_len < HANDOFF_HEADER_LEN) {
+        return -1;
+    }
+
+    if (msg[INTL_MSG_LEN] == HANDOFF_BATCH || msg[INTL_MSG_LEN] == HANDOFF_COPY) {
+        return handle_batch(vn, msg, msg_len);
+    } else if (msg[INTL_MSG_LEN] == HANDOFF_ACK) {
+        return handle_batch_ack(vn, msg, msg_len);
+    } else if (msg[INTL_MSG_LEN] == HANDOFF_LEAVE) {
+        return handle_leave(vn, msg, msg_len);
+    } else if (msg[INTL_MSG_LEN] == HANDOFF_WRITE) {
+        return handle_write(vn, msg, msg_len);
+    }
+
+    return -1;
+}
+
+/* leave the ring. the predecessor takes over our range and successors, the
+ * successor forgets us, then our keys follow to the predecessor with
+ * start_handoff. the vnodes of our server leave as well, they are skipped */
+void leave(vnode *vn) {
+    vn->leaving = true;
+    if (vn->node.next == NULL || vn->tbl->n_elems == 0) {
+        vn->handed_off = true; /* nobody to take the keys or none to take */
+    }
+    if (vn->node.next == NULL) {
+        return;
+    }
+
+    /* the successor first, else the predecessor could stabilize it before
+     * it forgot us and be told about us again */
+    if (!is_same_server(vn->node.next, vn->node.self)) {
+        send_leave(vn, vn->node.next);
+    }
+    if (vn->node.prev != NULL && !is_same_server(vn->node.prev, vn->node.self)) {
+        send_leave(vn, vn->node.prev);
+    }
+}
+
+int handle_lookup(vnode *vn, char *msg, size_t msg_len) {
+    /* answer the origin if we are responsible for the target, else pass
+     * the lookup on towards it */
+    if (!(msg[0] & lookup_mask && msg[0] & internal_mask) || msg_len != INTL_LOOKUP_LEN) {
+        return -1; /* a stray or cut off datagram */
+    }
+    struct server_info origin = parse_msg(msg, msg_len);
+
+    uint16_t target;
+    memcpy(&target, msg + INTL_MSG_LEN, sizeof target);
+    target = ntohs(target);
+    uint8_t finger = (uint8_t) msg[INTL_MSG_LEN + sizeof target];
+
+    if (is_id_in_range(vn, target)) {
+        char reply[INTL_LOOKUP_LEN];
+        fill_lookup_msg(reply, finger_mask, vn->node.self, target, finger);
+        send_intl_msg(vn->sock, reply, sizeof reply, &origin);
+    } else {
+        send_intl_msg(vn->sock, msg, msg_len, closest_preceding_node(vn, target));
+    }
+}
+
+int handle_finger(vnode *vn, char *msg, size_t msg_len) {
+    /* parse the responsible node into the finger it was looked up for */
+    if (!(msg[0] & finger_mask && msg[0] & internal_mask) || msg_len != INTL_LOOKUP_LEN) {
+        return -1; /* a stray or cut off datagram */
+    }
+    struct server_info owner = parse_msg(msg, msg_len);
+
+    uint16_t target;
+    memcpy(&target, msg + INTL_MSG_LEN, sizeof target);
+    target = ntohs(target);
+    uint8_t finger = (uint8_t) msg[INTL_MSG_LEN + sizeof target];
+
+    /* an answer for someone else or an id we no longer have */
+    if (finger >= N_FINGERS || target != finger_target(vn, finger)) {
+        return -1;
+    }
+
+    vn->fingers.node[finger] = owner;
+    vn->fingers.valid[finger] = owner.id != vn->node.self->id;
+    vn->fingers.asked_ms[finger] = 0;
+    return 0;
+}
+
+/* the local vnode closest before target, the responsible one if we have
+ * it. vnodes still joining have no range yet */
+vnode *route_vnode(uint16_t target) {
+    vnode *best = &vnodes[0];
+    uint16_t best_offset = target - ntohs(best->node.self->id);
+    for (int i = 1; i < n_vnodes; i++) {
+        uint16_t offset = target - ntohs(vnodes[i].node.self->id);
+        if (vnodes[i].node.next != NULL && (best->node.next == NULL || offset < best_offset)) {
+            best = &vnodes[i];
+            best_offset = offset;
+        }
+    }
+
+    return best;
+}
+
+int handle_intl_msg(int sock) {
     ssize_t status;
-    char *msg = calloc(INTL_MSG_LEN, sizeof *msg);
+    /* a handoff batch is the largest internal message */
+    char *msg = arena_alloc(&msg_arena, MAX_HANDOFF_LEN);
     struct sockaddr_storage their_addr;
-    socklen_t addr_size;
-    status = recvfrom(sock, msg, INTL_MSG_LEN, 0, (struct sockaddr *)&their_addr, &addr_size);
+    socklen_t addr_size = sizeof their_addr;
+    status = recvfrom(sock, msg, MAX_HANDOFF_LEN, 0, (struct sockaddr *)&their_addr, &addr_size);
+    if (status < INTL_MSG_LEN) {
+        return -1;
+    }
+    size_t msg_len = (size_t) status;
 
-    assert(msg[0] & internal_mask);
+    if (!(msg[0] & internal_mask)) {
+        return -1;
+    }
 
-    printf("received: ");
-    print_msg(msg, INTL_MSG_LEN);
+    /* joins and lookups go to the vnode closest to their target, the
+     * others to the vnode they name */
+    vnode *vn;
+    if (join_mask & msg[0]) {
+        vn = route_vnode(ntohs(parse_msg(msg, msg_len).id));
+    } else if (lookup_mask & msg[0] && msg_len == INTL_LOOKUP_LEN) {
+        uint16_t target;
+        memcpy(&target, msg + INTL_MSG_LEN, sizeof target);
+        vn = route_vnode(ntohs(target));
+    } else {
+        uint16_t dest_id;
+        memcpy(&dest_id, msg + 1, sizeof dest_id);
+        vn = find_vnode(dest_id);
+        if (vn == NULL) {
+            return -1; /* for a vnode that is gone */
+        }
+    }
+
+    log_debug("before message:");
+    log_server(LOG_DEBUG, "self", vn->node.self);
+    log_server(LOG_DEBUG, "prev", vn->node.prev);
+    log_server(LOG_DEBUG, "next", vn->node.next);
+    log_msg("received", msg, msg_len);
 
     if (join_mask & msg[0]) {
-        handle_join(sock, msg, INTL_MSG_LEN);
+        handle_join(vn, msg, msg_len);
     } else if (notify_mask & msg[0]) {
-        handle_notify(sock, msg, INTL_MSG_LEN);
+        handle_notify(vn, msg, msg_len);
     } else if (stabilize_mask & msg[0]) {
-        handle_stabilize(sock, msg, INTL_MSG_LEN);
+        handle_stabilize(vn, msg, msg_len);
+    } else if (lookup_mask & msg[0]) {
+        handle_lookup(vn, msg, msg_len);
+    } else if (finger_mask & msg[0]) {
+        handle_finger(vn, msg, msg_len);
+    } else if (successors_mask & msg[0]) {
+        handle_successors(vn, msg, msg_len);
+    } else if (handoff_mask & msg[0]) {
+        handle_handoff(vn, msg, msg_len);
     } else {
-        assert(0); /* no action bit set */
-        /* FIXME return -1; */
+        return -1; /* no action bit set */
     }
 
-    free(msg);
-    printf("after message:\n");
-    printf("prev: ");
-    print_server_info(node.prev);
-
-    printf("next: ");
-    print_server_info(node.next);
+    log_debug("after message:");
+    log_server(LOG_DEBUG, "prev", vn->node.prev);
+    log_server(LOG_DEBUG, "next", vn->node.next);
 }
 
-int handle_ext_msg(hash_table *tbl, int sock) {
-    printf("external message:\n");
+int handle_ext_msg(int sock) {
+    log_debug("external message:");
     ssize_t status;
-    char *msg = calloc(EXT_HEADER_LEN, sizeof *msg);
+    char header[EXT_HEADER_LEN];
     struct sockaddr_storage their_addr;
-    socklen_t addr_size;
-    status = recvfrom(sock, msg, EXT_HEADER_LEN, MSG_PEEK, (struct sockaddr *)&their_addr, &addr_size);
+    socklen_t addr_size = sizeof their_addr;
+    status = recvfrom(sock, header, EXT_HEADER_LEN, MSG_PEEK, (struct sockaddr *)&their_addr, &addr_size);
 
     if (status < 0) {
         fprintf(stderr, "recvfrom: %s\n", strerror(errno));
+        return -1;
     } else if (status < EXT_HEADER_LEN) {
+        /* drop the runt, it would stay queued otherwise */
+        recv(sock, header, sizeof header, 0);
         return -1;
     }
 
     /* read key length and value length */
-    char action = msg[0];
+    char action = header[0];
     uint16_t recv_key_len;
-    memcpy(&recv_key_len, msg + 2, sizeof recv_key_len);
+    memcpy(&recv_key_len, header + 2, sizeof recv_key_len);
     recv_key_len = ntohs(recv_key_len);
 
     uint16_t recv_value_len;
-    memcpy(&recv_value_len, msg + 4, sizeof recv_value_len);
+    memcpy(&recv_value_len, header + 4, sizeof recv_value_len);
     recv_value_len = ntohs(recv_value_len);
     int msg_len = EXT_HEADER_LEN + recv_key_len + recv_value_len;
+    if (action & origin_mask) {
+        msg_len += ORIGIN_LEN;
+    }
+
+    /* everything below lives in msg_arena until the message is handled,
+     * msg has room to append the origin when we forward */
+    char *msg = arena_alloc(&msg_arena, msg_len + ORIGIN_LEN);
+    status = recvfrom(sock, msg, msg_len, MSG_TRUNC, (struct sockaddr *)&their_addr, &addr_size);
+    if (status < 0) {
+        fprintf(stderr, "recvfrom: %s\n", strerror(errno));
+        return -1;
+    }
+    if (status != msg_len) {
+        /* the arena is not cleared, a short datagram would be completed
+         * by whatever the previous message left there */
+        return -1;
+    }
 
-    msg = realloc(msg, msg_len * sizeof(*msg));
-    recvfrom(sock, msg, msg_len, 0, (struct sockaddr *)&their_addr, &addr_size);
-    char *recv_key_buffer = calloc(recv_key_len+1, sizeof *recv_key_buffer);
-    char *recv_value_buffer = calloc(recv_value_len+1, sizeof *recv_value_buffer);
+    /* the answer to a request we forwarded, pass it back to its origin */
+    if (action & acknowledgment_mask) {
+        pending_request *req = &pending[(uint8_t) msg[1]];
+        if (!req->used) {
+            /* expired or a duplicate */
+            return -1;
+        }
+
+        msg[1] = req->transaction_id;
+        status = sendto(sock, msg, (size_t) msg_len, 0, (struct sockaddr *)&req->origin, req->origin_len);
+        if (status == -1) {
+            fprintf(stderr, "send: %s\n", strerror(errno));
+        }
+        req->used = false;
+        return 0;
+    }
+
+    /* the answer goes to the client, which is the sender unless the
+     * request was forwarded */
+    struct sockaddr_storage reply_addr = their_addr;
+    socklen_t reply_addr_size = addr_size;
+    if (action & origin_mask) {
+        struct sockaddr_in origin = parse_origin(msg + msg_len - ORIGIN_LEN);
+        memcpy(&reply_addr, &origin, sizeof origin);
+        reply_addr_size = sizeof origin;
+        action ^= origin_mask;
+    }
+    bool iterative = action & iterative_mask;
+    bool hedged = action & replica_mask;
+    action = (char) (action & ~(iterative_mask | replica_mask));
+
+    /* our vnode closest to the key answers or forwards */
+    vnode *vn = route_vnode(string_hash(msg + EXT_HEADER_LEN, recv_key_len));
+    hash_table *tbl = vn->tbl;
+    bool answer = is_key_in_range(vn, msg + EXT_HEADER_LEN, recv_key_len);
+
+    char *recv_key_buffer = arena_alloc(&msg_arena, recv_key_len + 1);
+    char *recv_value_buffer = arena_alloc(&msg_arena, recv_value_len + 1);
     char *cur_msg = msg;
     cur_msg += EXT_HEADER_LEN;
 
     memcpy(recv_key_buffer, cur_msg, recv_key_len);
+    recv_key_buffer[recv_key_len] = '\0';
     cur_msg += recv_key_len;
 
     memcpy(recv_value_buffer, cur_msg, recv_value_len);
+    recv_value_buffer[recv_value_len] = '\0';
     cur_msg += recv_value_len;
 
-    printf("action=%"PRIu8 " transaction_id=%d key_len=%"PRIu16 " value_len=%"PRIu16 " key=%s value=%s\n",
+    log_debug("action=%"PRIu8 " transaction_id=%d key_len=%"PRIu16 " value_len=%"PRIu16 " key=%s value=%s",
             action, msg[1], recv_key_len, recv_value_len, recv_key_buffer, recv_value_buffer);
+    if (trace != NULL) {
+        trace_write(trace, (uint8_t) action, recv_key_buffer, recv_key_len, recv_value_buffer, recv_value_len);
+    }
 
-    if (is_key_in_range(node, recv_key_buffer, recv_key_len)) {
+    if (hedged && !answer) {
+        /* the copy may be on any of our vnodes, the one after the owner */
+        for (int i = 0; i < n_vnodes && !answer; i++) {
+            void *value;
+            size_t value_len;
+            if (ht_get_value(vnodes[i].replicas, recv_key_buffer, recv_key_len, &value, &value_len) == 0) {
+                tbl = vnodes[i].replicas;
+                answer = true;
+            }
+        }
+        if (!answer) {
+            return 0; /* the owner answers */
+        }
+        action = (char) (action & get_mask); /* copies are read only */
+    }
+
+    if (answer) {
         /* process request */
         if (action & delete_mask) {
             status = ht_delete_key(tbl, recv_key_buffer, recv_key_len);
             if (status == -1) {
                 action ^= delete_mask;
             }
+            replicate(vn, delete_mask, recv_key_buffer, recv_key_len, NULL, 0);
         }
 
         if (action & set_mask) {
             status = ht_set_value(tbl, recv_key_buffer, recv_key_len, recv_value_buffer, recv_value_len);
             if (status == -1) {
                 action ^= set_mask;
+            } else {
+                replicate(vn, set_mask, recv_key_buffer, recv_key_len, recv_value_buffer, recv_value_len);
             }
         }
 
@@ -408,7 +1682,7 @@ int handle_ext_msg(hash_table *tbl, int sock) {
         /* build response header */
         uint16_t num;
         size_t response_len = EXT_HEADER_LEN + send_key_len + send_value_len;
-        char *response = calloc(response_len, sizeof *response);
+        char *response = arena_alloc(&msg_arena, response_len);
         char *cur_response = response;
         cur_response[0] = action;
         cur_response++;
@@ -435,64 +1709,127 @@ int handle_ext_msg(hash_table *tbl, int sock) {
             cur_response += send_value_len;
         }
 
-        status = sendto(sock, response, response_len, 0, (struct sockaddr*)&their_addr, addr_size);
+        status = sendto(sock, response, response_len, 0, (struct sockaddr*)&reply_addr, reply_addr_size);
+        if (status == -1) {
+            fprintf(stderr, "send: %s\n", strerror(errno));
+        }
+    } else if (iterative) {
+        /* refer the client to the best next node we know */
+        struct server_info *next_hop = closest_preceding_node(vn, string_hash(recv_key_buffer, recv_key_len));
+        char response[EXT_HEADER_LEN + REFERRAL_LEN];
+        response[0] = (char) (action | acknowledgment_mask | referral_mask);
+        response[1] = msg[1]; /* transaction_id */
+        uint16_t num = 0;
+        memcpy(response + 2, &num, sizeof num);
+        num = htons(REFERRAL_LEN);
+        memcpy(response + 4, &num, sizeof num);
+        fill_origin(response + EXT_HEADER_LEN, &next_hop->address);
+        memcpy(response + EXT_HEADER_LEN + ORIGIN_LEN, &next_hop->id, sizeof next_hop->id);
+
+        status = sendto(sock, response, sizeof response, 0, (struct sockaddr*)&reply_addr, reply_addr_size);
         if (status == -1) {
             fprintf(stderr, "send: %s\n", strerror(errno));
         }
-        free(response);
+    } else if (!relay) {
+        /* forward, the responsible node answers the client itself */
+        if (!(msg[0] & origin_mask)) {
+            assert(addr_size == sizeof (struct sockaddr_in));
+            fill_origin(msg + msg_len, (struct sockaddr_in *)&their_addr);
+            msg[0] |= origin_mask;
+            msg_len += ORIGIN_LEN;
+        }
+        send_msg(sock, msg, msg_len, closest_preceding_node(vn, string_hash(recv_key_buffer, recv_key_len)));
     } else {
-        /* forward, FIXME use fingertable */
-        struct sockaddr_storage peer_addr;
-        socklen_t peer_addr_size;
-        char transaction_id = msg[1];
-        send_msg(sock, msg, msg_len, node.next);
-        /* wait for answert */
-        char *response = calloc(EXT_HEADER_LEN, sizeof *response);
-        recvfrom(sock, response, 1, MSG_PEEK, (struct sockaddr*)&peer_addr, &peer_addr_size);
-        /* the server can not handle several clients at once. we expect that
-         * no message except the ones we sent are answered,
-         * if someone else sent a message we panic */
-        assert(!(response[0] & internal_mask));
-        recvfrom(sock, response, EXT_HEADER_LEN, MSG_PEEK, (struct sockaddr*)&peer_addr, &peer_addr_size);
-        assert(response[1] == transaction_id); /* someone else sent a message, we cant handle such scenarios */
-
-        uint16_t key_len;
-        memcpy(&key_len, msg + 2, sizeof key_len);
-        key_len = ntohs(key_len);
+        /* forward, the answer is matched in the pending table when it
+         * arrives */
+        int idx = pending_alloc();
+        if (idx == -1) {
+            fprintf(stderr, "handle_ext_msg: too many pending requests\n");
+            return -1;
+        }
 
-        uint16_t value_len;
-        memcpy(&value_len, msg + 4, sizeof value_len);
-        value_len = ntohs(value_len);
-        int response_len = EXT_HEADER_LEN + key_len + value_len;
-        response = realloc(response, response_len * (sizeof *response));
-        recvfrom(sock, response, response_len, 0, (struct sockaddr*)&peer_addr, &peer_addr_size);
+        pending_request *req = &pending[idx];
+        req->transaction_id = msg[1];
+        memcpy(&req->origin, &their_addr, addr_size);
+        req->origin_len = addr_size;
+        req->deadline_ms = now_ms() + PENDING_TIMEOUT_MS;
 
-        /* send to origin of request */
-        sendto(sock, response, response_len, 0, (struct sockaddr*)&their_addr, addr_size);
-        free(response);
+        msg[1] = (char) idx;
+        send_msg(sock, msg, msg_len, closest_preceding_node(vn, string_hash(recv_key_buffer, recv_key_len)));
     }
-
-    free(msg);
 }
 
-int handle_msg(hash_table *ht, int sock) {
-    printf("--------------------------------------- recv message\n");
+int handle_msg(int sock) {
+    log_debug("--------------------------------------- recv message");
     ssize_t status;
-    char *msg = calloc(1, sizeof *msg);
+    char first;
     struct sockaddr_storage their_addr;
-    socklen_t addr_size;
-    status = recvfrom(sock, msg, 1, MSG_PEEK, (struct sockaddr *)&their_addr, &addr_size);
+    socklen_t addr_size = sizeof their_addr;
+    status = recvfrom(sock, &first, 1, MSG_PEEK, (struct sockaddr *)&their_addr, &addr_size);
+    if (status < 0) {
+        fprintf(stderr, "recvfrom: %s\n", strerror(errno));
+        return -1;
+    }
+    if (status == 0) {
+        /* drop the empty datagram */
+        recv(sock, &first, sizeof first, 0);
+        return -1;
+    }
 
-    if (internal_mask & msg[0]) {
+    if (internal_mask & first) {
         handle_intl_msg(sock);
     } else {
-        handle_ext_msg(ht, sock);
+        handle_ext_msg(sock);
     }
 
-    free(msg);
-    printf("--------------------------------------- end message\n");
+    arena_reset(&msg_arena);
+    log_debug("--------------------------------------- end message");
+}
+
+/* the id of vnode k of the server at addr, spread over the ring */
+uint16_t vnode_id(struct sockaddr_in *addr, int k) {
+    uint64_t x = (uint64_t) ntohl(addr->sin_addr.s_addr) << 32 | (uint64_t) ntohs(addr->sin_port) << 16 | (uint64_t) k;
+    /* splitmix64 finalizer */
+    x ^= x >> 30;
+    x *= UINT64_C(0xbf58476d1ce4e5b9);
+    x ^= x >> 27;
+    x *= UINT64_C(0x94d049bb133111eb);
+    x ^= x >> 31;
+    return (uint16_t) (x ^ x >> 16 ^ x >> 32 ^ x >> 48);
 }
 
+/* set by SIGUSR1, the main loop then prints the keys per vnode */
+static volatile sig_atomic_t print_keys = 0;
+
+void request_print_keys(int sig) {
+    (void) sig;
+    print_keys = 1;
+}
+
+/* set by SIGTERM and SIGINT, the vnodes hand their keys over and the
+ * server exits once that is done */
+static volatile sig_atomic_t leave_requested = 0;
+
+void request_leave(int sig) {
+    (void) sig;
+    leave_requested = 1;
+}
+
+/* the periodic rounds of the main loop */
+typedef struct timer {
+    long interval_ms;
+    long due_ms;
+    void (*fire)(vnode *vn);
+} timer;
+
+static timer timers[] = {
+    { .interval_ms=STABILIZE_MS, .due_ms=0, .fire=stabilize_round },
+    { .interval_ms=CHECK_PREDECESSOR_MS, .due_ms=0, .fire=check_predecessor },
+    { .interval_ms=FIX_FINGERS_MS, .due_ms=0, .fire=fix_fingers },
+    { .interval_ms=HANDOFF_TIMEOUT_MS, .due_ms=0, .fire=handoff_round },
+};
+#define N_TIMERS (sizeof timers / sizeof *timers)
+
 int main(int argc, char **argv) {
     /* maybe we change the interface to this later,
      * printf("usage: %s <ip> <port> --id=<ip> --registration-ip=<reg_ip> --registration-port=<reg_port>\n", argv[0]);
@@ -504,24 +1841,59 @@ int main(int argc, char **argv) {
     char *port = NULL;
     uint16_t id = 0;
     bool create_chord = false;
+    char *trace_path = NULL;
+    bool trace_values = false;
+
+    /* -T <path> records external requests for replay, -V with value hashes,
+     * -F turns the finger tables off, -R relays answers, -v <n> hosts n
+     * virtual nodes with ids derived from the address, -k <n> keeps n
+     * copies of every key */
+    int c;
+    while ((c = getopt(argc, argv, "T:VFRv:k:")) != -1) {
+        if (c == 'T') {
+            trace_path = optarg;
+        } else if (c == 'V') {
+            trace_values = true;
+        } else if (c == 'F') {
+            use_fingers = false;
+        } else if (c == 'R') {
+            relay = true;
+        } else if (c == 'v') {
+            n_vnodes = atoi(optarg);
+            if (n_vnodes < 1 || n_vnodes > MAX_VNODES) {
+                fprintf(stderr, "-v: between 1 and %d virtual nodes\n", MAX_VNODES);
+                return 1;
+            }
+        } else if (c == 'k') {
+            replication = atoi(optarg);
+            if (replication < 1 || replication > MAX_REPLICATION) {
+                fprintf(stderr, "-k: between 1 and %d copies\n", MAX_REPLICATION);
+                return 1;
+            }
+        } else {
+            return 1;
+        }
+    }
+    char **args = argv + optind - 1;
+    int n_args = argc - optind + 1;
 
-    if (argc == 3 || argc == 4) {
-        ip = argv[1];
-        port = argv[2];
+    if (n_args == 3 || n_args == 4) {
+        ip = args[1];
+        port = args[2];
 
-        if (argc == 4) {
-            sscanf(argv[3], "%" SCNu16, &id);
+        if (n_args == 4) {
+            sscanf(args[3], "%" SCNu16, &id);
         }
 
         create_chord = true;
-    } else if (argc == 5 || argc == 6) {
-        ip = argv[1];
-        port = argv[2];
-        registration_ip = argv[3];
-        registration_port = argv[4];
-
-        if (argc == 6) {
-            sscanf(argv[5], "%" SCNu16, &id);
+    } else if (n_args == 5 || n_args == 6) {
+        ip = args[1];
+        port = args[2];
+        registration_ip = args[3];
+        registration_port = args[4];
+
+        if (n_args == 6) {
+            sscanf(args[5], "%" SCNu16, &id);
         }
     } else {
         /* TODO print usage */
@@ -559,28 +1931,156 @@ int main(int argc, char **argv) {
         fprintf(stderr, "bind: %s\n", strerror(errno));
     }
 
-    node.self = malloc(sizeof *(node.self));
     assert(servinfo->ai_addrlen == sizeof(struct sockaddr_in));
-    node.self->address = *((struct sockaddr_in *)servinfo->ai_addr); /* FIXME ugly */
-    node.self->id = htons(id);
+    for (int i = 0; i < n_vnodes; i++) {
+        vnode *vn = &vnodes[i];
+        vn->sock = sock;
+        vn->node.self = &vn->self_info;
+        vn->node.self->address = *((struct sockaddr_in *)servinfo->ai_addr); /* FIXME ugly */
+        vn->node.self->id = htons(id);
+        if (n_vnodes > 1) {
+            /* a hand-picked id stays valid for a single node only */
+            uint16_t vid = vnode_id(&vn->node.self->address, i);
+            for (int j = 0; j < i; j++) {
+                if (vnodes[j].node.self->id == htons(vid)) {
+                    vid++;
+                    j = -1; /* check the new id against all again */
+                }
+            }
+            vn->node.self->id = htons(vid);
+        }
+        vn->tbl = ht_create();
+        vn->replicas = ht_create();
+    }
 
-    if (create_chord) {
-    } else {
-        assert(registration_port != NULL);
-        join(sock, registration_ip, registration_port);
+    /* the first vnode creates the chord or joins it, the others join
+     * through the registration node or the first one */
+    for (int i = 0; i < n_vnodes; i++) {
+        if (!create_chord) {
+            assert(registration_port != NULL);
+            join(&vnodes[i], registration_ip, registration_port);
+        } else if (i > 0) {
+            join(&vnodes[i], ip, port);
+        }
     }
 
-    hash_table *ht = ht_create();
+    struct sigaction sa;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = request_print_keys;
+    sigaction(SIGUSR1, &sa, NULL);
+    sa.sa_handler = request_leave;
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    msg_arena.data = malloc(ARENA_LEN);
+    msg_arena.len = ARENA_LEN;
+    if (msg_arena.data == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return 1;
+    }
+    if (trace_path != NULL) {
+        trace = trace_open(trace_path, trace_values);
+    }
+    /* the debug log of every message stays off the hot path */
+    if (log_open(stdout) == -1) {
+        return 1;
+    }
 
+    bool leaving = false;
+    long leave_ms = 0;
     while (1) {
+        if (leave_requested && !leaving) {
+            leaving = true;
+            leave_ms = now_ms();
+            /* the keys go only once all neighbours know, else they could be
+             * handed back to one of us */
+            for (int i = 0; i < n_vnodes; i++) {
+                leave(&vnodes[i]);
+            }
+            for (int i = 0; i < n_vnodes; i++) {
+                start_handoff(&vnodes[i]);
+            }
+        }
+        if (leaving) {
+            /* a vnode without predecessor waits for one to stabilize it */
+            bool handing_off = false;
+            bool waiting = false;
+            for (int i = 0; i < n_vnodes; i++) {
+                handing_off |= vnodes[i].handoffs[MOVE_HANDOFF].active;
+                waiting |= !vnodes[i].handed_off;
+            }
+            if (!handing_off && (!waiting || now_ms() - leave_ms > SUCCESSOR_TIMEOUT_MS)) {
+                for (int i = 0; i < n_vnodes; i++) {
+                    if (!vnodes[i].handed_off && vnodes[i].tbl->n_elems > 0) {
+                        fprintf(stderr, "leave: no predecessor of id %" PRIu16 ", %zu keys are lost\n",
+                                ntohs(vnodes[i].node.self->id), vnodes[i].tbl->n_elems);
+                    }
+                }
+                break;
+            }
+        }
+
+        /* wait for a message until the next round or the next forwarded
+         * request is due */
+        long now = now_ms();
+        long wake_ms = expire_pending(now);
+        for (size_t i = 0; i < N_TIMERS; i++) {
+            if (now >= timers[i].due_ms) {
+                for (int j = 0; j < n_vnodes; j++) {
+                    timers[i].fire(&vnodes[j]);
+                }
+                timers[i].due_ms = now + timers[i].interval_ms;
+            }
+            if (wake_ms == -1 || timers[i].due_ms < wake_ms) {
+                wake_ms = timers[i].due_ms;
+            }
+        }
+
+        struct pollfd pfd = { .fd=sock, .events=POLLIN, .revents=0 };
+        status = poll(&pfd, 1, 0);
+        if (status == 0) {
+            /* the trace is written while we would wait anyway */
+            if (trace != NULL) {
+                trace_flush(trace);
+            }
+            status = poll(&pfd, 1, (int) (wake_ms - now));
+        }
+        if (print_keys) {
+            print_keys = 0;
+            size_t total = 0;
+            for (int i = 0; i < n_vnodes; i++) {
+                printf("keys: id=%" PRIu16 " n=%zu copies=%zu\n", ntohs(vnodes[i].node.self->id), vnodes[i].tbl->n_elems,
+                        vnodes[i].replicas->n_elems);
+                total += vnodes[i].tbl->n_elems;
+            }
+            printf("keys total: %zu\n", total);
+            fflush(stdout);
+        }
+        if (status < 0) {
+            if (errno != EINTR) {
+                fprintf(stderr, "poll: %s\n", strerror(errno));
+            }
+            continue;
+        } else if (status == 0) {
+            continue;
+        }
+
         /* handle message */
-        handle_msg(ht, sock);
+        handle_msg(sock);
     }
 
-    ht_destroy(ht);
-    free(node.prev);
-    free(node.next);
-    free(node.self);
+    if (trace != NULL) {
+        trace_close(trace);
+    }
+    log_close();
+    for (int i = 0; i < n_vnodes; i++) {
+        ht_destroy(vnodes[i].tbl);
+        ht_destroy(vnodes[i].replicas);
+        for (int j = 0; j < N_HANDOFFS; j++) {
+            free(vnodes[i].handoffs[j].batch);
+        }
+    }
+    free(msg_arena.data);
     close(sock);
     freeaddrinfo(servinfo);
     return 0;
@@ -0,0 +1,144 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <endian.h>
+
+#include "trace.h"
+
+/* records are buffered, trace_flush writes them out */
+#define TRACE_BUF_LEN (1 << 20)
+
+static uint64_t trace_clock_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+/* 64 bit fnv-1a */
+uint64_t trace_hash(const void *data, size_t len) {
+    const unsigned char *p = data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* create a trace at path, with hash_values every value is hashed.
+ * Returns NULL on error */
+trace_writer *trace_open(const char *path, bool hash_values) {
+    trace_writer *t = malloc(sizeof *t);
+    if (t == NULL) {
+        fprintf(stderr, "malloc: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    t->file = fopen(path, "wb");
+    if (t->file == NULL) {
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        free(t);
+        return NULL;
+    }
+    setvbuf(t->file, NULL, _IOFBF, TRACE_BUF_LEN);
+
+    if (fwrite(TRACE_MAGIC, 1, strlen(TRACE_MAGIC), t->file) != strlen(TRACE_MAGIC)) {
+        fprintf(stderr, "fwrite: %s\n", strerror(errno));
+        fclose(t->file);
+        free(t);
+        return NULL;
+    }
+    t->start_ns = trace_clock_ns();
+    t->hash_values = hash_values;
+    return t;
+}
+
+/* record a request arriving now */
+void trace_write(trace_writer *t, uint8_t action, const void *key, uint16_t key_len,
+        const void *value, uint32_t value_len) {
+    char record[TRACE_RECORD_LEN + sizeof (uint64_t)];
+    uint64_t arrival_ns = htole64(trace_clock_ns() - t->start_ns);
+    uint16_t le_key_len = htole16(key_len);
+    uint32_t le_value_len = htole32(value_len);
+    size_t len = TRACE_RECORD_LEN;
+
+    memcpy(record, &arrival_ns, sizeof arrival_ns);
+    record[8] = (char) action;
+    record[9] = t->hash_values ? TRACE_VALUE_HASH : 0;
+    memcpy(record + 10, &le_key_len, sizeof le_key_len);
+    memcpy(record + 12, &le_value_len, sizeof le_value_len);
+    if (t->hash_values) {
+        uint64_t hash = htole64(trace_hash(value, value_len));
+        memcpy(record + len, &hash, sizeof hash);
+        len += sizeof hash;
+    }
+
+    /* a failed write shows up as a short trace, the server keeps going */
+    fwrite(record, 1, len, t->file);
+    fwrite(key, 1, key_len, t->file);
+}
+
+void trace_flush(trace_writer *t) {
+    fflush(t->file);
+}
+
+void trace_close(trace_writer *t) {
+    fclose(t->file);
+    free(t);
+}
+
+/* open a trace for trace_read, returns NULL if it is none */
+FILE *trace_open_read(const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "fopen: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    char magic[sizeof TRACE_MAGIC - 1];
+    if (fread(magic, 1, sizeof magic, file) != sizeof magic || memcmp(magic, TRACE_MAGIC, sizeof magic) != 0) {
+        fprintf(stderr, "trace_open_read: %s is no trace\n", path);
+        fclose(file);
+        return NULL;
+    }
+    return file;
+}
+
+/* read the next record into e, returns 1, 0 at the end of the trace or -1
+ * if the trace is cut off */
+int trace_read(FILE *file, trace_entry *e) {
+    char record[TRACE_RECORD_LEN];
+    size_t n = fread(record, 1, sizeof record, file);
+    if (n == 0) {
+        return 0;
+    }
+    if (n != sizeof record) {
+        return -1;
+    }
+
+    uint64_t arrival_ns;
+    uint16_t key_len;
+    uint32_t value_len;
+    memcpy(&arrival_ns, record, sizeof arrival_ns);
+    memcpy(&key_len, record + 10, sizeof key_len);
+    memcpy(&value_len, record + 12, sizeof value_len);
+    e->arrival_ns = le64toh(arrival_ns);
+    e->action = (uint8_t) record[8];
+    e->flags = (uint8_t) record[9];
+    e->key_len = le16toh(key_len);
+    e->value_len = le32toh(value_len);
+
+    e->value_hash = 0;
+    if (e->flags & TRACE_VALUE_HASH) {
+        uint64_t hash;
+        if (fread(&hash, 1, sizeof hash, file) != sizeof hash) {
+            return -1;
+        }
+        e->value_hash = le64toh(hash);
+    }
+    if (fread(e->key, 1, e->key_len, file) != e->key_len) {
+        return -1;
+    }
+    return 1;
+}
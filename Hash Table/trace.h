@@ -0,0 +1,37 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* a trace file starts with TRACE_MAGIC, every record is the arrival time
+ * in ns since the trace was opened (8 bytes), action (1), flags (1),
+ * key length (2) and value length (4), all little endian, then the
+ * value hash (8) if TRACE_VALUE_HASH is set and the key */
+#define TRACE_MAGIC "KVTRACE1"
+#define TRACE_RECORD_LEN 16
+#define TRACE_VALUE_HASH 1
+
+typedef struct trace_writer {
+    FILE *file;
+    uint64_t start_ns;
+    bool hash_values;
+} trace_writer;
+
+typedef struct trace_entry {
+    uint64_t arrival_ns;
+    uint8_t action;
+    uint8_t flags;
+    uint16_t key_len;
+    uint32_t value_len;
+    uint64_t value_hash; /* 0 unless flags has TRACE_VALUE_HASH */
+    char key[UINT16_MAX];
+} trace_entry;
+
+uint64_t trace_hash(const void *data, size_t len);
+trace_writer *trace_open(const char *path, bool hash_values);
+void trace_write(trace_writer *t, uint8_t action, const void *key, uint16_t key_len,
+        const void *value, uint32_t value_len);
+void trace_flush(trace_writer *t);
+void trace_close(trace_writer *t);
+FILE *trace_open_read(const char *path);
+int trace_read(FILE *file, trace_entry *e);
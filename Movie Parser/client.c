@@ -4,6 +4,8 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <time.h>
+#include <endian.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -25,14 +27,25 @@
 #define HEADER_LEN 6
 /* maximum length of a package */
 #define MAX_REQUEST_LEN (HEADER_LEN + 2*MAX_LEN)
+/* maximum length of the requests carried by one batch frame */
+#define MAX_BATCH_LEN 0xFFFF
 
 /* bitmasks fro action */
 uint8_t DEL = 1;
 uint8_t SET = 1 << 1;
 uint8_t GET = 1 << 2;
+uint8_t BATCH = 1 << 4;
+/* a command frame that wraps a set or delete, so the server executes it
+ * once however often it is retried */
+uint8_t IDEMPOTENT = 0x80 | 0x12;
+/* length of the client id and request id of an idempotent request */
+#define IDS_LEN 16
 
 /* 2 seconds timeout */
 uint8_t transaction_id = 0;
+/* identifies this client and its sets and deletes across retries */
+uint64_t client_id;
+uint64_t request_id = 0;
 
 typedef struct {
     char *title;
@@ -78,6 +91,7 @@ hash_table *ht_create(char *domain_name, char *port) {
 
     hash_table *ht = malloc(sizeof *ht);
     ht->servinfo = servinfo;
+    client_id = ((uint64_t) getpid() << 32) ^ (uint64_t) time(NULL);
     return ht;
 }
 
@@ -145,6 +159,31 @@ int perform_action(hash_table *ht, uint8_t action, char *key, char **val, film *
     int request_len;
     char *request = build_request(action, key, val, &request_len);
 
+    /* sets and deletes are wrapped with ids that stay the same for all
+     * retries, the server answers a retry from its cache */
+    int wrapped = !(action & GET);
+    if (wrapped) {
+        char *inner = request;
+        uint16_t num;
+        uint64_t id;
+        request_id++;
+
+        request = malloc(HEADER_LEN + IDS_LEN + request_len);
+        request[0] = IDEMPOTENT;
+        request[1] = transaction_id;
+        num = htons(IDS_LEN);
+        memcpy(request + 2, &num, sizeof num);
+        num = htons(request_len);
+        memcpy(request + 4, &num, sizeof num);
+        id = htobe64(client_id);
+        memcpy(request + HEADER_LEN, &id, sizeof id);
+        id = htobe64(request_id);
+        memcpy(request + HEADER_LEN + sizeof id, &id, sizeof id);
+        memcpy(request + HEADER_LEN + IDS_LEN, inner, request_len);
+        request_len += HEADER_LEN + IDS_LEN;
+        free(inner);
+    }
+
     struct timeval timeout;
     timeout.tv_sec = TIMEOUT;
     timeout.tv_usec = 0;
@@ -169,6 +208,17 @@ int perform_action(hash_table *ht, uint8_t action, char *key, char **val, film *
             goto retry;
         }
 
+        /* the response to the wrapped request follows the ids */
+        if (wrapped) {
+            char ids[IDS_LEN];
+            memcpy(&num, msg_buffer + 2, sizeof num);
+            if (ntohs(num) != IDS_LEN
+                    || recv(sock, ids, sizeof ids, MSG_WAITALL) != IDS_LEN
+                    || recv(sock, msg_buffer, sizeof msg_buffer, MSG_WAITALL) != HEADER_LEN) {
+                goto retry;
+            }
+        }
+
         /* if the acknowledment of the server does not contain the
          * action we want to perform, we retry the request */
         char action_performed = msg_buffer[0] & action;
@@ -266,6 +316,100 @@ int ht_delete(hash_table *ht, char *key) {
     return status;
 }
 
+/* send a batch frame carrying n_ops requests in body and check that every
+ * operation was acknowledged. Retry like perform_action. */
+int perform_batch(hash_table *ht, char *body, uint16_t body_len, uint16_t n_ops) {
+    char header[HEADER_LEN];
+    uint16_t num;
+    header[0] = BATCH;
+    header[1] = transaction_id;
+    num = htons(n_ops);
+    memcpy(header + 2, &num, sizeof num);
+    num = htons(body_len);
+    memcpy(header + 4, &num, sizeof num);
+
+    struct timeval timeout;
+    timeout.tv_sec = TIMEOUT;
+    timeout.tv_usec = 0;
+
+    for (int i = 0; i < RETRIES; i++) {
+        int sock = socket(ht->servinfo->ai_family, ht->servinfo->ai_socktype, ht->servinfo->ai_protocol);
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof timeout);
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout);
+
+        if (connect(sock, ht->servinfo->ai_addr, ht->servinfo->ai_addrlen) < 0) {
+            goto retry;
+        }
+
+        if (send(sock, header, sizeof header, MSG_MORE) < 0 || send(sock, body, body_len, 0) < 0) {
+            goto retry;
+        }
+
+        char msg_buffer[HEADER_LEN];
+        if (recv(sock, msg_buffer, sizeof msg_buffer, MSG_WAITALL) != HEADER_LEN || !(msg_buffer[0] & BATCH)) {
+            goto retry;
+        }
+
+        /* one ordinary response per operation, sets carry no key or value */
+        int n_acked = 0;
+        for (uint16_t j = 0; j < n_ops; j++) {
+            if (recv(sock, msg_buffer, sizeof msg_buffer, MSG_WAITALL) != HEADER_LEN) {
+                goto retry;
+            }
+            if (msg_buffer[0] & SET) {
+                n_acked++;
+            }
+        }
+        if (n_acked != n_ops) {
+            goto retry;
+        }
+
+        /* success */
+        close(sock);
+        transaction_id++;
+        return 0;
+
+retry:
+        close(sock);
+        continue;
+    }
+
+    transaction_id++;
+    return -1;
+}
+
+/* rpc-interface for a set of n films, the requests are packed into as few
+ * batch frames as possible, so this takes one round trip per frame
+ * if result < 0 error */
+int ht_mset(hash_table *ht, film **fs, int n) {
+    char *body = malloc(MAX_BATCH_LEN);
+    uint16_t body_len = 0;
+    uint16_t n_ops = 0;
+    int status = 0;
+
+    for (int i = 0; i < n; i++) {
+        int request_len;
+        char *request = build_request(SET, fs[i]->title, fs[i]->fields, &request_len);
+        if (request_len > MAX_BATCH_LEN - body_len) {
+            status |= perform_batch(ht, body, body_len, n_ops);
+            body_len = 0;
+            n_ops = 0;
+        }
+        assert(request_len <= MAX_BATCH_LEN);
+        memcpy(body + body_len, request, request_len);
+        body_len += request_len;
+        n_ops++;
+        free(request);
+    }
+
+    if (n_ops > 0) {
+        status |= perform_batch(ht, body, body_len, n_ops);
+    }
+
+    free(body);
+    return status;
+}
+
 /* free a film struct */
 void film_destroy(film *f) {
     free(f->title);
@@ -351,17 +495,23 @@ int main(int argc, char *argv[]) {
     assert(n_films <= MAX_FILMS);
 
     hash_table *ht = ht_create(argv[1], argv[2]);
+
+    /* load all films at once */
+    if (ht_mset(ht, films, n_films) < 0) {
+        printf("could not perform set operation for all %d films\n", n_films);
+    } else {
+        printf("set operation successfull for all %d films\n", n_films);
+    }
+
     for (int i = 0; i < N_FILMS; i++) {
         int status;
         film *f = films[i % n_films];
         printf("--------------------------------------\n");
-        printf("perform get,set,delete,get for film %s\n", f->title);
+        printf("perform get,delete,get for film %s\n", f->title);
 
-        status = ht_set(ht, f->title, f->fields);
-        if (status < 0) {
+        /* the film was deleted in an earlier round */
+        if (i >= n_films && ht_set(ht, f->title, f->fields) < 0) {
             printf("could not perform set operation for film %s\n", f->title);
-        } else {
-            printf("set operation successfull for film %s\n", f->title);
         }
 
         film *f_remote;
@@ -24,7 +24,7 @@ long timediff(struct timespec start, struct timespec end) {
     long sec_diff = end.tv_sec - start.tv_sec;
     long nsec_diff = end.tv_nsec - start.tv_nsec;
     /* 1000000000 ns = 1s*/
-    return sec_diff/1000000000 + nsec_diff;
+    return sec_diff * 1000000000 + nsec_diff;
 }
 
 int send_msg(int sock, struct addrinfo *servinfo, uint8_t action, char *key, char *val) {
@@ -148,12 +148,12 @@ int main(int argc, char **argv) {
     struct timespec start, end;
 
     //1. time stamp after request transmition
-    clock_gettime(CLOCK_REALTIME, &start);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
     recv_msg(sock);
 
     //2. time stamp
-    clock_gettime(CLOCK_REALTIME, &end);
+    clock_gettime(CLOCK_MONOTONIC, &end);
     printf("The DHT request needed: %ld Nanoseconds.\n", timediff(start, end));
 
     freeaddrinfo(servinfo);